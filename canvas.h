@@ -0,0 +1,498 @@
+#ifndef _CANVAS_H_
+#define _CANVAS_H_
+
+/**
+ * The image in memory that blocks are drawn to, for all output formats. Only the pixel format differs,
+ * so the drawing code below is compiled once per format with constant strides.
+ * draw.cpp, draw_png.cpp and draw_pyramid.cpp keep their canvases and move them to and from their files
+ */
+
+#include "helper.h"
+#include "colors.h"
+#include "globals.h"
+#include <cstring>
+#include <cstdlib>
+
+// Pixel formats: bytes per pixel, where the format's byte order starts in colors[], how to blend
+struct PixelBgr {
+	// 24bpp as in a bitmap. There's no alpha in the image, so translucent pixels just mix with what's there
+	enum { BYTES = 3, COLOROFFSET = 0 };
+	static inline void blend(uint8_t *destination, const uint8_t *source)
+	{
+		const float v2 = (float(source[ALPHA]) / 255.0f);
+		const float v1 = (1.0f - v2);
+		destination[0] = uint8_t(float(destination[0]) * v1 + float(source[0]) * v2);
+		destination[1] = uint8_t(float(destination[1]) * v1 + float(source[1]) * v2);
+		destination[2] = uint8_t(float(destination[2]) * v1 + float(source[2]) * v2);
+	}
+	static inline void fromBgra(uint8_t *destination, const uint8_t *bgra)
+	{
+		memcpy(destination, bgra, 4);
+	}
+};
+
+struct PixelRgb {
+	// 24bpp as in a tiff; same as PixelBgr, but red first
+	enum { BYTES = 3, COLOROFFSET = PRED };
+	static inline void blend(uint8_t *destination, const uint8_t *source)
+	{
+		PixelBgr::blend(destination, source);
+	}
+	static inline void fromBgra(uint8_t *destination, const uint8_t *bgra)
+	{
+		destination[0] = bgra[RED];
+		destination[1] = bgra[GREEN];
+		destination[2] = bgra[BLUE];
+		destination[3] = bgra[ALPHA];
+	}
+};
+
+struct PixelRgba {
+	// 32bpp as in a png, the image is transparent where nothing was drawn
+	enum { BYTES = 4, COLOROFFSET = PRED };
+	static inline void blend(uint8_t *destination, const uint8_t *source)
+	{
+		if (destination[ALPHA] == 0 || source[ALPHA] == 255) {
+			memcpy(destination, source, 4);
+			return;
+		}
+#		define BLEND(ca,aa,cb) uint8_t(((size_t(ca) * size_t(aa)) + (size_t(255 - aa) * size_t(cb))) / 255)
+		destination[0] = BLEND(source[0], source[ALPHA], destination[0]);
+		destination[1] = BLEND(source[1], source[ALPHA], destination[1]);
+		destination[2] = BLEND(source[2], source[ALPHA], destination[2]);
+		destination[ALPHA] += (size_t(source[ALPHA]) * size_t(255 - destination[ALPHA])) / 255;
+#		undef BLEND
+	}
+	static inline void fromBgra(uint8_t *destination, const uint8_t *bgra)
+	{
+		destination[0] = bgra[RED];
+		destination[1] = bgra[GREEN];
+		destination[2] = bgra[BLUE];
+		destination[3] = bgra[ALPHA];
+	}
+};
+
+// Where the pixels are; the same for all formats, so the code moving a canvas to and from a file can be shared
+class CanvasBase {
+public:
+	// Rows top to bottom, lineWidth bytes each (negative if they are stored bottom up). offsetX/offsetY
+	// are added to all coordinates drawn to, for parts of the image that start outside of it
+	uint8_t *buffer;
+	int width, height, lineWidth;
+	int offsetX, offsetY;
+
+	CanvasBase() : buffer(NULL), width(0), height(0), lineWidth(0), offsetX(0), offsetY(0) {}
+	// Start of row y; offsets are 64 bit, as the image can be bigger than 2GiB
+	inline uint8_t *row(const int y)
+	{
+		return buffer + ptrdiff_t(y) * lineWidth;
+	}
+};
+
+template <class Format>
+class Canvas : public CanvasBase {
+public:
+	Canvas() : _tile(NULL), _tileImage(NULL), _tileSize(0) {}
+
+	void setPixel(const size_t x, const size_t y, const uint8_t color, const float fsub);
+	void blendPixel(const size_t x, const size_t y, const uint8_t color, const float fsub);
+	void drawLine(const size_t x, const size_t y, const size_t count, const uint8_t *colors, const uint8_t *ops);
+	void beginTile(const int x, const int y, const int width, const int height);
+	void endTile();
+	void clear(const int x, const int y, const int width, const int height);
+
+private:
+	// Tile currently drawn to (see beginTile), and what the canvas was before
+	uint8_t *_tile, *_tileImage;
+	int _tileSize, _tileX, _tileY, _tileWidth, _tileHeight, _tileImageLineWidth, _tileOffsetX, _tileOffsetY;
+
+	// One routine per block shape (colors[block][SHAPE]), so setPixel won't be one hell of a mess
+	typedef void (Canvas::*ShapeFunc)(const size_t x, const size_t y, const uint8_t block, const uint8_t *color, const int sub);
+	static const ShapeFunc _shapes[SHAPE_COUNT];
+
+	inline uint8_t *pixel(const size_t x, const size_t y)
+	{
+		return buffer + (int(x) + offsetX) * Format::BYTES + ptrdiff_t(int(y) + offsetY) * lineWidth;
+	}
+	inline void copy(uint8_t *destination, const uint8_t *source)
+	{
+		memcpy(destination, source, Format::BYTES);
+	}
+	void copyTile(const bool toImage);
+
+	static inline void modColor(uint8_t *color, const int mod)
+	{
+		color[0] = clamp(color[0] + mod);
+		color[1] = clamp(color[1] + mod);
+		color[2] = clamp(color[2] + mod);
+	}
+	static inline void addColor(uint8_t *color, const uint8_t *add)
+	{
+		const float v2 = (float(add[ALPHA]) / 255.0f);
+		const float v1 = (1.0f - (v2 * .2f));
+		color[0] = clamp(uint16_t(float(color[0]) * v1 + float(add[0]) * v2));
+		color[1] = clamp(uint16_t(float(color[1]) * v1 + float(add[1]) * v2));
+		color[2] = clamp(uint16_t(float(color[2]) * v1 + float(add[2]) * v2));
+	}
+	static inline void sideColors(const uint8_t *color, uint8_t *light, uint8_t *dark)
+	{	// Shaded down versions of the color for the sides of blocks
+		memcpy(light, color, 4);
+		memcpy(dark, color, 4);
+		modColor(light, -17);
+		modColor(dark, -27);
+	}
+	static inline int noiseStrength(const uint8_t block, const uint8_t *color)
+	{	// In case the user wants noise, depending on the desired intensity and the block's brightness
+		if (g_Noise && colors[block][NOISE]) {
+			return int(float(g_Noise * colors[block][NOISE]) * (float(GETBRIGHTNESS(color) + 10) / 2650.0f));
+		}
+		return 0;
+	}
+
+	void setCube(const size_t x, const size_t y, const uint8_t block, const uint8_t *color, const int sub);
+	void setGrass(const size_t x, const size_t y, const uint8_t block, const uint8_t *color, const int sub);
+	void setSnow(const size_t x, const size_t y, const uint8_t block, const uint8_t *color, const int sub);
+	void setTorch(const size_t x, const size_t y, const uint8_t block, const uint8_t *color, const int sub);
+	void setFlower(const size_t x, const size_t y, const uint8_t block, const uint8_t *color, const int sub);
+	void setFence(const size_t x, const size_t y, const uint8_t block, const uint8_t *color, const int sub);
+	void setFire(const size_t x, const size_t y, const uint8_t block, const uint8_t *color, const int sub);
+	void setStep(const size_t x, const size_t y, const uint8_t block, const uint8_t *color, const int sub);
+};
+
+template <class Format>
+const typename Canvas<Format>::ShapeFunc Canvas<Format>::_shapes[SHAPE_COUNT] = {
+	&Canvas::setCube, &Canvas::setGrass, &Canvas::setSnow, &Canvas::setTorch,
+	&Canvas::setFlower, &Canvas::setFence, &Canvas::setFire, &Canvas::setStep
+};
+
+template <class Format>
+void Canvas<Format>::setPixel(const size_t x, const size_t y, const uint8_t color, const float fsub)
+{
+	// Sets pixels around x,y where A is the anchor
+	// T = given color, D = darker, L = lighter
+	// A T T T
+	// D D L L
+	// D D L L
+	//	  D L
+	// First determine how much the color has to be lightened up or darkened
+	const int sub = int(fsub * (float(colors[color][BRIGHTNESS]) / 323.0f + .21f)); // The brighter the color, the stronger the impact
+	uint8_t c[4];
+	// Now make a local copy of the color that we can modify just for this one block
+	memcpy(c, colors[color] + Format::COLOROFFSET, 4);
+	modColor(c, sub);
+	// Then draw it the way its shape needs it
+	(this->*_shapes[colors[color][SHAPE]])(x, y, color, c, sub);
+}
+
+template <class Format>
+void Canvas<Format>::blendPixel(const size_t x, const size_t y, const uint8_t color, const float fsub)
+{	// This one is used for cave overlay
+	// Sets pixels around x,y where A is the anchor
+	// T = given color, D = darker, L = lighter
+	// A T T T
+	// D D L L
+	// D D L L
+	//	  D L
+	uint8_t L[4], D[4], c[4];
+	// Now make a local copy of the color that we can modify just for this one block
+	memcpy(c, colors[color] + Format::COLOROFFSET, 4);
+	c[ALPHA] = clamp(int(float(c[ALPHA]) * fsub)); // The brighter the color, the stronger the impact
+	sideColors(c, L, D);
+	const int noise = noiseStrength(color, c);
+	// Top row
+	uint8_t *pos = pixel(x, y);
+	for (size_t i = 0; i < 4; ++i, pos += Format::BYTES) {
+		Format::blend(pos, c);
+		if (noise) modColor(pos, rand() % (noise * 2) - noise);
+	}
+	// Second row
+	pos = pixel(x, y+1);
+	for (size_t i = 0; i < 4; ++i, pos += Format::BYTES) {
+		Format::blend(pos, (i < 2 ? D : L));
+		if (noise) modColor(pos, rand() % (noise * 2) - noise * (i == 0 || i == 3 ? 1 : 2));
+	}
+	/*
+	// Third row
+	pos = pixel(x, y+2);
+	for (size_t i = 0; i < 4; ++i, pos += Format::BYTES) {
+		addColor(pos, (i < 2 ? D : L));
+		if (noise) modColor(pos, rand() % (noise * 2) - noise * (i == 0 || i == 3 ? 2 : 1));
+	}
+	// Last row
+	pos = pixel(x, y+3);
+	addColor(pos+=Format::BYTES, D);
+	if (noise) modColor(pos, -(rand() % noise) * 2);
+	addColor(pos+=Format::BYTES, L);
+	if (noise) modColor(pos, -(rand() % noise) * 2);
+	*/
+}
+
+template <class Format>
+void Canvas<Format>::drawLine(const size_t x, const size_t y, const size_t count, const uint8_t *colors, const uint8_t *ops)
+{
+	// Draw a line of single pixels, as calculated by the deferred shader
+	// colors are BGRA, 4 bytes per pixel, ops tell what to do: 0 = leave alone, 1 = replace, n = blend n-1 times
+	uint8_t *pos = pixel(x, y);
+	for (size_t i = 0; i < count; ++i, pos += Format::BYTES, colors += 4) {
+		if (ops[i] == 0) continue;
+		uint8_t c[4];
+		Format::fromBgra(c, colors);
+		if (ops[i] == 1) {
+			copy(pos, c);
+		} else {
+			for (uint8_t j = 1; j < ops[i]; ++j) Format::blend(pos, c);
+		}
+	}
+}
+
+template <class Format>
+void Canvas<Format>::beginTile(const int x, const int y, const int width, const int height)
+{
+	// Redirect drawing to a small buffer for the area x,y - x+width,y+height, which stays in the cache while it's drawn to.
+	// Coordinates are relative to x-TILE_MARGIN,y-TILE_MARGIN until endTile(); whatever ends up in the margin is lost
+	const int tileWidth = width + TILE_MARGIN * 2, tileHeight = height + TILE_MARGIN * 2;
+	if (_tileSize < tileWidth * Format::BYTES * tileHeight) {
+		delete[] _tile;
+		_tileSize = tileWidth * Format::BYTES * tileHeight;
+		_tile = new uint8_t[_tileSize];
+	}
+	_tileX = x;
+	_tileY = y;
+	_tileWidth = width;
+	_tileHeight = height;
+	_tileImage = buffer;
+	_tileImageLineWidth = lineWidth;
+	_tileOffsetX = offsetX;
+	_tileOffsetY = offsetY;
+	copyTile(false);
+	buffer = _tile;
+	lineWidth = tileWidth * Format::BYTES;
+	offsetX = offsetY = 0;
+}
+
+template <class Format>
+void Canvas<Format>::endTile()
+{
+	buffer = _tileImage;
+	lineWidth = _tileImageLineWidth;
+	offsetX = _tileOffsetX;
+	offsetY = _tileOffsetY;
+	copyTile(true);
+}
+
+template <class Format>
+void Canvas<Format>::copyTile(const bool toImage)
+{
+	// Copy the inner part of the tile from or to the image, as far as it is inside the image
+	const int fromX = MAX(_tileX, -_tileOffsetX), toX = MIN(_tileX + _tileWidth, width - _tileOffsetX);
+	const int fromY = MAX(_tileY, -_tileOffsetY), toY = MIN(_tileY + _tileHeight, height - _tileOffsetY);
+	if (fromX >= toX) return;
+	const int tileLineWidth = (_tileWidth + TILE_MARGIN * 2) * Format::BYTES;
+	for (int y = fromY; y < toY; ++y) {
+		uint8_t *image = _tileImage + (fromX + _tileOffsetX) * Format::BYTES + ptrdiff_t(y + _tileOffsetY) * _tileImageLineWidth;
+		uint8_t *tile = _tile + (fromX - _tileX + TILE_MARGIN) * Format::BYTES + (y - _tileY + TILE_MARGIN) * tileLineWidth;
+		if (toImage) {
+			memcpy(image, tile, (toX - fromX) * Format::BYTES);
+		} else {
+			memcpy(tile, image, (toX - fromX) * Format::BYTES);
+		}
+	}
+}
+
+template <class Format>
+void Canvas<Format>::clear(const int x, const int y, const int width, const int height)
+{
+	// Back to the transparent background, as far as the area is on the canvas
+	const int fromX = MAX(x + offsetX, 0), toX = MIN(x + offsetX + width, this->width);
+	const int fromY = MAX(y + offsetY, 0), toY = MIN(y + offsetY + height, this->height);
+	for (int py = fromY; py < toY; ++py) {
+		memset(row(py) + fromX * Format::BYTES, 0, size_t(toX - fromX) * Format::BYTES);
+	}
+}
+
+template <class Format>
+void Canvas<Format>::setCube(const size_t x, const size_t y, const uint8_t block, const uint8_t *c, const int sub)
+{
+	uint8_t L[4], D[4];
+	sideColors(c, L, D);
+	const int noise = noiseStrength(block, c);
+	// Ordinary blocks are all rendered the same way
+	if (c[ALPHA] == 255) { // Fully opaque - faster
+		// Top row
+		uint8_t *pos = pixel(x, y);
+		for (size_t i = 0; i < 4; ++i, pos += Format::BYTES) {
+			copy(pos, c);
+			if (noise) modColor(pos, rand() % (noise * 2) - noise);
+		}
+		// Second row
+		pos = pixel(x, y+1);
+		for (size_t i = 0; i < 4; ++i, pos += Format::BYTES) {
+			copy(pos, (i < 2 ? D : L));
+			// The weird check here is to get the pattern right, as the noise should be stronger
+			// every other row, but take into account the isometric perspective
+			if (noise) modColor(pos, rand() % (noise * 2) - noise * (i == 0 || i == 3 ? 1 : 2));
+		}
+		// Third row
+		pos = pixel(x, y+2);
+		for (size_t i = 0; i < 4; ++i, pos += Format::BYTES) {
+			copy(pos, (i < 2 ? D : L));
+			if (noise) modColor(pos, rand() % (noise * 2) - noise * (i == 0 || i == 3 ? 2 : 1));
+		}
+		// Last row
+		pos = pixel(x, y+3);
+		copy(pos+=Format::BYTES, D);
+		if (noise) modColor(pos, -(rand() % noise) * 2);
+		copy(pos+=Format::BYTES, L);
+		if (noise) modColor(pos, -(rand() % noise) * 2);
+	} else { // Not opaque, use slower blending code
+		// Top row
+		uint8_t *pos = pixel(x, y);
+		for (size_t i = 0; i < 4; ++i, pos += Format::BYTES) {
+			Format::blend(pos, c);
+			if (noise) modColor(pos, rand() % (noise * 2) - noise);
+		}
+		// Second row
+		pos = pixel(x, y+1);
+		for (size_t i = 0; i < 4; ++i, pos += Format::BYTES) {
+			Format::blend(pos, (i < 2 ? D : L));
+			if (noise) modColor(pos, rand() % (noise * 2) - noise * (i == 0 || i == 3 ? 1 : 2));
+		}
+		// Third row
+		pos = pixel(x, y+2);
+		for (size_t i = 0; i < 4; ++i, pos += Format::BYTES) {
+			Format::blend(pos, (i < 2 ? D : L));
+			if (noise) modColor(pos, rand() % (noise * 2) - noise * (i == 0 || i == 3 ? 2 : 1));
+		}
+		// Last row
+		pos = pixel(x, y+3);
+		Format::blend(pos+=Format::BYTES, D);
+		if (noise) modColor(pos, -(rand() % noise) * 2);
+		Format::blend(pos+=Format::BYTES, L);
+		if (noise) modColor(pos, -(rand() % noise) * 2);
+	}
+}
+
+template <class Format>
+void Canvas<Format>::setGrass(const size_t x, const size_t y, const uint8_t block, const uint8_t *color, const int sub)
+{	// this will make grass look like dirt from the side
+	uint8_t light[4], dark[4], L[4], D[4];
+	sideColors(color, light, dark);
+	memcpy(L, colors[DIRT] + Format::COLOROFFSET, 4);
+	memcpy(D, colors[DIRT] + Format::COLOROFFSET, 4);
+	modColor(L, sub - 15);
+	modColor(D, sub - 25);
+	const int noise = noiseStrength(block, color);
+	// Top row
+	uint8_t *pos = pixel(x, y);
+	for (size_t i = 0; i < 4; ++i, pos += Format::BYTES) {
+		copy(pos, color);
+		if (noise) modColor(pos, rand() % (noise * 2) - noise);
+	}
+	// Second row
+	pos = pixel(x, y+1);
+	copy(pos, dark);
+	copy(pos+Format::BYTES, dark);
+	copy(pos+Format::BYTES*2, light);
+	copy(pos+Format::BYTES*3, light);
+	// Third row
+	pos = pixel(x, y+2);
+	copy(pos, D);
+	copy(pos+Format::BYTES, D);
+	copy(pos+Format::BYTES*2, L);
+	copy(pos+Format::BYTES*3, L);
+	// Last row
+	pos = pixel(x, y+3);
+	copy(pos+Format::BYTES, D);
+	copy(pos+Format::BYTES*2, L);
+}
+
+template <class Format>
+void Canvas<Format>::setSnow(const size_t x, const size_t y, const uint8_t block, const uint8_t *color, const int sub)
+{
+	// Top row (second row)
+	uint8_t *pos = pixel(x, y+1);
+	for (size_t i = 0; i < 4; ++i, pos += Format::BYTES) {
+		copy(pos, color);
+	}
+	/*
+	// Third row
+	// This gives you white edges on height diffs, but I think
+	// the current way looks closer to ingame, although trees
+	// turn out a little prettier when using this imo
+	pos = pixel(x, y+2);
+	copy(pos, D);
+	copy(pos+Format::BYTES, D);
+	copy(pos+Format::BYTES*2, L);
+	copy(pos+Format::BYTES*3, L);
+	*/
+}
+
+template <class Format>
+void Canvas<Format>::setTorch(const size_t x, const size_t y, const uint8_t block, const uint8_t *color, const int sub)
+{ // Maybe the orientation should be considered when drawing, but it probably isn't worth the efford
+	copy(pixel(x+2, y+1), color);
+	copy(pixel(x+2, y+2), color);
+}
+
+template <class Format>
+void Canvas<Format>::setFlower(const size_t x, const size_t y, const uint8_t block, const uint8_t *color, const int sub)
+{
+	uint8_t *pos = pixel(x, y+1);
+	copy(pos+Format::BYTES, color);
+	copy(pos+Format::BYTES*3, color);
+	copy(pixel(x+2, y+2), color);
+	copy(pixel(x+1, y+3), color);
+}
+
+template <class Format>
+void Canvas<Format>::setFence(const size_t x, const size_t y, const uint8_t block, const uint8_t *color, const int sub)
+{
+	// First row
+	uint8_t *pos = pixel(x, y);
+	Format::blend(pos, color);
+	Format::blend(pos+Format::BYTES, color);
+	// Second row
+	Format::blend(pixel(x, y+1), color);
+	// Third row
+	pos = pixel(x, y+2);
+	Format::blend(pos, color);
+	Format::blend(pos+Format::BYTES, color);
+	// Last row
+	Format::blend(pixel(x, y+3), color);
+}
+
+template <class Format>
+void Canvas<Format>::setFire(const size_t x, const size_t y, const uint8_t block, const uint8_t *color, const int sub)
+{	// This basically just leaves out a few pixels
+	uint8_t light[4], dark[4];
+	sideColors(color, light, dark);
+	// Top row
+	uint8_t *pos = pixel(x, y);
+	Format::blend(pos, color);
+	Format::blend(pos+Format::BYTES*2, color);
+	// Second and third row
+	for (size_t i = 1; i < 3; ++i) {
+		pos = pixel(x, y+i);
+		Format::blend(pos, dark);
+		Format::blend(pos+Format::BYTES*i, dark);
+		Format::blend(pos+Format::BYTES*3, light);
+	}
+	// Last row
+	Format::blend(pixel(x+2, y+3), light);
+}
+
+template <class Format>
+void Canvas<Format>::setStep(const size_t x, const size_t y, const uint8_t block, const uint8_t *color, const int sub)
+{
+	uint8_t light[4], dark[4];
+	sideColors(color, light, dark);
+	uint8_t *pos = pixel(x, y+2);
+	for (size_t i = 0; i < 4; ++i, pos += Format::BYTES) {
+		copy(pos, color);
+	}
+	pos = pixel(x, y+3);
+	copy(pos+Format::BYTES, dark);
+	copy(pos+Format::BYTES*2, light);
+}
+
+#endif
@@ -26,7 +26,7 @@
 			double(b * b) * .163); \
 } while (false)
 
-// Byte order is: blue green red alpha noise brightness
+// Byte order is: blue green red alpha noise brightness shape
 // Brightness is used to speed up calculations later
 uint8_t colors[256][16];
 
@@ -113,6 +113,14 @@ void loadColors()
 	SETCOLOR(83, 183,234,150,255);
 	SETCOLOR(84, 100,67,50,255);
 	SETCOLOR(FENCE, 137,112,65,225); // Not fully opaque to prevent culling on this one
+	// Everything else is a cube
+	colors[GRASS][SHAPE] = SHAPE_GRASS;
+	colors[SNOW][SHAPE] = SHAPE_SNOW;
+	colors[TORCH][SHAPE] = colors[REDTORCH_ON][SHAPE] = colors[REDTORCH_OFF][SHAPE] = SHAPE_TORCH;
+	colors[FLOWERR][SHAPE] = colors[FLOWERY][SHAPE] = colors[MUSHROOMB][SHAPE] = colors[MUSHROOMR][SHAPE] = SHAPE_FLOWER;
+	colors[FENCE][SHAPE] = SHAPE_FENCE;
+	colors[FIRE][SHAPE] = SHAPE_FIRE;
+	colors[STEP][SHAPE] = SHAPE_STEP;
 }
 
 
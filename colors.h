@@ -9,7 +9,7 @@
 			double(1[c] * 1[c]) * .601 + \
 			double(0[c] * 0[c]) * .163)
 
-// Byte order is: blue green red alpha noise brightness
+// Byte order is: blue green red alpha noise brightness shape
 // Brightness is used to speed up calculations later
 extern uint8_t colors[256][16];
 #define BLUE 0
@@ -18,11 +18,23 @@ extern uint8_t colors[256][16];
 #define ALPHA 3
 #define NOISE 4
 #define BRIGHTNESS 5
+#define SHAPE 6
 #define PRED 8
 #define PGREEN 9
 #define PBLUE 10
 #define PALPHA 11
 
+// How a block is drawn, set by loadColors(). The canvas (canvas.h) has one routine per shape
+#define SHAPE_CUBE 0
+#define SHAPE_GRASS 1 // Cube with dirt on the sides
+#define SHAPE_SNOW 2 // Thin layer on top of the block below
+#define SHAPE_TORCH 3
+#define SHAPE_FLOWER 4 // Flowers and mushrooms
+#define SHAPE_FENCE 5
+#define SHAPE_FIRE 6
+#define SHAPE_STEP 7 // Half a block
+#define SHAPE_COUNT 8
+
 void loadColors();
 bool loadColorsFromFile(const char* file);
 bool dumpColorsToFile(const char* file);
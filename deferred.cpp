@@ -0,0 +1,319 @@
+/**
+ * Deferred shading: Rasterising blocks only records what ends up in each pixel (G-buffer),
+ * turning that into colors happens in a separate pass afterwards.
+ */
+
+#include "deferred.h"
+#include "helper.h"
+#include "colors.h"
+#include "globals.h"
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+
+// Max number of fragments kept per pixel; one opaque one plus translucent ones on top of it
+#define LAYERS 3
+
+// What part of the block a pixel shows (stored in bits 3-5 of the fragment flags)
+#define FACE_TOP 1
+#define FACE_DARK 2
+#define FACE_LIGHT 3
+#define FACE_DIRTDARK 4
+#define FACE_DIRTLIGHT 5
+// Noise pattern of that pixel (bits 6-7)
+#define NOISE_ONE 1
+#define NOISE_TWO 2
+#define NOISE_BOTTOM 3
+// Pixel replaces whatever was there before instead of being blended
+#define OP_COPY 0x80
+
+#define GBPIXEL(layout) ((layout) & 0x7F)
+#define GBFACE(flags) (((flags) >> 3) & 7)
+#define GBNOISE(flags) ((flags) >> 6)
+
+namespace {
+	struct Fragment {
+		uint8_t block, y, light, flags; // light: lower nibble block light, upper nibble sky light
+		uint8_t repeat; // Translucent blocks of the same type behind each other (water...) share one fragment
+	};
+
+	uint8_t *gCount = NULL; // Number of fragments per pixel, bit 7 set if the first one is opaque
+	Fragment *gFragments = NULL;
+	size_t gWidth = 0, gHeight = 0, gMapHeight = 0;
+	int gOffsetX = 0, gOffsetY = 0;
+
+	// Sprite layout per block type, for each of the 4x4 pixels: face | noise << 3 | OP_COPY, 0 = not drawn
+	// This has to match what the canvas (canvas.h) does for each block shape
+	uint8_t gLayout[256][16];
+
+	inline void modColor(uint8_t* color, const int mod);
+	void initLayout();
+	void shadeFragment(const Fragment &f, const size_t x, const size_t y, const float *yBrightness, uint8_t *out);
+}
+
+float shadeBrightness(const size_t y, const int light, const bool edge)
+{	// light < 0 means no light is used for this block
+	//float col = float(y) * .78f - 91;
+	float brightnessAdjustment = (100.0f/(1.0f+exp(-(1.3f * float(y) / 16.0f)+6.0f))) - 91; // thx Donkey Kong
+	if (g_BlendUnderground) brightnessAdjustment -= 168;
+	if (light >= 0) {
+		if (!g_Skylight) { // Night
+			brightnessAdjustment -= (125 - light * 9);
+		} else { // Day
+			brightnessAdjustment -= (210 - light * 14);
+		}
+	}
+	if (edge) brightnessAdjustment += 12;
+	return brightnessAdjustment;
+}
+
+bool createGBuffer(size_t width, size_t height, int offsetX, int offsetY)
+{
+	gWidth = width;
+	gHeight = height;
+	gOffsetX = offsetX;
+	gOffsetY = offsetY;
+	gMapHeight = g_MapsizeY * g_Scale; // Heights in the G-buffer are those of the world, see WORLDY
+	printf("G-buffer takes up %.2fMiB\n", float(gWidth * gHeight * (1 + LAYERS * sizeof(Fragment)) / float(1024 * 1024)));
+	gCount = new uint8_t[gWidth * gHeight];
+	gFragments = new Fragment[gWidth * gHeight * LAYERS];
+	memset(gCount, 0, gWidth * gHeight);
+	initLayout();
+	return true;
+}
+
+void destroyGBuffer()
+{
+	delete[] gCount;
+	delete[] gFragments;
+	gCount = NULL;
+	gFragments = NULL;
+}
+
+void rasterBlock(const int x, const int y, const uint8_t block, const uint8_t height, const uint8_t light, const uint8_t flags)
+{	// x and y are image coordinates of the top left corner of the block's sprite, just like setPixel
+	const uint8_t *layout = gLayout[block];
+	for (size_t row = 0; row < 4; ++row) {
+		const size_t index = size_t(x - gOffsetX) + (size_t(y - gOffsetY) + row) * gWidth;
+		for (size_t col = 0; col < 4; ++col, ++layout) {
+			if (*layout == 0) continue;
+			uint8_t &count = gCount[index + col];
+			Fragment *frags = gFragments + (index + col) * LAYERS;
+			Fragment f;
+			f.block = block;
+			f.y = height;
+			f.light = light;
+			f.flags = flags | (GBPIXEL(*layout) << 3);
+			f.repeat = 1;
+			if (*layout & OP_COPY) { // Everything behind this one is gone
+				frags[0] = f;
+				count = 0x81;
+				continue;
+			}
+			uint8_t n = count & 0x7F;
+			if (n != 0 && !(n == 1 && (count & 0x80)) && frags[n - 1].block == block
+					&& (frags[n - 1].flags >> 3) == (f.flags >> 3) && frags[n - 1].repeat < 255) {
+				// Same as the one below, just count it
+				f.repeat = frags[n - 1].repeat + 1;
+				frags[n - 1] = f;
+				continue;
+			}
+			if (n == LAYERS) { // Too many translucent layers, merge two of the same type or forget about the lowest one
+				const uint8_t first = (count & 0x80 ? 1 : 0);
+				uint8_t drop = first;
+				for (uint8_t i = n - 1; i > first; --i) {
+					if (frags[i].block == frags[i - 1].block && frags[i].repeat + frags[i - 1].repeat <= 255) {
+						frags[i].repeat += frags[i - 1].repeat;
+						drop = i - 1;
+						break;
+					}
+				}
+				memmove(frags + drop, frags + drop + 1, (LAYERS - drop - 1) * sizeof(Fragment));
+				--n;
+			}
+			frags[n] = f;
+			count = (count & 0x80) | (n + 1);
+		}
+	}
+}
+
+void shadeGBuffer(void (*drawLine)(size_t x, size_t y, size_t count, const uint8_t *colors, const uint8_t *ops))
+{
+	printf("Shading...\n");
+	float yBrightness[256];
+	for (size_t i = 0; i < 256; ++i) {
+		yBrightness[i] = shadeBrightness(i, -1, false);
+	}
+	uint8_t *line = new uint8_t[gWidth * 4];
+	uint8_t *ops = new uint8_t[gWidth];
+	for (size_t y = 0; y < gHeight; ++y) {
+		if (y % 16 == 0) printProgress(y, gHeight);
+		const uint8_t *count = gCount + y * gWidth;
+		const Fragment *frags = gFragments + y * gWidth * LAYERS;
+		// Do all pixels of one layer at once, so they can be blended onto the line in one go
+		for (size_t layer = 0; layer < LAYERS; ++layer) {
+			size_t first = gWidth, last = 0;
+			for (size_t x = 0; x < gWidth; ++x) {
+				if ((count[x] & 0x7F) <= layer) {
+					ops[x] = 0;
+					continue;
+				}
+				ops[x] = (layer == 0 && (count[x] & 0x80) ? 1 : 1 + frags[x * LAYERS + layer].repeat);
+				shadeFragment(frags[x * LAYERS + layer], x + gOffsetX, y + gOffsetY, yBrightness, line + x * 4);
+				if (first == gWidth) first = x;
+				last = x;
+			}
+			if (first == gWidth) break; // No pixel on this line has that many layers
+			(*drawLine)(first + gOffsetX, y + gOffsetY, last - first + 1, line + first * 4, ops + first);
+		}
+	}
+	printProgress(10, 10);
+	delete[] line;
+	delete[] ops;
+}
+
+bool saveGBuffer(const char* file, int imageWidth, int imageHeight)
+{
+	FILE *fh = fopen(file, "wb");
+	if (fh == NULL) return false;
+	const int32_t header[8] = {1, imageWidth, imageHeight, int32_t(gWidth), int32_t(gHeight), gOffsetX, gOffsetY, int32_t(gMapHeight)};
+	const bool ok = fwrite("MCGB", 1, 4, fh) == 4
+			&& fwrite(header, sizeof(header), 1, fh) == 1
+			&& fwrite(gCount, 1, gWidth * gHeight, fh) == gWidth * gHeight
+			&& fwrite(gFragments, sizeof(Fragment) * LAYERS, gWidth * gHeight, fh) == gWidth * gHeight;
+	fclose(fh);
+	return ok;
+}
+
+bool loadGBuffer(const char* file, int &imageWidth, int &imageHeight)
+{
+	FILE *fh = fopen(file, "rb");
+	if (fh == NULL) return false;
+	char magic[4];
+	int32_t header[8];
+	if (fread(magic, 1, 4, fh) != 4 || memcmp(magic, "MCGB", 4) != 0
+			|| fread(header, sizeof(header), 1, fh) != 1 || header[0] != 1) {
+		fclose(fh);
+		return false;
+	}
+	imageWidth = header[1];
+	imageHeight = header[2];
+	g_MapsizeY = header[7];
+	createGBuffer(header[3], header[4], header[5], header[6]);
+	const bool ok = fread(gCount, 1, gWidth * gHeight, fh) == gWidth * gHeight
+			&& fread(gFragments, sizeof(Fragment) * LAYERS, gWidth * gHeight, fh) == gWidth * gHeight;
+	fclose(fh);
+	return ok;
+}
+
+size_t calcGBufferSize(int mapChunksX, int mapChunksZ, size_t mapHeight)
+{
+	const size_t width = size_t((mapChunksX + 2) * CHUNKSIZE_X + (mapChunksZ + 2) * CHUNKSIZE_Z) * 2 + 4;
+	const size_t height = mapHeight * 2 + size_t((mapChunksX + 2) * CHUNKSIZE_X + (mapChunksZ + 2) * CHUNKSIZE_Z) + 4;
+	return width * height * (1 + LAYERS * sizeof(Fragment));
+}
+
+namespace {
+
+	inline void modColor(uint8_t* color, const int mod)
+	{
+		color[0] = clamp(color[0] + mod);
+		color[1] = clamp(color[1] + mod);
+		color[2] = clamp(color[2] + mod);
+	}
+
+	void initLayout()
+	{
+		// Row by row, see Canvas::setPixel:
+		// A T T T
+		// D D L L
+		// D D L L
+		//   D L
+		const uint8_t cube[16] = {
+			FACE_TOP | NOISE_ONE << 3, FACE_TOP | NOISE_ONE << 3, FACE_TOP | NOISE_ONE << 3, FACE_TOP | NOISE_ONE << 3,
+			FACE_DARK | NOISE_ONE << 3, FACE_DARK | NOISE_TWO << 3, FACE_LIGHT | NOISE_TWO << 3, FACE_LIGHT | NOISE_ONE << 3,
+			FACE_DARK | NOISE_TWO << 3, FACE_DARK | NOISE_ONE << 3, FACE_LIGHT | NOISE_ONE << 3, FACE_LIGHT | NOISE_TWO << 3,
+			0, FACE_DARK | NOISE_BOTTOM << 3, FACE_LIGHT | NOISE_BOTTOM << 3, 0};
+		const uint8_t grass[16] = {
+			FACE_TOP | NOISE_ONE << 3, FACE_TOP | NOISE_ONE << 3, FACE_TOP | NOISE_ONE << 3, FACE_TOP | NOISE_ONE << 3,
+			FACE_DARK, FACE_DARK, FACE_LIGHT, FACE_LIGHT,
+			FACE_DIRTDARK, FACE_DIRTDARK, FACE_DIRTLIGHT, FACE_DIRTLIGHT,
+			0, FACE_DIRTDARK, FACE_DIRTLIGHT, 0};
+		const uint8_t snow[16] = {0, 0, 0, 0, FACE_TOP, FACE_TOP, FACE_TOP, FACE_TOP, 0, 0, 0, 0, 0, 0, 0, 0};
+		const uint8_t torch[16] = {0, 0, 0, 0, 0, 0, FACE_TOP, 0, 0, 0, FACE_TOP, 0, 0, 0, 0, 0};
+		const uint8_t flower[16] = {0, 0, 0, 0, 0, FACE_TOP, 0, FACE_TOP, 0, 0, FACE_TOP, 0, 0, FACE_TOP, 0, 0};
+		const uint8_t fence[16] = {FACE_TOP, FACE_TOP, 0, 0, FACE_TOP, 0, 0, 0, FACE_TOP, FACE_TOP, 0, 0, FACE_TOP, 0, 0, 0};
+		const uint8_t fire[16] = {
+			FACE_TOP, 0, FACE_TOP, 0,
+			FACE_DARK, FACE_DARK, 0, FACE_LIGHT,
+			FACE_DARK, 0, FACE_DARK, FACE_LIGHT,
+			0, 0, FACE_LIGHT, 0};
+		const uint8_t step[16] = {0, 0, 0, 0, 0, 0, 0, 0, FACE_TOP, FACE_TOP, FACE_TOP, FACE_TOP, 0, FACE_DARK, FACE_LIGHT, 0};
+		const uint8_t *layouts[SHAPE_COUNT] = {cube, grass, snow, torch, flower, fence, fire, step};
+		const bool copies[SHAPE_COUNT] = {true, true, true, true, true, false, false, true};
+		for (int i = 0; i < 256; ++i) {
+			const uint8_t shape = colors[i][SHAPE];
+			const uint8_t *src = layouts[shape];
+			const bool copy = copies[shape] && (shape != SHAPE_CUBE || colors[i][ALPHA] == 255);
+			for (int p = 0; p < 16; ++p) {
+				gLayout[i][p] = (src[p] != 0 && copy ? src[p] | OP_COPY : src[p]);
+			}
+		}
+	}
+
+	void shadeFragment(const Fragment &f, const size_t x, const size_t y, const float *yBrightness, uint8_t *out)
+	{
+		float fsub = yBrightness[f.y];
+		if (!(f.flags & GB_UNLIT) && (g_Nightmode || (g_Skylight && !(f.flags & GB_MAPEDGE)))) {
+			// Now that we know the mode, mix block and sky light like the loader would do it
+			int l = f.light & 0x0F;
+			if (g_Skylight) {
+				const int sky = (g_Nightmode ? clamp((f.light >> 4) / 3 - 2) : f.light >> 4);
+				l = MAX(l, sky);
+			}
+			if (l == 0 && size_t(f.y) + 1 == gMapHeight) l = (g_Nightmode ? 3 : 15); // quickfix: assume maximum strength at highest level
+			if (!g_Skylight) { // Night
+				fsub -= (125 - l * 9);
+			} else { // Day
+				fsub -= (210 - l * 14);
+			}
+		}
+		if (f.flags & GB_EDGE) fsub += 12;
+		const int sub = int(fsub * (float(colors[f.block][BRIGHTNESS]) / 323.0f + .21f)); // The brighter the color, the stronger the impact
+		uint8_t c[4];
+		memcpy(c, colors[f.block], 4);
+		modColor(c, sub);
+		int noise = 0;
+		if (g_Noise && colors[f.block][NOISE] && GBNOISE(f.flags)) {
+			noise = int(float(g_Noise * colors[f.block][NOISE]) * (float(GETBRIGHTNESS(c) + 10) / 2650.0f));
+		}
+		const int face = GBFACE(f.flags);
+		if (face == FACE_DIRTDARK || face == FACE_DIRTLIGHT) {
+			memcpy(c, colors[DIRT], 4);
+			modColor(c, sub - (face == FACE_DIRTDARK ? 25 : 15));
+		} else if (face == FACE_DARK) {
+			modColor(c, -27);
+		} else if (face == FACE_LIGHT) {
+			modColor(c, -17);
+		}
+		if (noise) {
+			// Same pixel should always get the same noise, no matter how often it is shaded
+			uint32_t r = uint32_t(x) * 73856093u ^ uint32_t(y) * 19349663u ^ uint32_t(f.block) * 83492791u;
+			r ^= r >> 13;
+			r *= 0x5bd1e995u;
+			r ^= r >> 15;
+			switch (GBNOISE(f.flags)) {
+			case NOISE_ONE:
+				modColor(c, int(r % uint32_t(noise * 2)) - noise);
+				break;
+			case NOISE_TWO:
+				modColor(c, int(r % uint32_t(noise * 2)) - noise * 2);
+				break;
+			default:
+				modColor(c, -int(r % uint32_t(noise)) * 2);
+			}
+		}
+		memcpy(out, c, 4);
+	}
+
+}
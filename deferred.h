@@ -0,0 +1,21 @@
+#ifndef _DEFERRED_H_
+#define _DEFERRED_H_
+
+#include "helper.h"
+
+// Flags stored with every fragment in the G-buffer
+#define GB_EDGE 1 // Block is at an edge (terrain goes down behind it)
+#define GB_MAPEDGE 2 // Block is at the bottom left or right edge of the map, skylight is ignored there
+#define GB_UNLIT 4 // No light information was available when rasterising
+
+float shadeBrightness(const size_t y, const int light, const bool edge);
+
+bool createGBuffer(size_t width, size_t height, int offsetX, int offsetY);
+void destroyGBuffer();
+void rasterBlock(const int x, const int y, const uint8_t block, const uint8_t height, const uint8_t light, const uint8_t flags);
+void shadeGBuffer(void (*drawLine)(size_t x, size_t y, size_t count, const uint8_t *colors, const uint8_t *ops));
+bool saveGBuffer(const char* file, int imageWidth, int imageHeight);
+bool loadGBuffer(const char* file, int &imageWidth, int &imageHeight);
+size_t calcGBufferSize(int mapChunksX, int mapChunksZ, size_t mapHeight);
+
+#endif
@@ -1,11 +1,12 @@
 /**
- * This file contains functions to create and draw to a bitmap image
+ * This file contains functions to create a bitmap or BigTIFF image and move the canvas to and from it
  */
 
 #include "draw.h"
 #include "helper.h"
 #include "colors.h"
 #include "globals.h"
+#include "canvas.h"
 #include <cstring>
 #include <cstdio>
 #include <cstdlib>
@@ -33,27 +34,39 @@ typedef struct {
 	uint8_t ClrImportant[4];
 } BITMAP_INFOHEADER;
 
-#define PIXEL(x,y) (gBitmap[(x) * 3 + (gBmpLocalHeight - ((y) + 1)) * gBmpLocalLineWidth])
-
 namespace {
-	uint8_t *gBitmap = NULL;
-	int gBmpLocalLineWidth = 0, gBmpLocalWidth = 0, gBmpLocalHeight = 0, gBmpLocalX = 0, gBmpLocalY = 0;
+	// Output is either a bitmap, stored upside down, or a BigTIFF (for images too big for a bitmap), stored top
+	// down in strips of rows. Both are uncompressed 24bpp, so everything but the headers and the order of rows and
+	// colors is the same. The canvas always has the rows in the usual order
+	Canvas<PixelBgr> gBgrCanvas;
+	Canvas<PixelRgb> gRgbCanvas;
+	CanvasBase *gCanvas = &gBgrCanvas; // The one of the current file format
+	bool gTiff = false;
+	int gBmpLocalX = 0, gBmpLocalY = 0;
 	int gBmpLineWidth = 0, gBmpWidth = 0, gBmpHeight = 0;
-	int64_t gBmpSize = 0, gBmpLocalSize = 0;
+	int64_t gBmpSize = 0, gBmpLocalSize = 0, gBmpDataOffset = 0;
+	// The whole file mapped into memory, if that worked; the canvas then points right into it
+	uint8_t *gBmpMap = NULL;
+	// Size of the strips of a tiff; readers load one strip at a time
+#	define TIFFSTRIPBYTES (1024 * 1024)
 
-	inline void blend(uint8_t* c1, const uint8_t* c2);
-	inline void modColor(uint8_t* color, const int mod);
-	inline void addColor(uint8_t* color, uint8_t* add);
+	bool beginFile(FILE* fh, size_t width, size_t height);
+	bool createImage(FILE* fh, size_t width, size_t height, bool splitUp);
+	bool createStream(FILE* fh, size_t width, size_t height, int rows);
+	bool openImage(FILE* fh, size_t width, size_t height);
+	void unmapBitmap();
 
-	// Split them up so setPixelBmp won't be one hell of a mess
-	void setSnow(const size_t &x, const size_t &y, const uint8_t *color);
-	void setTorch(const size_t &x, const size_t &y, const uint8_t *color);
-	void setFlower(const size_t &x, const size_t &y, const uint8_t *color);
-	void setFire(const size_t &x, const size_t &y, uint8_t *color, uint8_t *light, uint8_t *dark);
-	void setGrass(const size_t &x, const size_t &y, const uint8_t *color, const uint8_t *light, const uint8_t *dark, const int &sub);
-	void setFence(const size_t &x, const size_t &y, const uint8_t *color);
-	void setStep(const size_t &x, const size_t &y, const uint8_t *color, const uint8_t *light, const uint8_t *dark);
+	inline int64_t rowPos(const int y)
+	{	// Position of row y of the image in the file
+		return gBmpDataOffset + int64_t(gTiff ? y : gBmpHeight - 1 - y) * gBmpLineWidth;
+	}
 
+	inline void le64(uint8_t* target, uint64_t val)
+	{
+		for (int i = 0; i < 8; ++i) {
+			target[i] = uint8_t((val >> (i * 8)) & 0xff);
+		}
+	}
 	inline void le32(uint8_t* target, uint32_t val)
 	{
 		target[0] = uint8_t(val & 0xff);
@@ -69,57 +82,116 @@ namespace {
 
 	bool writeBitmapHeader24(FILE* fh, const size_t width, const size_t height)
 	{
-		//uint32_t datasize = ((uint32_t(width) * 3u + 3u) & ~uint32_t(3)) * uint32_t(height);
+		// Sizes are only 32 bits, fitsImageBmp() makes sure they're enough
 		BITMAP_FILEHEADER header;
 		BITMAP_INFOHEADER info;
 		memset(&header, 0, sizeof(header));
 		memset(&info, 0, sizeof(info));
 		header.Type[0] = 'B';
 		header.Type[1] = 'M';
+		le32(header.Size, uint32_t(gBmpDataOffset + gBmpSize));
 		le32(header.DataOffset, uint32_t(sizeof(header) + sizeof(info)));
 		le32(info.HeaderSize, uint32_t(sizeof(info)));
 		le16(info.BitCount, 24);
 		le32(info.Height, uint32_t(height));
 		le32(info.Width, uint32_t(width));
 		le16(info.Planes, 1);
+		le32(info.ImageByteCount, uint32_t(gBmpSize));
 		return
 				(fwrite(&header, 1, sizeof(header), fh) == sizeof(header))
 				&& (fwrite(&info, 1, sizeof(info), fh) == sizeof(info));
 	}
+
+	inline uint8_t *tiffEntry(uint8_t *pos, uint16_t tag, uint16_t type, uint64_t count, uint64_t value)
+	{	// Values of up to 8 bytes are stored right in the entry
+		le16(pos, tag);
+		le16(pos + 2, type);
+		le64(pos + 4, count);
+		le64(pos + 12, value);
+		return pos + 20;
+	}
+
+	bool writeTiffHeader24(FILE* fh, const size_t width, const size_t height)
+	{
+		// BigTIFF: header, one directory with 11 entries, then the offsets and sizes of all strips, then the image
+		const int64_t stripRows = MAX(1, TIFFSTRIPBYTES / gBmpLineWidth), strips = (int64_t(height) + stripRows - 1) / stripRows;
+		const int64_t arrays = 256; // Header (16) and directory (8 + 11 * 20 + 8), rounded up
+		uint8_t header[256];
+		memset(header, 0, sizeof(header));
+		header[0] = header[1] = 'I'; // Little endian
+		le16(header + 2, 43);
+		le16(header + 4, 8);
+		le64(header + 8, 16);
+		le64(header + 16, 11);
+		uint8_t *entry = header + 24;
+		entry = tiffEntry(entry, 256, 4, 1, width); // ImageWidth
+		entry = tiffEntry(entry, 257, 4, 1, height); // ImageLength
+		entry = tiffEntry(entry, 258, 3, 3, 8 | (8 << 16) | (uint64_t(8) << 32)); // BitsPerSample
+		entry = tiffEntry(entry, 259, 3, 1, 1); // Compression: none
+		entry = tiffEntry(entry, 262, 3, 1, 2); // PhotometricInterpretation: RGB
+		entry = tiffEntry(entry, 273, 16, strips, uint64_t(arrays)); // StripOffsets; a single one is the image itself
+		entry = tiffEntry(entry, 277, 3, 1, 3); // SamplesPerPixel
+		entry = tiffEntry(entry, 278, 4, 1, uint64_t(stripRows)); // RowsPerStrip
+		entry = tiffEntry(entry, 279, 16, strips, uint64_t(strips == 1 ? gBmpSize : arrays + 8 * strips)); // StripByteCounts
+		entry = tiffEntry(entry, 284, 3, 1, 1); // PlanarConfiguration: RGBRGB...
+		entry = tiffEntry(entry, 305, 2, 6, 'm' | ('c' << 8) | ('m' << 16) | ('a' << 24) | (uint64_t('p') << 32)); // Software
+		gBmpDataOffset = arrays + (strips == 1 ? 0 : 16 * strips);
+		if (fwrite(header, 1, sizeof(header), fh) != sizeof(header)) return false;
+		if (strips == 1) return true;
+		// Strips simply follow each other
+		uint8_t value[8];
+		for (int64_t i = 0; i < strips; ++i) {
+			le64(value, uint64_t(gBmpDataOffset + i * stripRows * gBmpLineWidth));
+			if (fwrite(value, 1, 8, fh) != 8) return false;
+		}
+		for (int64_t i = 0; i < strips; ++i) {
+			le64(value, uint64_t(MIN(stripRows, int64_t(height) - i * stripRows) * gBmpLineWidth));
+			if (fwrite(value, 1, 8, fh) != 8) return false;
+		}
+		return true;
+	}
 }
 
 bool createImageBmp(FILE* fh, size_t width, size_t height, bool splitUp)
 {
-	gBmpWidth = (int)width;
-	gBmpHeight = (int)height;
-	gBmpLineWidth = int(gBmpWidth * 3 + 3) & ~int(3); // The size in bytes of a line in a bitmap has to be a multiple of 4
-	gBmpSize = gBmpLineWidth * gBmpHeight;
-	printf("Bitmap dimensions are %dx%d, 24bpp, %.2fMiB\n", gBmpWidth, gBmpHeight, float(gBmpSize / float(1024 * 1024)));
-	fseek64(fh, 0, SEEK_SET);
-	if (!writeBitmapHeader24(fh, width, height)) return false;
-	if (splitUp) {
-		// Pre allocate disk space with zeroes
-		// Most OSes should automatically do that when seeking
-		// beyond the EOF, but just to be sure, do it manually
-		uint8_t *tmpdata = new uint8_t[gBmpLineWidth];
-		memset(tmpdata, 0, gBmpLineWidth);
-		for (int i = 0; i < gBmpHeight; ++i) {
-			if ((int)fwrite(tmpdata, 1, gBmpLineWidth, fh) != gBmpLineWidth) return false;
-		}
-		delete[] tmpdata;
-	} else {
-		gBitmap = new uint8_t[gBmpSize];
-		memset(gBitmap, 0, gBmpSize);
-		gBmpLocalHeight = gBmpHeight;
-		gBmpLocalLineWidth = gBmpLineWidth;
-		gBmpLocalWidth = gBmpWidth;
-	}
-	return true;
+	gTiff = false;
+	gCanvas = &gBgrCanvas;
+	return createImage(fh, width, height, splitUp);
+}
+
+bool createImageTiff(FILE* fh, size_t width, size_t height, bool splitUp)
+{
+	gTiff = true;
+	gCanvas = &gRgbCanvas;
+	return createImage(fh, width, height, splitUp);
+}
+
+bool openImageBmp(FILE* fh, size_t width, size_t height)
+{
+	gTiff = false;
+	gCanvas = &gBgrCanvas;
+	return openImage(fh, width, height);
+}
+
+bool openImageTiff(FILE* fh, size_t width, size_t height)
+{
+	gTiff = true;
+	gCanvas = &gRgbCanvas;
+	return openImage(fh, width, height);
 }
 
 bool saveImageBmp(FILE* fh)
 {
-	return fwrite(gBitmap, 1, gBmpSize, fh) == (size_t)gBmpSize;
+	if (gBmpMap != NULL) { // Everything is in the file already
+		unmapBitmap();
+		return true;
+	}
+	// Right after the header, rows in the order of the file
+	for (int i = 0; i < gBmpHeight; ++i) {
+		const int y = (gTiff ? i : gBmpHeight - 1 - i);
+		if ((int)fwrite(gCanvas->row(y), 1, gBmpLineWidth, fh) != gBmpLineWidth) return false;
+	}
+	return true;
 }
 
 bool loadImagePartBmp(FILE* fh, int startx, int starty, int width, int height)
@@ -128,33 +200,34 @@ bool loadImagePartBmp(FILE* fh, int startx, int starty, int width, int height)
 	const int offY = MAX(0, -starty);
 	if (width + startx > gBmpWidth) width = gBmpWidth - startx;
 	if (height + starty > gBmpHeight) height = gBmpHeight - starty;
-	gBmpLocalWidth = width;
-	gBmpLocalLineWidth = width * 3;
+	if (gBmpMap != NULL) {
+		// The canvas covers the whole file, just move its origin to the area
+		gCanvas->offsetX = startx;
+		gCanvas->offsetY = starty;
+		return true;
+	}
+	gCanvas->width = width;
+	gCanvas->lineWidth = width * 3;
 	const int readLineWidth = (width - offX) * 3;
-	gBmpLocalHeight = height;
+	gCanvas->height = height;
 	gBmpLocalX = startx;
 	gBmpLocalY = starty;
 	printf("* Loading area at %d, %d of size %d x %d\n", int(startx), int(starty), int(width), int(height));
-	if (gBitmap == NULL) {
+	if (gCanvas->buffer == NULL) {
 		// First call, no image created yet, just alloc mem
-		gBmpLocalSize = gBmpLocalLineWidth * gBmpHeight;
-		gBitmap = new uint8_t[gBmpLocalSize];
-		memset(gBitmap, 0, gBmpLocalSize);
+		gBmpLocalSize = int64_t(gCanvas->lineWidth) * gBmpHeight;
+		gCanvas->buffer = new uint8_t[gBmpLocalSize];
+		memset(gCanvas->buffer, 0, gBmpLocalSize);
 	} else {
 		// Need to load the area to render to from file, as it might contain some partially rendered stuff
-		if (gBmpLocalSize < gBmpLocalLineWidth * gBmpHeight) {
-			gBmpLocalSize = gBmpLocalLineWidth * gBmpHeight;
-			delete[] gBitmap;
-			gBitmap = new uint8_t[gBmpLocalSize];
+		if (gBmpLocalSize < int64_t(gCanvas->lineWidth) * gBmpHeight) {
+			gBmpLocalSize = int64_t(gCanvas->lineWidth) * gBmpHeight;
+			delete[] gCanvas->buffer;
+			gCanvas->buffer = new uint8_t[gBmpLocalSize];
 		}
-		int fileLine = gBmpHeight - gBmpLocalY - gBmpLocalHeight;
-		for (int arrayLine = 0; arrayLine < gBmpLocalHeight - offY; ++arrayLine) {
-			const int64_t pos = int64_t(fileLine) * int64_t(gBmpLineWidth) // row
-					+ int64_t((gBmpLocalX + offX) * 3 // column
-					+ sizeof(BITMAP_INFOHEADER) + sizeof(BITMAP_FILEHEADER)); // header
-			fseek64(fh, pos, SEEK_SET);
-			if ((int)fread(gBitmap + (arrayLine * gBmpLocalLineWidth) + offX * 3, 1, readLineWidth, fh) != readLineWidth) return false;
-			++fileLine;
+		for (int y = offY; y < gCanvas->height; ++y) {
+			fseek64(fh, rowPos(gBmpLocalY + y) + (gBmpLocalX + offX) * 3, SEEK_SET);
+			if ((int)fread(gCanvas->row(y) + offX * 3, 1, readLineWidth, fh) != readLineWidth) return false;
 		}
 	}
 	return true;
@@ -162,339 +235,222 @@ bool loadImagePartBmp(FILE* fh, int startx, int starty, int width, int height)
 
 bool saveImagePartBmp(FILE* fh)
 {
+	if (gBmpMap != NULL) return true; // The kernel writes the file back whenever it likes; the mapping stays until the program ends
 	const int offX = MAX(0, -gBmpLocalX);
 	const int offY = MAX(0, -gBmpLocalY);
-	const int writeLineWidth = (gBmpLocalWidth - offX) * 3;
-	size_t fileLine = gBmpHeight - gBmpLocalY - gBmpLocalHeight;
-	for (int arrayLine = 0; arrayLine < gBmpLocalHeight - offY; ++arrayLine) {
-		const int64_t pos = int64_t(fileLine) * int64_t(gBmpLineWidth)
-				+ int64_t((gBmpLocalX + offX) * 3
-				+ sizeof(BITMAP_INFOHEADER) + sizeof(BITMAP_FILEHEADER));
-		if (pos < 0) continue;
-		fseek64(fh, pos, SEEK_SET);
-		if ((int)fwrite(gBitmap + (arrayLine * gBmpLocalLineWidth) + offX * 3, 1, writeLineWidth, fh) != writeLineWidth) return false;
-		++fileLine;
+	const int writeLineWidth = (gCanvas->width - offX) * 3;
+	for (int y = offY; y < gCanvas->height && gBmpLocalY + y < gBmpHeight; ++y) {
+		fseek64(fh, rowPos(gBmpLocalY + y) + (gBmpLocalX + offX) * 3, SEEK_SET);
+		if ((int)fwrite(gCanvas->row(y) + offX * 3, 1, writeLineWidth, fh) != writeLineWidth) return false;
+	}
+	return true;
+}
+
+bool beginPatchBmp(int x, int y, int width, int height)
+{
+	// The area is drawn anew: move the origin of the canvas there and clear it
+	gCanvas->offsetX = x;
+	gCanvas->offsetY = y;
+	if (gTiff) {
+		gRgbCanvas.clear(0, 0, width, height);
+	} else {
+		gBgrCanvas.clear(0, 0, width, height);
+	}
+	return true;
+}
+
+bool endPatchBmp()
+{
+	return true; // Drawn right into the mapped file
+}
+
+bool createStreamBmp(FILE* fh, size_t width, size_t height, int rows)
+{
+	gTiff = false;
+	gCanvas = &gBgrCanvas;
+	return createStream(fh, width, height, rows);
+}
+
+bool createStreamTiff(FILE* fh, size_t width, size_t height, int rows)
+{
+	gTiff = true;
+	gCanvas = &gRgbCanvas;
+	return createStream(fh, width, height, rows);
+}
+
+bool streamRowsBmp(FILE* fh, int rows)
+{
+	// Write the top rows of the band to the file, then move the band down by as many rows
+	const int write = MIN(rows, gBmpHeight - gBmpLocalY);
+	if (write > 0) {
+		// These rows are a single piece of the file; in a bitmap it starts with the last one.
+		// Rows below the band were never drawn to, so they're written as zeros
+		uint8_t *zeros = (write > gCanvas->height ? new uint8_t[gBmpLineWidth] : NULL);
+		if (zeros != NULL) memset(zeros, 0, gBmpLineWidth);
+		fseek64(fh, MIN(rowPos(gBmpLocalY), rowPos(gBmpLocalY + write - 1)), SEEK_SET);
+		for (int i = 0; i < write; ++i) {
+			const int y = (gTiff ? i : write - 1 - i);
+			if ((int)fwrite(y < gCanvas->height ? gCanvas->row(y) : zeros, 1, gBmpLineWidth, fh) != gBmpLineWidth) {
+				delete[] zeros;
+				return false;
+			}
+		}
+		delete[] zeros;
 	}
+	gBmpLocalY += rows;
+	rows = MIN(rows, gCanvas->height);
+	memmove(gCanvas->buffer, gCanvas->row(rows), size_t(gCanvas->height - rows) * gCanvas->lineWidth);
+	memset(gCanvas->row(gCanvas->height - rows), 0, size_t(rows) * gCanvas->lineWidth);
 	return true;
 }
 
-size_t calcImageSizeBmp(int mapChunksX, int mapChunksZ, size_t mapHeight, int &pixelsX, int &pixelsY, bool tight)
+bool fitsImageBmp(int width, int height)
+{
+	// All sizes in the header have to fit in 32 bits
+	return (uint64_t(width) * 3 + 3) / 4 * 4 * uint64_t(height) + sizeof(BITMAP_INFOHEADER) + sizeof(BITMAP_FILEHEADER) <= 0xFFFFFFFFu;
+}
+
+uint64_t calcImageSizeBmp(int mapChunksX, int mapChunksZ, size_t mapHeight, int &pixelsX, int &pixelsY, bool tight)
 {
 	pixelsX = (mapChunksX * CHUNKSIZE_X + mapChunksZ * CHUNKSIZE_Z) * 2 + (tight ? 3 : 10);
 	pixelsY = (mapChunksX * CHUNKSIZE_X + mapChunksZ * CHUNKSIZE_Z + (int)mapHeight * 2) + (tight ? 3 : 10);
-	return (size_t(pixelsX * 3 + 3) & ~size_t(3)) * pixelsY;
+	return ((uint64_t(pixelsX) * 3 + 3) & ~uint64_t(3)) * uint64_t(pixelsY);
+}
+
+uint64_t calcImageSizeTiff(int mapChunksX, int mapChunksZ, size_t mapHeight, int &pixelsX, int &pixelsY, bool tight)
+{
+	calcImageSizeBmp(mapChunksX, mapChunksZ, mapHeight, pixelsX, pixelsY, tight);
+	return uint64_t(pixelsX) * 3 * uint64_t(pixelsY);
 }
 
 void setPixelBmp(size_t x, size_t y, uint8_t color, float fsub)
 {
-	// Sets pixels around x,y where A is the anchor
-	// T = given color, D = darker, L = lighter
-	// A T T T
-	// D D L L
-	// D D L L
-	//	  D L
-	// First determine how much the color has to be lightened up or darkened
-	int sub = int(fsub * (float(colors[color][BRIGHTNESS]) / 323.0f + .21f)); // The brighter the color, the stronger the impact
-	uint8_t L[4], D[4], c[4];
-	// Now make a local copy of the color that we can modify just for this one block
-	memcpy(c, colors[color], 4);
-	modColor(c, sub);
-	// Then check the block type, as some types will be drawn differently
-	if (color == SNOW) {
-		setSnow(x, y, c);
-		return;
-	}
-	if (color == TORCH || color == REDTORCH_ON || color == REDTORCH_OFF) {
-		setTorch(x, y, c);
-		return;
-	}
-	if (color == FLOWERR || color == FLOWERY || color == MUSHROOMB || color == MUSHROOMR) {
-		setFlower(x, y, c);
-		return;
-	}
-	if (color == FENCE) {
-		setFence(x, y, c);
-		return;
-	}
-	// All the above blocks didn't need the shaded down versions of the color, so we only calc them here
-	// They are for the sides of blocks
-	memcpy(L, c, 4);
-	memcpy(D, c, 4);
-	modColor(L, -17);
-	modColor(D, -27);
-	// A few more blocks with special handling... Those need the two colors we just mixed
-	if (color == GRASS) {
-		setGrass(x, y, c, L, D, sub);
-		return;
-	}
-	if (color == FIRE) {
-		setFire(x, y, c, L, D);
-		return;
-	}
-	if (color == STEP) {
-		setStep(x, y, c, L, D);
-		return;
-	}
-	// In case the user wants noise, calc the strength now, depending on the desired intensity and the block's brightness
-	int noise = 0;
-	if (g_Noise && colors[color][NOISE]) {
-		noise = int(float(g_Noise * colors[color][NOISE]) * (float(GETBRIGHTNESS(c) + 10) / 2650.0f));
-	}
-	// Ordinary blocks are all rendered the same way
-	if (c[ALPHA] == 255) { // Fully opaque - faster
-		// Top row
-		uint8_t *pos = &PIXEL(x, y);
-		for (size_t i = 0; i < 4; ++i, pos += 3) {
-			memcpy(pos, c, 3);
-			if (noise) modColor(pos, rand() % (noise * 2) - noise);
-		}
-		// Second row
-		pos = &PIXEL(x, y+1);
-		for (size_t i = 0; i < 4; ++i, pos += 3) {
-			memcpy(pos, (i < 2 ? D : L), 3);
-			// The weird check here is to get the pattern right, as the noise should be stronger
-			// every other row, but take into account the isometric perspective
-			if (noise) modColor(pos, rand() % (noise * 2) - noise * (i == 0 || i == 3 ? 1 : 2));
-		}
-		// Third row
-		pos = &PIXEL(x, y+2);
-		for (size_t i = 0; i < 4; ++i, pos += 3) {
-			memcpy(pos, (i < 2 ? D : L), 3);
-			if (noise) modColor(pos, rand() % (noise * 2) - noise * (i == 0 || i == 3 ? 2 : 1));
-		}
-		// Last row
-		pos = &PIXEL(x, y+3);
-		memcpy(pos+=3, D, 3);
-		if (noise) modColor(pos, -(rand() % noise) * 2);
-		memcpy(pos+=3, L, 3);
-		if (noise) modColor(pos, -(rand() % noise) * 2);
-	} else { // Not opaque, use slower blending code
-		// Top row
-		uint8_t *pos = &PIXEL(x, y);
-		for (size_t i = 0; i < 4; ++i, pos += 3) {
-			blend(pos, c);
-			if (noise) modColor(pos, rand() % (noise * 2) - noise);
-		}
-		// Second row
-		pos = &PIXEL(x, y+1);
-		for (size_t i = 0; i < 4; ++i, pos += 3) {
-			blend(pos, (i < 2 ? D : L));
-			if (noise) modColor(pos, rand() % (noise * 2) - noise * (i == 0 || i == 3 ? 1 : 2));
-		}
-		// Third row
-		pos = &PIXEL(x, y+2);
-		for (size_t i = 0; i < 4; ++i, pos += 3) {
-			blend(pos, (i < 2 ? D : L));
-			if (noise) modColor(pos, rand() % (noise * 2) - noise * (i == 0 || i == 3 ? 2 : 1));
-		}
-		// Last row
-		pos = &PIXEL(x, y+3);
-		blend(pos+=3, D);
-		if (noise) modColor(pos, -(rand() % noise) * 2);
-		blend(pos+=3, L);
-		if (noise) modColor(pos, -(rand() % noise) * 2);
-	}
-	// The above two branches are almost the same, maybe one could just create a function pointer and...
+	gBgrCanvas.setPixel(x, y, color, fsub);
 }
 
 void blendPixelBmp(size_t x, size_t y, uint8_t color, float fsub)
 {
-	// Sets pixels around x,y where A is the anchor
-	// T = given color, D = darker, L = lighter
-	// A T T T
-	// D D L L
-	// D D L L
-	//	  D L
-	uint8_t L[4], D[4], c[4];
-	// Now make a local copy of the color that we can modify just for this one block
-	memcpy(c, colors[color], 4);
-	c[ALPHA] = clamp(int(float(c[ALPHA]) * fsub)); // The brighter the color, the stronger the impact
-	// They are for the sides of blocks
-	memcpy(L, c, 4);
-	memcpy(D, c, 4);
-	modColor(L, -17);
-	modColor(D, -27);
-	// In case the user wants noise, calc the strength now, depending on the desired intensity and the block's brightness
-	int noise = 0;
-	if (g_Noise && colors[color][NOISE]) {
-		noise = int(float(g_Noise * colors[color][NOISE]) * (float(GETBRIGHTNESS(c) + 10) / 2650.0f));
-	}
-	// Top row
-	uint8_t *pos = &PIXEL(x, y);
-	for (size_t i = 0; i < 4; ++i, pos += 3) {
-		blend(pos, c);
-		if (noise) modColor(pos, rand() % (noise * 2) - noise);
-	}
-	// Second row
-	pos = &PIXEL(x, y+1);
-	for (size_t i = 0; i < 4; ++i, pos += 3) {
-		blend(pos, (i < 2 ? D : L));
-		if (noise) modColor(pos, rand() % (noise * 2) - noise * (i == 0 || i == 3 ? 1 : 2));
-	}
-	/*
-	// Third row
-	pos = &PIXEL(x, y+2);
-	for (size_t i = 0; i < 4; ++i, pos += 3) {
-		addColor(pos, (i < 2 ? D : L));
-		if (noise) modColor(pos, rand() % (noise * 2) - noise * (i == 0 || i == 3 ? 2 : 1));
-	}
-	// Last row
-	pos = &PIXEL(x, y+3);
-	addColor(pos+=3, D);
-	if (noise) modColor(pos, -(rand() % noise) * 2);
-	addColor(pos+=3, L);
-	if (noise) modColor(pos, -(rand() % noise) * 2);
-	*/
+	gBgrCanvas.blendPixel(x, y, color, fsub);
 }
 
-namespace {
+void drawLineBmp(size_t x, size_t y, size_t count, const uint8_t *colors, const uint8_t *ops)
+{
+	gBgrCanvas.drawLine(x, y, count, colors, ops);
+}
 
-	inline void blend(uint8_t* c1, const uint8_t* c2)
-	{
-		const float v2 = (float(c2[ALPHA]) / 255.0f);
-		const float v1 = (1.0f - v2);
-		c1[0] = uint8_t(float(c1[0]) * v1 + float(c2[0]) * v2);
-		c1[1] = uint8_t(float(c1[1]) * v1 + float(c2[1]) * v2);
-		c1[2] = uint8_t(float(c1[2]) * v1 + float(c2[2]) * v2);
-	}
+void beginTileBmp(int x, int y, int width, int height)
+{
+	gBgrCanvas.beginTile(x, y, width, height);
+}
 
-	inline void modColor(uint8_t* color, const int mod)
-	{
-		color[0] = clamp(color[0] + mod);
-		color[1] = clamp(color[1] + mod);
-		color[2] = clamp(color[2] + mod);
-	}
+void endTileBmp()
+{
+	gBgrCanvas.endTile();
+}
 
-	inline void addColor(uint8_t* color, uint8_t* add)
-	{
-		const float v2 = (float(add[ALPHA]) / 255.0f);
-		const float v1 = (1.0f - (v2 * .2f));
-		color[0] = clamp(uint16_t(float(color[0]) * v1 + float(add[0]) * v2));
-		color[1] = clamp(uint16_t(float(color[1]) * v1 + float(add[1]) * v2));
-		color[2] = clamp(uint16_t(float(color[2]) * v1 + float(add[2]) * v2));
-	}
+void setPixelTiff(size_t x, size_t y, uint8_t color, float fsub)
+{
+	gRgbCanvas.setPixel(x, y, color, fsub);
+}
 
-	void setSnow(const size_t &x, const size_t &y, const uint8_t *color)
-	{
-		// Top row (second row)
-		uint8_t *pos = &PIXEL(x, y+1);
-		for (size_t i = 0; i < 10; i += 3) {
-			memcpy(pos+i, color, 3);
-		}
-		/*
-		// Third row
-		// This gives you white edges on height diffs, but I think
-		// the current way looks closer to ingame, although trees
-		// turn out a little prettier when using this imo
-		pos = &PIXEL(x, y+2);
-		memcpy(pos, D, 3);
-		memcpy(pos+3, D, 3);
-		memcpy(pos+6, L, 3);
-		memcpy(pos+9, L, 3);
-		*/
-	}
+void blendPixelTiff(size_t x, size_t y, uint8_t color, float fsub)
+{
+	gRgbCanvas.blendPixel(x, y, color, fsub);
+}
 
-	void setTorch(const size_t &x, const size_t &y, const uint8_t *color)
-	{ // Maybe the orientation should be considered when drawing, but it probably isn't worth the efford
-		uint8_t *pos = &PIXEL(x+2, y+1);
-		memcpy(pos, color, 3);
-		pos = &PIXEL(x+2, y+2);
-		memcpy(pos, color, 3);
-	}
+void drawLineTiff(size_t x, size_t y, size_t count, const uint8_t *colors, const uint8_t *ops)
+{
+	gRgbCanvas.drawLine(x, y, count, colors, ops);
+}
 
-	void setFlower(const size_t &x, const size_t &y, const uint8_t *color)
+void beginTileTiff(int x, int y, int width, int height)
+{
+	gRgbCanvas.beginTile(x, y, width, height);
+}
+
+void endTileTiff()
+{
+	gRgbCanvas.endTile();
+}
+
+namespace {
+
+	bool beginFile(FILE* fh, size_t width, size_t height)
 	{
-		uint8_t *pos = &PIXEL(x, y+1);
-		memcpy(pos+3, color, 3);
-		memcpy(pos+9, color, 3);
-		pos = &PIXEL(x+2, y+2);
-		memcpy(pos, color, 3);
-		pos = &PIXEL(x+1, y+3);
-		memcpy(pos, color, 3);
+		// Size of everything and the header. Lines of a bitmap have to be a multiple of 4 bytes
+		gBmpWidth = (int)width;
+		gBmpHeight = (int)height;
+		gBmpLineWidth = (gTiff ? gBmpWidth * 3 : int(gBmpWidth * 3 + 3) & ~int(3));
+		gBmpSize = int64_t(gBmpLineWidth) * gBmpHeight;
+		gBmpLocalX = gBmpLocalY = 0;
+		fseek64(fh, 0, SEEK_SET);
+		if (gTiff) return writeTiffHeader24(fh, width, height);
+		gBmpDataOffset = sizeof(BITMAP_INFOHEADER) + sizeof(BITMAP_FILEHEADER);
+		return writeBitmapHeader24(fh, width, height);
 	}
 
-	void setFire(const size_t &x, const size_t &y, uint8_t *color, uint8_t *light, uint8_t *dark)
-	{	// This basically just leaves out a few pixels
-		// Top row
-		uint8_t *pos = &PIXEL(x, y);
-		for (size_t i = 0; i < 10; i += 6) {
-			blend(pos+i, color);
-		}
-		// Second and third row
-		for (size_t i = 1; i < 3; ++i) {
-			pos = &PIXEL(x, y+i);
-			blend(pos, dark);
-			blend(pos+(3*i), dark);
-			blend(pos+9, light);
+	bool createImage(FILE* fh, size_t width, size_t height, bool splitUp)
+	{
+		if (!beginFile(fh, width, height)) return false;
+		printf("%s dimensions are %dx%d, 24bpp, %.2fMiB\n", (gTiff ? "BigTIFF" : "Bitmap"), gBmpWidth, gBmpHeight, float(gBmpSize / float(1024 * 1024)));
+		gCanvas->width = gBmpWidth;
+		gCanvas->height = gBmpHeight;
+		if ((gBmpMap = mapFile(fh, gBmpDataOffset + gBmpSize)) != NULL) {
+			// Draw straight into the file. A bitmap's rows are stored bottom up, so the canvas starts at the last one and goes backwards
+			gCanvas->buffer = gBmpMap + rowPos(0);
+			gCanvas->lineWidth = (gTiff ? gBmpLineWidth : -gBmpLineWidth);
+		} else if (splitUp) {
+			// Pre allocate disk space with zeroes
+			// Most OSes should automatically do that when seeking
+			// beyond the EOF, but just to be sure, do it manually
+			uint8_t *tmpdata = new uint8_t[gBmpLineWidth];
+			memset(tmpdata, 0, gBmpLineWidth);
+			for (int i = 0; i < gBmpHeight; ++i) {
+				if ((int)fwrite(tmpdata, 1, gBmpLineWidth, fh) != gBmpLineWidth) return false;
+			}
+			delete[] tmpdata;
+		} else {
+			gCanvas->buffer = new uint8_t[gBmpSize];
+			memset(gCanvas->buffer, 0, gBmpSize);
+			gCanvas->lineWidth = gBmpLineWidth;
 		}
-		// Last row
-		pos = &PIXEL(x, y+3);
-		blend(pos+6, light);
+		return true;
 	}
 
-	void setGrass(const size_t &x, const size_t &y, const uint8_t *color, const uint8_t *light, const uint8_t *dark, const int &sub)
-	{	// this will make grass look like dirt from the side
-		uint8_t L[4], D[4];
-		memcpy(L, colors[DIRT], 4);
-		memcpy(D, colors[DIRT], 4);
-		modColor(L, sub - 15);
-		modColor(D, sub - 25);
-		// consider noise
-		int noise = 0;
-		if (g_Noise && colors[GRASS][NOISE]) {
-			noise = int(float(g_Noise * colors[GRASS][NOISE]) * (float(GETBRIGHTNESS(color) + 10) / 2650.0f));
-		}
-		// Top row
-		uint8_t *pos = &PIXEL(x, y);
-		for (size_t i = 0; i < 4; ++i, pos += 3) {
-			memcpy(pos, color, 3);
-			if (noise) modColor(pos, rand() % (noise * 2) - noise);
-		}
-		// Second row
-		pos = &PIXEL(x, y+1);
-		memcpy(pos, dark, 3);
-		memcpy(pos+3, dark, 3);
-		memcpy(pos+6, light, 3);
-		memcpy(pos+9, light, 3);
-		// Third row
-		pos = &PIXEL(x, y+2);
-		memcpy(pos, D, 3);
-		memcpy(pos+3, D, 3);
-		memcpy(pos+6, L, 3);
-		memcpy(pos+9, L, 3);
-		// Last row
-		pos = &PIXEL(x, y+3);
-		memcpy(pos+3, D, 3);
-		memcpy(pos+6, L, 3);
+	bool createStream(FILE* fh, size_t width, size_t height, int rows)
+	{
+		// Like createImage, but only a band of rows is kept in memory, which streamRowsBmp() moves down the image
+		if (!beginFile(fh, width, height)) return false;
+		gCanvas->width = gBmpWidth;
+		gCanvas->lineWidth = gBmpLineWidth;
+		gCanvas->height = rows;
+		gBmpLocalSize = int64_t(gCanvas->lineWidth) * gCanvas->height;
+		printf("%s dimensions are %dx%d, 24bpp, %.2fMiB, %d rows at a time\n", (gTiff ? "BigTIFF" : "Bitmap"), gBmpWidth, gBmpHeight, float(gBmpSize / float(1024 * 1024)), rows);
+		gCanvas->buffer = new uint8_t[gBmpLocalSize];
+		memset(gCanvas->buffer, 0, gBmpLocalSize);
+		return true;
 	}
 
-	void setFence(const size_t &x, const size_t &y, const uint8_t *color)
+	bool openImage(FILE* fh, size_t width, size_t height)
 	{
-		// First row
-		uint8_t *pos = &PIXEL(x, y);
-		blend(pos, color);
-		blend(pos+3, color);
-		// Second row
-		pos = &PIXEL(x, y+1);
-		blend(pos, color);
-		// Third row
-		pos = &PIXEL(x, y+2);
-		blend(pos, color);
-		blend(pos+3, color);
-		// Last row
-		pos = &PIXEL(x, y+3);
-		blend(pos, color);
+		// For -update: the file has to hold an image of that size already. Only the header is written anew,
+		// the pixels stay, and the parts that changed are drawn over them right in the mapped file
+		if (fseek64(fh, 0, SEEK_END) != 0) return false;
+		const int64_t fileSize = int64_t(ftell64(fh));
+		if (!beginFile(fh, width, height) || fileSize != gBmpDataOffset + gBmpSize) return false;
+		gCanvas->width = gBmpWidth;
+		gCanvas->height = gBmpHeight;
+		if ((gBmpMap = mapFile(fh, gBmpDataOffset + gBmpSize)) == NULL) return false;
+		gCanvas->buffer = gBmpMap + rowPos(0);
+		gCanvas->lineWidth = (gTiff ? gBmpLineWidth : -gBmpLineWidth);
+		return true;
 	}
 
-	void setStep(const size_t &x, const size_t &y, const uint8_t *color, const uint8_t *light, const uint8_t *dark)
+	void unmapBitmap()
 	{
-		uint8_t *pos = &PIXEL(x, y+2);
-		for (size_t i = 0; i < 10; i += 3) {
-			memcpy(pos+i, color, 3);
-		}
-		pos = &PIXEL(x, y+3);
-		memcpy(pos+3, dark, 3);
-		memcpy(pos+6, light, 3);
+		unmapFile(gBmpMap, gBmpDataOffset + gBmpSize);
+		gBmpMap = NULL;
+		gCanvas->buffer = NULL;
 	}
 
 }
@@ -3,12 +3,32 @@
 
 #include "helper.h"
 
+// Bitmap and BigTIFF output. Only creating the image and drawing to it differs between the two,
+// the other functions work on whichever was created last
 bool createImageBmp(FILE* fh, size_t width, size_t height, bool splitUp);
+bool createImageTiff(FILE* fh, size_t width, size_t height, bool splitUp);
+bool openImageBmp(FILE* fh, size_t width, size_t height);
+bool openImageTiff(FILE* fh, size_t width, size_t height);
 bool saveImageBmp(FILE* fh);
 bool loadImagePartBmp(FILE* fh, int startx, int starty, int width, int height);
 void setPixelBmp(size_t x, size_t y, uint8_t color, float fsub);
 void blendPixelBmp(size_t x, size_t y, uint8_t color, float fsub);
+void drawLineBmp(size_t x, size_t y, size_t count, const uint8_t *colors, const uint8_t *ops);
+void beginTileBmp(int x, int y, int width, int height);
+void endTileBmp();
+void setPixelTiff(size_t x, size_t y, uint8_t color, float fsub);
+void blendPixelTiff(size_t x, size_t y, uint8_t color, float fsub);
+void drawLineTiff(size_t x, size_t y, size_t count, const uint8_t *colors, const uint8_t *ops);
+void beginTileTiff(int x, int y, int width, int height);
+void endTileTiff();
 bool saveImagePartBmp(FILE* fh);
-size_t calcImageSizeBmp(int mapChunksX, int mapChunksZ, size_t mapHeight, int &pixelsX, int &pixelsY, bool tight = false);
+bool beginPatchBmp(int x, int y, int width, int height);
+bool endPatchBmp();
+bool createStreamBmp(FILE* fh, size_t width, size_t height, int rows);
+bool createStreamTiff(FILE* fh, size_t width, size_t height, int rows);
+bool streamRowsBmp(FILE* fh, int rows);
+uint64_t calcImageSizeBmp(int mapChunksX, int mapChunksZ, size_t mapHeight, int &pixelsX, int &pixelsY, bool tight = false);
+uint64_t calcImageSizeTiff(int mapChunksX, int mapChunksZ, size_t mapHeight, int &pixelsX, int &pixelsY, bool tight = false);
+bool fitsImageBmp(int width, int height);
 
 #endif
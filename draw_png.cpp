@@ -1,144 +1,168 @@
 /**
- * This file contains functions to create and draw to a png image
+ * This file contains functions to create a png image and move the canvas to and from it
  */
 
 #include "draw_png.h"
 #include "helper.h"
 #include "colors.h"
 #include "globals.h"
+#include "canvas.h"
+#include "threads.h"
 #include <cstring>
 #include <cstdio>
 #include <cstdlib>
 #include <png.h>
-#include <list>
-#ifndef _WIN32
-#include <sys/stat.h>
-#endif
+#include <zlib.h>
+#include <vector>
+#include <algorithm>
 
 
-#define PIXEL(x,y) (gImageBuffer[((x) + gOffsetX) * 4 + ((y) + gOffsetY) * gPngLocalLineWidth])
-
 namespace {
-	struct ImagePart {
-		int x, y, width, height;
-		char *filename;
-		FILE *pngFileHandle;
-		png_structp pngPtr;
-		png_infop pngInfo;
-		ImagePart(const char* _file, int _x, int _y, int _w, int _h)
-		{
-			filename = strdup(_file);
-			x = _x; y = _y; width = _w; height = _h;
-			pngPtr = NULL;
-			pngFileHandle = NULL;
-			pngInfo = NULL;
-		}
-		~ImagePart()
-		{
-			free(filename);
-		}
-	};
-	typedef std::list<ImagePart*> imageList;
-	imageList partialImages;
-
-	uint8_t *gImageBuffer = NULL;
-	int gPngLocalLineWidth = 0, gPngLocalWidth = 0, gPngLocalHeight = 0;
+	Canvas<PixelRgba> gCanvas;
 	int gPngLineWidth = 0, gPngWidth = 0, gPngHeight = 0;
-	int gOffsetX = 0, gOffsetY = 0;
+	int gPngStreamRow = 0; // Rows written by streamRowsPng()
 	int64_t gPngSize = 0, gPngLocalSize = 0;
 	png_structp pngPtrMain = NULL; // Main image
 	png_infop pngInfoPtrMain = NULL;
-	png_structp pngPtrCurrent = NULL; // This will be either the same as above, or a temp image when using disk caching
-	FILE* gPngPartialFileHandle = NULL;
-
-	inline void blend(uint8_t* destination, const uint8_t* source);
-	inline void modColor(uint8_t* color, const int mod);
-	inline void addColor(uint8_t* color, uint8_t* add);
-
-	// Split them up so setPixelPng won't be one hell of a mess
-	void setSnow(const size_t &x, const size_t &y, const uint8_t *color);
-	void setTorch(const size_t &x, const size_t &y, const uint8_t *color);
-	void setFlower(const size_t &x, const size_t &y, const uint8_t *color);
-	void setFire(const size_t &x, const size_t &y, uint8_t *color, uint8_t *light, uint8_t *dark);
-	void setGrass(const size_t &x, const size_t &y, const uint8_t *color, const uint8_t *light, const uint8_t *dark, const int &sub);
-	void setFence(const size_t &x, const size_t &y, const uint8_t *color);
-	void setStep(const size_t &x, const size_t &y, const uint8_t *color, const uint8_t *light, const uint8_t *dark);
+	// With disk caching, the image is kept as raw rows in a scratch file in the temp dir until all parts are drawn,
+	// then composeFinalImagePng() encodes it. The file is mapped into memory if possible, so parts are drawn right
+	// into it; if not, the area of each part is read into the canvas and written back (gPartX/Y is where it goes)
+	FILE *gScratch = NULL;
+	uint8_t *gScratchMap = NULL;
+	int gPartX = 0, gPartY = 0;
+	uint8_t *gPngImage = NULL; // All of the image, if it is in memory or mapped
+
+	// Rows that are final are encoded on a thread of their own while drawing goes on, see rowsDonePng().
+	// rows is NULL if they are in the scratch file; zeroRows empty rows follow them
+	struct EncodeJob {
+		const uint8_t *rows;
+		int firstRow, count, zeroRows;
+	};
+	EncodeJob gEncodeJob;
+	void *gEncodeThread = NULL;
+	bool gEncodeOk = true;
+	int gPngEncoded = 0; // Rows handed to the encoder so far
+	std::vector<uint8_t> gStreamRows; // Copy of the rows of the band being encoded when streaming
+
+	bool beginPng(FILE* fh, size_t width, size_t height);
+	void closeScratch();
+	bool encodeRows(const EncodeJob &job, const bool progress);
+	size_t encodeThread(void *, size_t);
+	void startEncoder(const EncodeJob &job);
+	bool waitEncoder();
+
+	// Parallel encoding of the image data: rows are filtered and deflated in blocks on all threads, every block
+	// ending on a byte boundary (Z_SYNC_FLUSH), so they can simply be appended to each other to form one zlib
+	// stream, like pigz does. Only the adler32 checksums have to be combined
+	struct DeflateBlock {
+		const uint8_t *rows, *above; // NULL if they're still in the scratch file, see composeFinalImagePng()
+		int count, firstRow;
+		std::vector<uint8_t> data, out;
+		uLong adler;
+	};
+	std::vector<DeflateBlock> gDeflateBlocks;
+	std::vector<uint8_t> gPngAbove; // Last row written, needed for filtering the next one
+	uLong gPngAdler = 1;
+	bool gPngZlibHeader = false; // Whether the zlib header was written yet
+
+	void beginIdat();
+	bool writeIdat(png_structp png, const uint8_t *rows, int count, int firstRow = 0);
+	bool endIdat(png_structp png);
+	int idatBatchRows();
+	size_t deflateJob(void *, size_t job);
+	inline void filterRow(uint8_t *out, const uint8_t *row, const uint8_t *above, const int filter);
 }
 
 bool createImagePng(FILE* fh, size_t width, size_t height, bool splitUp)
 {
-	gPngLocalWidth = gPngWidth = (int)width;
-	gPngLocalHeight = gPngHeight = (int)height;
-	gPngLocalLineWidth = gPngLineWidth = gPngWidth * 4;
-	gPngSize = gPngLocalSize = gPngLineWidth * gPngHeight;
+	if (!beginPng(fh, width, height)) return false;
 	printf("Image dimensions are %dx%d, 32bpp, %.2fMiB\n", gPngWidth, gPngHeight, float(gPngSize / float(1024 * 1024)));
 	if (!splitUp) {
-		gImageBuffer = new uint8_t[gPngSize];
-		memset(gImageBuffer, 0, (size_t)gPngSize);
+		gCanvas.buffer = gPngImage = new uint8_t[gPngSize];
+		memset(gCanvas.buffer, 0, (size_t)gPngSize);
+		return true;
 	}
-	fseek64(fh, 0, SEEK_SET);
-	// Write header
-	pngPtrMain = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-
-	if (pngPtrMain == NULL) {
+	gScratch = openTempFile(g_TempDir);
+	if (gScratch == NULL) {
+		printf("Could not create a temporary file in %s; check permissions or use -tmpdir.\n", (g_TempDir == NULL ? "the temp dir" : g_TempDir));
 		return false;
 	}
+	gScratchMap = mapFile(gScratch, uint64_t(gPngSize));
+	if (gScratchMap != NULL) {
+		gCanvas.buffer = gPngImage = gScratchMap;
+		return true;
+	}
+	// Not mapped; a file that ends with a zero reads as zeros up to there
+	return fseek64(gScratch, gPngSize - 1, SEEK_SET) == 0 && fputc(0, gScratch) != EOF;
+}
 
-	pngInfoPtrMain = png_create_info_struct(pngPtrMain);
-
-	if (pngInfoPtrMain == NULL) {
-		png_destroy_write_struct(&pngPtrMain, NULL);
+bool openImagePng(FILE* fh, size_t width, size_t height)
+{
+	// For -update: read the image of the last run into memory, so the parts that changed can be drawn over it.
+	// saveImagePng() then writes all of it anew. fh is open for reading and writing
+	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_infop info = (png == NULL ? NULL : png_create_info_struct(png));
+	if (info == NULL) {
+		png_destroy_read_struct(&png, NULL, NULL);
 		return false;
 	}
-
-	if (setjmp(png_jmpbuf(pngPtrMain))) { // libpng will issue a longjmp on error, so code flow will end up
-		png_destroy_write_struct(&pngPtrMain, &pngInfoPtrMain); // here if something goes wrong in the code below
+	const size_t lineWidth = width * 4;
+	uint8_t *image = new uint8_t[lineWidth * height];
+	if (setjmp(png_jmpbuf(png))) { // libpng will issue a longjmp on error, so code flow will end up
+		png_destroy_read_struct(&png, &info, NULL); // here if something goes wrong in the code below
+		delete[] image;
 		return false;
 	}
-
-	png_init_io(pngPtrMain, fh);
-
-	png_set_IHDR(pngPtrMain, pngInfoPtrMain, (uint32_t)width, (uint32_t)height,
-			8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
-			PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-
-	png_text title_text;
-	title_text.compression = PNG_TEXT_COMPRESSION_NONE;
-	title_text.key = (png_charp)"Software";
-	title_text.text = (png_charp)"mcmap";
-	png_set_text(pngPtrMain, pngInfoPtrMain, &title_text, 1);
-
-	png_write_info(pngPtrMain, pngInfoPtrMain);
-	if (!splitUp) {
-		pngPtrCurrent = pngPtrMain;
+	fseek64(fh, 0, SEEK_SET);
+	png_init_io(png, fh);
+	png_set_user_limits(png, 0x7FFFFFFF, 0x7FFFFFFF);
+	png_read_info(png, info);
+	if (png_get_image_width(png, info) != width || png_get_image_height(png, info) != height || png_get_bit_depth(png, info) != 8
+			|| png_get_color_type(png, info) != PNG_COLOR_TYPE_RGBA || png_get_interlace_type(png, info) != PNG_INTERLACE_NONE) {
+		png_destroy_read_struct(&png, &info, NULL);
+		delete[] image;
+		return false;
 	}
+	for (size_t y = 0; y < height; ++y) {
+		png_read_row(png, image + y * lineWidth, NULL);
+	}
+	png_destroy_read_struct(&png, &info, NULL);
+	if (!truncateFile(fh, 0) || !beginPng(fh, width, height)) {
+		delete[] image;
+		return false;
+	}
+	printf("Image dimensions are %dx%d, 32bpp, %.2fMiB\n", gPngWidth, gPngHeight, float(gPngSize / float(1024 * 1024)));
+	gCanvas.buffer = gPngImage = image;
 	return true;
 }
 
 bool saveImagePng(FILE* fh)
 {
+	// Encode what wasn't encoded in the background yet
+	if (!waitEncoder()) {
+		png_destroy_write_struct(&pngPtrMain, &pngInfoPtrMain);
+		return false;
+	}
 	if (setjmp(png_jmpbuf(pngPtrMain))) { // libpng will issue a longjmp on error, so code flow will end up
 		png_destroy_write_struct(&pngPtrMain, &pngInfoPtrMain); // here if something goes wrong in the code below
 		return false;
 	}
-	uint8_t *line = gImageBuffer;
-	for (int y = 0; y < gPngHeight; ++y) {
-		png_write_row(pngPtrMain, (png_bytep)line);
-		line += gPngLineWidth;
-	}
-	png_write_end(pngPtrMain, NULL);
+	const EncodeJob rest = {gPngImage + int64_t(gPngEncoded) * gPngLineWidth, gPngEncoded, gPngHeight - gPngEncoded, 0};
+	const bool ok = encodeRows(rest, true) && endIdat(pngPtrMain);
 	png_destroy_write_struct(&pngPtrMain, &pngInfoPtrMain);
-	return true;
+	return ok;
 }
 
 bool loadImagePartPng(FILE* fh, int startx, int starty, int width, int height)
 {
-	if (pngPtrCurrent != NULL || gPngPartialFileHandle != NULL) {
-		printf("Something wrong with disk caching.\n");
-		return false;
-	}
-	gOffsetX = MIN(startx, 0);
-	gOffsetY = MIN(starty, 0);
+	if (gScratchMap != NULL) {
+		// The canvas covers the whole image, just move its origin to the area
+		gCanvas.offsetX = startx;
+		gCanvas.offsetY = starty;
+		return true;
+	}
+	gCanvas.offsetX = MIN(startx, 0);
+	gCanvas.offsetY = MIN(starty, 0);
 	if (startx < 0) {
 		width += startx;
 		startx = 0;
@@ -153,442 +177,451 @@ bool loadImagePartPng(FILE* fh, int startx, int starty, int width, int height)
 	if (starty + height > gPngHeight) {
 		height = gPngHeight - starty;
 	}
-	char name[200];
-	snprintf(name, 200, "cache/%d.%d.%d.%d.png", startx, starty, width, height);
-	ImagePart *img = new ImagePart(name, startx, starty, width, height);
-	partialImages.push_back(img);
-	//
-	gPngLocalWidth = width;
-	gPngLocalHeight = height;
-	gPngLocalLineWidth = gPngLocalWidth * 4;
-	int64_t size = gPngLocalLineWidth * gPngLocalHeight;
-	printf("Creating temporary image: %dx%d, 32bpp, %.2fMiB\n", gPngLocalWidth, gPngLocalHeight, float(size / float(1024 * 1024)));
-	if (gImageBuffer == NULL) {
-		gImageBuffer = new uint8_t[size];
-		gPngLocalSize = size;
-	} else if (size > gPngLocalSize) {
-		delete[] gImageBuffer;
-		gImageBuffer = new uint8_t[size];
+	gPartX = startx;
+	gPartY = starty;
+	gCanvas.width = width;
+	gCanvas.height = height;
+	gCanvas.lineWidth = gCanvas.width * 4;
+	const int64_t size = int64_t(gCanvas.lineWidth) * gCanvas.height;
+	if (gCanvas.buffer == NULL || size > gPngLocalSize) {
+		delete[] gCanvas.buffer;
+		gCanvas.buffer = new uint8_t[size];
 		gPngLocalSize = size;
 	}
-	memset(gImageBuffer, 0, (size_t)size);
-	// Create temp image
-	// This is done here to detect early if the target is not writable
-#ifdef _WIN32
-	mkdir("cache");
-#else
-	mkdir("cache", 0755);
-#endif
-	gPngPartialFileHandle = fopen(name, "wb");
-	if (gPngPartialFileHandle == NULL) {
-		printf("Could not create temporary image at %s; check permissions in current dir.\n", name);
-		return false;
+	// The area might already contain parts of the ones drawn before
+	for (int y = 0; y < height; ++y) {
+		fseek64(gScratch, int64_t(starty + y) * gPngLineWidth + startx * 4, SEEK_SET);
+		if ((int)fread(gCanvas.row(y), 1, gCanvas.lineWidth, gScratch) != gCanvas.lineWidth) return false;
 	}
 	return true;
 }
 
 bool saveImagePartPng(FILE* fh)
 {
-	// Write header
-	png_infop info_ptr = NULL;
-	pngPtrCurrent = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-
-	if (pngPtrCurrent == NULL) {
-		return false;
+	if (gScratchMap != NULL) return true; // Drawn right into the scratch file
+	for (int y = 0; y < gCanvas.height; ++y) {
+		fseek64(gScratch, int64_t(gPartY + y) * gPngLineWidth + gPartX * 4, SEEK_SET);
+		if ((int)fwrite(gCanvas.row(y), 1, gCanvas.lineWidth, gScratch) != gCanvas.lineWidth) return false;
 	}
+	return true;
+}
 
-	info_ptr = png_create_info_struct(pngPtrCurrent);
+bool beginPatchPng(int x, int y, int width, int height)
+{
+	// Same as beginPatchBmp(), the whole image is in memory
+	gCanvas.offsetX = x;
+	gCanvas.offsetY = y;
+	gCanvas.clear(0, 0, width, height);
+	return true;
+}
+
+bool endPatchPng()
+{
+	return true;
+}
+
+bool createStreamPng(FILE* fh, size_t width, size_t height, int rows)
+{
+	// Like createImagePng, but only a band of rows is kept in memory, which streamRowsPng() moves down the image
+	if (!beginPng(fh, width, height)) return false;
+	printf("Image dimensions are %dx%d, 32bpp, %.2fMiB\n", gPngWidth, gPngHeight, float(gPngSize / float(1024 * 1024)));
+	gCanvas.height = rows;
+	gPngLocalSize = int64_t(gCanvas.lineWidth) * rows;
+	printf("Keeping %d rows at a time, %.2fMiB\n", rows, float(gPngLocalSize / float(1024 * 1024)));
+	gCanvas.buffer = new uint8_t[gPngLocalSize];
+	memset(gCanvas.buffer, 0, (size_t)gPngLocalSize);
+	gCanvas.offsetX = gCanvas.offsetY = 0;
+	gPngStreamRow = 0;
+	return true;
+}
 
-	if (info_ptr == NULL) {
-		png_destroy_write_struct(&pngPtrCurrent, NULL);
+bool streamRowsPng(FILE* fh, int rows)
+{
+	// Hand the top rows of the band to the encoder, then move the band down by as many rows.
+	// The encoder works on a copy, so drawing can go on while it runs; only the last rows are encoded right away
+	if (!waitEncoder()) {
+		png_destroy_write_struct(&pngPtrMain, &pngInfoPtrMain);
 		return false;
 	}
-
-	if (setjmp(png_jmpbuf(pngPtrCurrent))) { // libpng will issue a longjmp on error, so code flow will end up
-		png_destroy_write_struct(&pngPtrCurrent, &info_ptr); // here if something goes wrong in the code below
+	if (setjmp(png_jmpbuf(pngPtrMain))) { // libpng will issue a longjmp on error, so code flow will end up
+		png_destroy_write_struct(&pngPtrMain, &pngInfoPtrMain); // here if something goes wrong in the code below
 		return false;
 	}
-
-	png_init_io(pngPtrCurrent, gPngPartialFileHandle);
-	png_set_compression_level(pngPtrCurrent, Z_BEST_SPEED);
-
-	png_set_IHDR(pngPtrCurrent, info_ptr, (uint32_t)gPngLocalWidth, (uint32_t)gPngLocalHeight,
-			8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
-			PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-
-	png_write_info(pngPtrCurrent, info_ptr);
-	//
-	uint8_t *line = gImageBuffer;
-	for (int y = 0; y < gPngLocalHeight; ++y) {
-		png_write_row(pngPtrCurrent, (png_bytep)line);
-		line += gPngLocalLineWidth;
+	const int write = MIN(rows, gPngHeight - gPngStreamRow);
+	if (write > 0) {
+		// Rows below the band were never drawn to
+		const int copy = MIN(write, gCanvas.height);
+		gStreamRows.assign(gCanvas.buffer, gCanvas.row(copy));
+		const EncodeJob job = {&gStreamRows[0], gPngStreamRow, copy, write - copy};
+		gPngStreamRow += write;
+		if (gPngStreamRow < gPngHeight) {
+			startEncoder(job);
+		} else {
+			const bool ok = encodeRows(job, false) && endIdat(pngPtrMain);
+			png_destroy_write_struct(&pngPtrMain, &pngInfoPtrMain);
+			if (!ok) return false;
+		}
 	}
-	png_write_end(pngPtrCurrent, NULL);
-	png_destroy_write_struct(&pngPtrCurrent, &info_ptr);
-	pngPtrCurrent = NULL;
-	fclose(gPngPartialFileHandle);
-	gPngPartialFileHandle = NULL;
+	rows = MIN(rows, gCanvas.height);
+	memmove(gCanvas.buffer, gCanvas.row(rows), size_t(gCanvas.height - rows) * gCanvas.lineWidth);
+	memset(gCanvas.row(gCanvas.height - rows), 0, size_t(rows) * gCanvas.lineWidth);
 	return true;
 }
 
 bool composeFinalImagePng()
 {
-	uint8_t *lineWrite = new uint8_t[gPngLineWidth];
-	uint8_t *lineRead = new uint8_t[gPngLineWidth];
+	// All parts are in the scratch file, encode what wasn't encoded in the background yet. If it isn't mapped,
+	// every thread reads the rows of the blocks it compresses itself, so reading overlaps with compressing
+	printf("Composing final png file...\n");
+	if (!waitEncoder()) {
+		png_destroy_write_struct(&pngPtrMain, NULL);
+		closeScratch();
+		return false;
+	}
 	if (setjmp(png_jmpbuf(pngPtrMain))) { // libpng will issue a longjmp on error, so code flow will end up
-		delete[] lineWrite;
-		delete[] lineRead;
+		closeScratch();
 		png_destroy_write_struct(&pngPtrMain, NULL); // here if something goes wrong in the code below
 		return false;
 	}
-	printf("Composing final png file...\n");
-	for (int y = 0; y < gPngHeight; ++y) {
-		if (y % 10 == 0) printProgress(size_t(y), size_t(gPngHeight));
-		// paint each image on this one
-		memset(lineWrite, 0, gPngLineWidth);
-		for (imageList::iterator it = partialImages.begin(); it != partialImages.end(); it++) {
-			ImagePart *img = *it;
-			// do we have to load?
-			if (img->y == y && img->pngPtr == NULL) {
-				img->pngFileHandle = fopen(img->filename, "rb");
-				img->pngPtr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-				if (img->pngPtr == NULL || img->pngFileHandle == NULL) {
-					fclose(img->pngFileHandle);
-					return false; // Not really cleaning up here, but program will terminate anyways, so why bother
-				}
-				img->pngInfo = png_create_info_struct(img->pngPtr);
-				if (img->pngInfo == NULL || setjmp(png_jmpbuf(img->pngPtr))) {
-					return false; // Same here
-				}
-				png_init_io(img->pngPtr, img->pngFileHandle);
-				png_read_info(img->pngPtr, img->pngInfo);
-				// TODO: maybe check image dimensions reported by libpng here. They should never really be different from what's expected
-			}
-			if (img->pngPtr == NULL) continue; // Not your turn, image!
-			// Read next line from current image chunk
-			png_read_row(img->pngPtr, (png_bytep)lineRead, NULL);
-			// Now this puts all the pixels in the right spot of the current line of the final image
-			const uint8_t *end = lineWrite + (img->x + img->width) * 4;
-			uint8_t *read = lineRead;
-			for (uint8_t *write = lineWrite + (img->x * 4); write < end; write += 4) {
-				blend(write, read);
-				read += 4;
-			}
-			// Now check if we're done with this image chunk
-			if (--(img->height) == 0) { // if so, close and discard
-				png_destroy_read_struct(&(img->pngPtr), &(img->pngInfo), NULL);
-				fclose(img->pngFileHandle);
-				img->pngFileHandle = NULL;
-				img->pngPtr = NULL;
-				//remove(img->filename);
-			}
-		} // Done composing this line, write to final image
-		png_write_row(pngPtrMain, (png_bytep)lineWrite);
-	}
-	printProgress(10, 10);
-	png_write_end(pngPtrMain, NULL);
+	const EncodeJob rest = {(gPngImage == NULL ? NULL : gPngImage + int64_t(gPngEncoded) * gPngLineWidth), gPngEncoded, gPngHeight - gPngEncoded, 0};
+	const bool ok = fflush(gScratch) == 0 && encodeRows(rest, true) && endIdat(pngPtrMain);
 	png_destroy_write_struct(&pngPtrMain, NULL);
-	delete[] lineWrite;
-	delete[] lineRead;
-	return true;
+	closeScratch();
+	return ok;
 }
 
-size_t calcImageSizePng(int mapChunksX, int mapChunksZ, size_t mapHeight, int &pixelsX, int &pixelsY, bool tight)
+void rowsDonePng(int rows)
+{
+	// Rows above 'rows' won't change anymore. Encode them on a thread of their own, unless it's still busy with the
+	// ones before; then they're handed over next time. Not worth it for only a few rows
+	rows = MIN(rows, gPngHeight);
+	if ((gEncodeThread != NULL && !threadDone(gEncodeThread)) || rows - gPngEncoded < idatBatchRows() / 2 || !waitEncoder()) return;
+	if (gPngImage == NULL && fflush(gScratch) != 0) return; // The encoder reads the file itself
+	const EncodeJob job = {(gPngImage == NULL ? NULL : gPngImage + int64_t(gPngEncoded) * gPngLineWidth), gPngEncoded, rows - gPngEncoded, 0};
+	gPngEncoded = rows;
+	startEncoder(job);
+}
+
+uint64_t calcImageSizePng(int mapChunksX, int mapChunksZ, size_t mapHeight, int &pixelsX, int &pixelsY, bool tight)
 {
 	pixelsX = (mapChunksX * CHUNKSIZE_X + mapChunksZ * CHUNKSIZE_Z) * 2 + (tight ? 3 : 10);
 	pixelsY = (mapChunksX * CHUNKSIZE_X + mapChunksZ * CHUNKSIZE_Z + (int)mapHeight * 2) + (tight ? 3 : 10);
-	return pixelsX * 4 * pixelsY;
+	return uint64_t(pixelsX) * 4 * uint64_t(pixelsY);
+}
+
+bool fitsImagePng(int width, int height)
+{
+	// The png format allows up to 2^31-1 pixels each way, but a line has to fit the int used for its size in bytes
+	return uint64_t(width) * 4 + 1 <= 0x7FFFFFFFu && height > 0;
 }
 
 void setPixelPng(size_t x, size_t y, uint8_t color, float fsub)
 {
-	// Sets pixels around x,y where A is the anchor
-	// T = given color, D = darker, L = lighter
-	// A T T T
-	// D D L L
-	// D D L L
-	//	  D L
-	// First determine how much the color has to be lightened up or darkened
-	int sub = int(fsub * (float(colors[color][BRIGHTNESS]) / 323.0f + .21f)); // The brighter the color, the stronger the impact
-	uint8_t L[4], D[4], c[4];
-	// Now make a local copy of the color that we can modify just for this one block
-	memcpy(c, colors[color]+8, 4);
-	modColor(c, sub);
-	// Then check the block type, as some types will be drawn differently
-	if (color == SNOW) {
-		setSnow(x, y, c);
-		return;
-	}
-	if (color == TORCH || color == REDTORCH_ON || color == REDTORCH_OFF) {
-		setTorch(x, y, c);
-		return;
-	}
-	if (color == FLOWERR || color == FLOWERY || color == MUSHROOMB || color == MUSHROOMR) {
-		setFlower(x, y, c);
-		return;
-	}
-	if (color == FENCE) {
-		setFence(x, y, c);
-		return;
-	}
-	// All the above blocks didn't need the shaded down versions of the color, so we only calc them here
-	// They are for the sides of blocks
-	memcpy(L, c, 4);
-	memcpy(D, c, 4);
-	modColor(L, -17);
-	modColor(D, -27);
-	// A few more blocks with special handling... Those need the two colors we just mixed
-	if (color == GRASS) {
-		setGrass(x, y, c, L, D, sub);
-		return;
-	}
-	if (color == FIRE) {
-		setFire(x, y, c, L, D);
-		return;
-	}
-	if (color == STEP) {
-		setStep(x, y, c, L, D);
-		return;
-	}
-	// In case the user wants noise, calc the strength now, depending on the desired intensity and the block's brightness
-	int noise = 0;
-	if (g_Noise && colors[color][NOISE]) {
-		noise = int(float(g_Noise * colors[color][NOISE]) * (float(GETBRIGHTNESS(c) + 10) / 2650.0f));
-	}
-	// Ordinary blocks are all rendered the same way
-	if (c[ALPHA] == 255) { // Fully opaque - faster
-		// Top row
-		uint8_t *pos = &PIXEL(x, y);
-		for (size_t i = 0; i < 4; ++i, pos += 4) {
-			memcpy(pos, c, 4);
-			if (noise) modColor(pos, rand() % (noise * 2) - noise);
+	gCanvas.setPixel(x, y, color, fsub);
+}
+
+void blendPixelPng(size_t x, size_t y, uint8_t color, float fsub)
+{
+	gCanvas.blendPixel(x, y, color, fsub);
+}
+
+void drawLinePng(size_t x, size_t y, size_t count, const uint8_t *colors, const uint8_t *ops)
+{
+	gCanvas.drawLine(x, y, count, colors, ops);
+}
+
+void beginTilePng(int x, int y, int width, int height)
+{
+	gCanvas.beginTile(x, y, width, height);
+}
+
+void endTilePng()
+{
+	gCanvas.endTile();
+}
+
+namespace {
+
+	bool beginPng(FILE* fh, size_t width, size_t height)
+	{
+		// Sizes of everything and the header
+		gCanvas.width = gPngWidth = (int)width;
+		gCanvas.height = gPngHeight = (int)height;
+		gCanvas.lineWidth = gPngLineWidth = gPngWidth * 4;
+		gCanvas.offsetX = gCanvas.offsetY = 0;
+		gPngSize = gPngLocalSize = int64_t(gPngLineWidth) * gPngHeight;
+		fseek64(fh, 0, SEEK_SET);
+		pngPtrMain = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+
+		if (pngPtrMain == NULL) {
+			return false;
 		}
-		// Second row
-		pos = &PIXEL(x, y+1);
-		for (size_t i = 0; i < 4; ++i, pos += 4) {
-			memcpy(pos, (i < 2 ? D : L), 4);
-			// The weird check here is to get the pattern right, as the noise should be stronger
-			// every other row, but take into account the isometric perspective
-			if (noise) modColor(pos, rand() % (noise * 2) - noise * (i == 0 || i == 3 ? 1 : 2));
+
+		pngInfoPtrMain = png_create_info_struct(pngPtrMain);
+
+		if (pngInfoPtrMain == NULL) {
+			png_destroy_write_struct(&pngPtrMain, NULL);
+			return false;
 		}
-		// Third row
-		pos = &PIXEL(x, y+2);
-		for (size_t i = 0; i < 4; ++i, pos += 4) {
-			memcpy(pos, (i < 2 ? D : L), 4);
-			if (noise) modColor(pos, rand() % (noise * 2) - noise * (i == 0 || i == 3 ? 2 : 1));
+
+		if (setjmp(png_jmpbuf(pngPtrMain))) { // libpng will issue a longjmp on error, so code flow will end up
+			png_destroy_write_struct(&pngPtrMain, &pngInfoPtrMain); // here if something goes wrong in the code below
+			return false;
 		}
-		// Last row
-		pos = &PIXEL(x, y+3);
-		memcpy(pos+=4, D, 4);
-		if (noise) modColor(pos, -(rand() % noise) * 2);
-		memcpy(pos+=4, L, 4);
-		if (noise) modColor(pos, -(rand() % noise) * 2);
-	} else { // Not opaque, use slower blending code
-		// Top row
-		uint8_t *pos = &PIXEL(x, y);
-		for (size_t i = 0; i < 4; ++i, pos += 4) {
-			blend(pos, c);
-			if (noise) modColor(pos, rand() % (noise * 2) - noise);
+
+		png_init_io(pngPtrMain, fh);
+		// libpng refuses images over 1000000 pixels wide or high by default
+		png_set_user_limits(pngPtrMain, 0x7FFFFFFF, 0x7FFFFFFF);
+
+		png_set_IHDR(pngPtrMain, pngInfoPtrMain, (uint32_t)width, (uint32_t)height,
+				8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
+				PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+
+		png_text title_text;
+		title_text.compression = PNG_TEXT_COMPRESSION_NONE;
+		title_text.key = (png_charp)"Software";
+		title_text.text = (png_charp)"mcmap";
+		png_set_text(pngPtrMain, pngInfoPtrMain, &title_text, 1);
+
+		png_write_info(pngPtrMain, pngInfoPtrMain);
+		gPngEncoded = 0;
+		gEncodeOk = true;
+		beginIdat();
+		return true;
+	}
+
+	void closeScratch()
+	{
+		// Closing the file deletes it
+		if (gScratchMap != NULL) {
+			unmapFile(gScratchMap, uint64_t(gPngSize));
+			gCanvas.buffer = gScratchMap = NULL;
 		}
-		// Second row
-		pos = &PIXEL(x, y+1);
-		for (size_t i = 0; i < 4; ++i, pos += 4) {
-			blend(pos, (i < 2 ? D : L));
-			if (noise) modColor(pos, rand() % (noise * 2) - noise * (i == 0 || i == 3 ? 1 : 2));
+		if (gScratch != NULL) fclose(gScratch);
+		gScratch = NULL;
+		gPngImage = NULL;
+	}
+
+	bool encodeRows(const EncodeJob &job, const bool progress)
+	{
+		// Encode the rows in batches, then the empty ones. Whoever calls this has to take care of libpng's longjmp
+		const int batch = idatBatchRows();
+		for (int y = 0; y < job.count; y += batch) {
+			if (progress) printProgress(size_t(job.firstRow + y), size_t(gPngHeight));
+			if (!writeIdat(pngPtrMain, (job.rows == NULL ? NULL : job.rows + size_t(y) * gPngLineWidth), MIN(batch, job.count - y), job.firstRow + y)) {
+				return false;
+			}
 		}
-		// Third row
-		pos = &PIXEL(x, y+2);
-		for (size_t i = 0; i < 4; ++i, pos += 4) {
-			blend(pos, (i < 2 ? D : L));
-			if (noise) modColor(pos, rand() % (noise * 2) - noise * (i == 0 || i == 3 ? 2 : 1));
+		if (job.zeroRows > 0) {
+			std::vector<uint8_t> zeros(size_t(MIN(batch, job.zeroRows)) * gPngLineWidth, 0);
+			for (int y = 0; y < job.zeroRows; y += batch) {
+				if (!writeIdat(pngPtrMain, &zeros[0], MIN(batch, job.zeroRows - y))) return false;
+			}
 		}
-		// Last row
-		pos = &PIXEL(x, y+3);
-		blend(pos+=4, D);
-		if (noise) modColor(pos, -(rand() % noise) * 2);
-		blend(pos+=4, L);
-		if (noise) modColor(pos, -(rand() % noise) * 2);
-	}
-	// The above two branches are almost the same, maybe one could just create a function pointer and...
-}
+		if (progress) printProgress(10, 10);
+		return true;
+	}
 
-void blendPixelPng(size_t x, size_t y, uint8_t color, float fsub)
-{	// This one is used for cave overlay
-	// Sets pixels around x,y where A is the anchor
-	// T = given color, D = darker, L = lighter
-	// A T T T
-	// D D L L
-	// D D L L
-	//	  D L
-	uint8_t L[4], D[4], c[4];
-	// Now make a local copy of the color that we can modify just for this one block
-	memcpy(c, colors[color]+8, 4);
-	c[ALPHA] = clamp(int(float(c[ALPHA]) * fsub)); // The brighter the color, the stronger the impact
-	// They are for the sides of blocks
-	memcpy(L, c, 4);
-	memcpy(D, c, 4);
-	modColor(L, -17);
-	modColor(D, -27);
-	// In case the user wants noise, calc the strength now, depending on the desired intensity and the block's brightness
-	int noise = 0;
-	if (g_Noise && colors[color][NOISE]) {
-		noise = int(float(g_Noise * colors[color][NOISE]) * (float(GETBRIGHTNESS(c) + 10) / 2650.0f));
-	}
-	// Top row
-	uint8_t *pos = &PIXEL(x, y);
-	for (size_t i = 0; i < 4; ++i, pos += 4) {
-		blend(pos, c);
-		if (noise) modColor(pos, rand() % (noise * 2) - noise);
-	}
-	// Second row
-	pos = &PIXEL(x, y+1);
-	for (size_t i = 0; i < 4; ++i, pos += 4) {
-		blend(pos, (i < 2 ? D : L));
-		if (noise) modColor(pos, rand() % (noise * 2) - noise * (i == 0 || i == 3 ? 1 : 2));
+	size_t encodeThread(void *, size_t)
+	{
+		if (setjmp(png_jmpbuf(pngPtrMain))) { // libpng's longjmp has to stay on this thread
+			return 1;
+		}
+		return (encodeRows(gEncodeJob, false) ? 0 : 1);
 	}
-}
 
-namespace {
+	void startEncoder(const EncodeJob &job)
+	{
+		// Nothing may use pngPtrMain until waitEncoder(). If no thread can be started, encode right away
+		gEncodeJob = job;
+		gEncodeThread = startThread(&encodeThread, NULL);
+		if (gEncodeThread == NULL) {
+			gEncodeOk = (encodeThread(NULL, 0) == 0) && gEncodeOk;
+		}
+	}
 
-	inline void blend(uint8_t* destination, const uint8_t* source)
+	bool waitEncoder()
 	{
-		if (destination[ALPHA] == 0 || source[ALPHA] == 255) {
-			memcpy(destination, source, 4);
-			return;
+		// Has to be called before setjmp(), the encoder thread sets libpng's jump buffer to its own
+		if (gEncodeThread != NULL) {
+			gEncodeOk = (joinThread(gEncodeThread) == 0) && gEncodeOk;
+			gEncodeThread = NULL;
 		}
-#		define BLEND(ca,aa,cb) uint8_t(((size_t(ca) * size_t(aa)) + (size_t(255 - aa) * size_t(cb))) / 255)
-		destination[0] = BLEND(source[0], source[ALPHA], destination[0]);
-		destination[1] = BLEND(source[1], source[ALPHA], destination[1]);
-		destination[2] = BLEND(source[2], source[ALPHA], destination[2]);
-		destination[ALPHA] += (size_t(source[ALPHA]) * size_t(255 - destination[ALPHA])) / 255;
+		return gEncodeOk;
 	}
 
-	inline void modColor(uint8_t* color, const int mod)
+	void beginIdat()
 	{
-		color[0] = clamp(color[0] + mod);
-		color[1] = clamp(color[1] + mod);
-		color[2] = clamp(color[2] + mod);
+		gPngAbove.assign(gPngLineWidth, 0); // Row above the first one is all zeros for the filters
+		gPngAdler = adler32(0, NULL, 0);
+		gPngZlibHeader = false;
 	}
 
-	inline void addColor(uint8_t* color, uint8_t* add)
+	bool writeIdat(png_structp png, const uint8_t *rows, int count, int firstRow)
 	{
-		const float v2 = (float(add[ALPHA]) / 255.0f);
-		const float v1 = (1.0f - (v2 * .2f));
-		color[0] = clamp(uint16_t(float(color[0]) * v1 + float(add[0]) * v2));
-		color[1] = clamp(uint16_t(float(color[1]) * v1 + float(add[1]) * v2));
-		color[2] = clamp(uint16_t(float(color[2]) * v1 + float(add[2]) * v2));
+		// Encode 'count' rows in blocks on all threads and write them as one IDAT chunk.
+		// If rows is NULL, they're read from the scratch file, starting at row firstRow of the image.
+		// Blocks are at least PNGBLOCKMIN bytes, as every block starts without a dictionary,
+		// and at most PNGBLOCKMAX, to spread big batches evenly
+#		define PNGBLOCKMIN (128 * 1024)
+#		define PNGBLOCKMAX (1024 * 1024)
+		const int minRows = MAX(1, PNGBLOCKMIN / gPngLineWidth), maxRows = MAX(1, PNGBLOCKMAX / gPngLineWidth);
+		const int perBlock = MIN(MAX((count + numThreads() - 1) / numThreads(), minRows), maxRows);
+		gDeflateBlocks.resize((count + perBlock - 1) / perBlock);
+		for (size_t i = 0; i < gDeflateBlocks.size(); ++i) {
+			DeflateBlock &block = gDeflateBlocks[i];
+			block.rows = (rows == NULL ? NULL : rows + i * perBlock * size_t(gPngLineWidth));
+			block.above = (i == 0 ? &gPngAbove[0] : (rows == NULL ? NULL : block.rows - gPngLineWidth));
+			block.count = MIN(perBlock, count - int(i) * perBlock);
+			block.firstRow = firstRow + int(i) * perBlock;
+		}
+		if (runJobs(&deflateJob, NULL, gDeflateBlocks.size(), false) != 0) {
+			printf("Error compressing image data.\n");
+			return false;
+		}
+		const std::vector<uint8_t> &last = gDeflateBlocks.back().data;
+		memcpy(&gPngAbove[0], (rows == NULL ? &last[last.size() - gPngLineWidth] : rows + size_t(count - 1) * gPngLineWidth), gPngLineWidth);
+		// Compressed blocks follow each other in one chunk; the first one starts the zlib stream
+		uint8_t header[2] = {0x78, 0};
+		png_uint_32 length = (gPngZlibHeader ? 0 : 2);
+		for (size_t i = 0; i < gDeflateBlocks.size(); ++i) {
+			length += png_uint_32(gDeflateBlocks[i].out.size());
+		}
+		png_write_chunk_start(png, (png_bytep)"IDAT", length);
+		if (!gPngZlibHeader) {
+			header[1] = uint8_t((g_PngLevel < 2 ? 0 : (g_PngLevel < 6 ? 1 : (g_PngLevel == 6 ? 2 : 3))) << 6);
+			header[1] += 31 - (header[0] * 256 + header[1]) % 31;
+			png_write_chunk_data(png, header, 2);
+			gPngZlibHeader = true;
+		}
+		for (size_t i = 0; i < gDeflateBlocks.size(); ++i) {
+			DeflateBlock &block = gDeflateBlocks[i];
+			if (!block.out.empty()) png_write_chunk_data(png, &block.out[0], block.out.size());
+			gPngAdler = adler32_combine(gPngAdler, block.adler, z_off_t(block.count) * (gPngLineWidth + 1));
+			std::vector<uint8_t>().swap(block.out);
+			std::vector<uint8_t>().swap(block.data);
+		}
+		png_write_chunk_end(png);
+		return true;
 	}
 
-	void setSnow(const size_t &x, const size_t &y, const uint8_t *color)
+	bool endIdat(png_structp png)
 	{
-		// Top row (second row)
-		uint8_t *pos = &PIXEL(x, y+1);
-		for (size_t i = 0; i < 13; i += 4) {
-			memcpy(pos+i, color, 4);
+		// An empty final block and the checksum close the zlib stream
+		uint8_t tail[8] = {0x78, 1, 0x03, 0x00,
+				uint8_t(gPngAdler >> 24), uint8_t(gPngAdler >> 16), uint8_t(gPngAdler >> 8), uint8_t(gPngAdler)};
+		if (gPngZlibHeader) {
+			png_write_chunk(png, (png_bytep)"IDAT", tail + 2, 6);
+		} else { // No rows at all
+			png_write_chunk(png, (png_bytep)"IDAT", tail, 8);
 		}
+		png_write_chunk(png, (png_bytep)"IEND", NULL, 0);
+		png_write_flush(png);
+		return true;
 	}
 
-	void setTorch(const size_t &x, const size_t &y, const uint8_t *color)
-	{ // Maybe the orientation should be considered when drawing, but it probably isn't worth the efford
-		uint8_t *pos = &PIXEL(x+2, y+1);
-		memcpy(pos, color, 4);
-		pos = &PIXEL(x+2, y+2);
-		memcpy(pos, color, 4);
+	int idatBatchRows()
+	{
+		// How many rows to hand to writeIdat() at once, so all threads get a few blocks
+		return MAX(1, PNGBLOCKMAX / gPngLineWidth) * numThreads() * 2;
 	}
 
-	void setFlower(const size_t &x, const size_t &y, const uint8_t *color)
+	size_t deflateJob(void *, size_t job)
 	{
-		uint8_t *pos = &PIXEL(x, y+1);
-		memcpy(pos+4, color, 4);
-		memcpy(pos+12, color, 4);
-		pos = &PIXEL(x+2, y+2);
-		memcpy(pos, color, 4);
-		pos = &PIXEL(x+1, y+3);
-		memcpy(pos, color, 4);
-	}
-
-	void setFire(const size_t &x, const size_t &y, uint8_t *color, uint8_t *light, uint8_t *dark)
-	{	// This basically just leaves out a few pixels
-		// Top row
-		uint8_t *pos = &PIXEL(x, y);
-		for (size_t i = 0; i < 10; i += 8) {
-			blend(pos+i, color);
-		}
-		// Second and third row
-		for (size_t i = 1; i < 3; ++i) {
-			pos = &PIXEL(x, y+i);
-			blend(pos, dark);
-			blend(pos+(4*i), dark);
-			blend(pos+12, light);
+		DeflateBlock &block = gDeflateBlocks[job];
+		const size_t rowBytes = gPngLineWidth + 1;
+		const uint8_t *above = block.above, *row = block.rows;
+		if (row == NULL) { // Read the rows, and the one above unless it's the last one of the previous batch
+			const int extra = (above == NULL ? 1 : 0);
+			block.data.resize(size_t(block.count + extra) * gPngLineWidth);
+			if (!readFileAt(gScratch, uint64_t(block.firstRow - extra) * gPngLineWidth, &block.data[0], block.data.size())) {
+				return 1;
+			}
+			above = (extra ? &block.data[0] : above);
+			row = &block.data[size_t(extra) * gPngLineWidth];
 		}
-		// Last row
-		pos = &PIXEL(x, y+3);
-		blend(pos+8, light);
-	}
-
-	void setGrass(const size_t &x, const size_t &y, const uint8_t *color, const uint8_t *light, const uint8_t *dark, const int &sub)
-	{	// this will make grass look like dirt from the side
-		uint8_t L[4], D[4];
-		memcpy(L, colors[DIRT]+8, 4);
-		memcpy(D, colors[DIRT]+8, 4);
-		modColor(L, sub - 15);
-		modColor(D, sub - 25);
-		// consider noise
-		int noise = 0;
-		if (g_Noise && colors[GRASS][NOISE]) {
-			noise = int(float(g_Noise * colors[GRASS][NOISE]) * (float(GETBRIGHTNESS(color) + 10) / 2650.0f));
+		z_stream stream;
+		memset(&stream, 0, sizeof(stream));
+		// Raw deflate, header and checksum are written separately
+		if (deflateInit2(&stream, g_PngLevel, Z_DEFLATED, -15, 8, (g_PngFilter == 0 ? Z_DEFAULT_STRATEGY : Z_FILTERED)) != Z_OK) {
+			return 1;
 		}
-		// Top row
-		uint8_t *pos = &PIXEL(x, y);
-		for (size_t i = 0; i < 4; ++i, pos += 4) {
-			memcpy(pos, color, 4);
-			if (noise) modColor(pos, rand() % (noise * 2) - noise);
+		block.out.resize(deflateBound(&stream, uLong(rowBytes * block.count)) + 16);
+		stream.next_out = &block.out[0];
+		stream.avail_out = uInt(block.out.size());
+		uint8_t *filtered = new uint8_t[rowBytes], *trial = new uint8_t[rowBytes];
+		block.adler = adler32(0, NULL, 0);
+		for (int y = 0; y < block.count; ++y) {
+			if (g_PngFilter < 5) {
+				filterRow(filtered, row, above, g_PngFilter);
+			} else {
+				// Try all filters and keep the one with the lowest sum of absolute (signed) values, the same heuristic libpng uses
+				int bestSum = 0x7FFFFFFF;
+				for (int f = 0; f < 5; ++f) {
+					filterRow(trial, row, above, f);
+					int sum = 0;
+					for (size_t i = 1; i < rowBytes && sum < bestSum; ++i) {
+						sum += abs(int(int8_t(trial[i])));
+					}
+					if (sum < bestSum) {
+						bestSum = sum;
+						std::swap(filtered, trial);
+					}
+				}
+			}
+			block.adler = adler32(block.adler, filtered, uInt(rowBytes));
+			stream.next_in = filtered;
+			stream.avail_in = uInt(rowBytes);
+			do {
+				if (stream.avail_out == 0) { // Didn't compress well, make room
+					const size_t used = block.out.size();
+					block.out.resize(used * 2);
+					stream.next_out = &block.out[used];
+					stream.avail_out = uInt(block.out.size() - used);
+				}
+				deflate(&stream, (y + 1 == block.count ? Z_SYNC_FLUSH : Z_NO_FLUSH));
+			} while (stream.avail_out == 0);
+			above = row;
+			row += gPngLineWidth;
 		}
-		// Second row
-		pos = &PIXEL(x, y+1);
-		memcpy(pos, dark, 4);
-		memcpy(pos+4, dark, 4);
-		memcpy(pos+8, light, 4);
-		memcpy(pos+12, light, 4);
-		// Third row
-		pos = &PIXEL(x, y+2);
-		memcpy(pos, D, 4);
-		memcpy(pos+4, D, 4);
-		memcpy(pos+8, L, 4);
-		memcpy(pos+12, L, 4);
-		// Last row
-		pos = &PIXEL(x, y+3);
-		memcpy(pos+4, D, 4);
-		memcpy(pos+8, L, 4);
-	}
-
-	void setFence(const size_t &x, const size_t &y, const uint8_t *color)
+		block.out.resize(block.out.size() - stream.avail_out);
+		deflateEnd(&stream);
+		delete[] filtered;
+		delete[] trial;
+		return 0;
+	}
+
+	inline uint8_t paeth(const int a, const int b, const int c)
 	{
-		// First row
-		uint8_t *pos = &PIXEL(x, y);
-		blend(pos, color);
-		blend(pos+4, color);
-		// Second row
-		pos = &PIXEL(x, y+1);
-		blend(pos, color);
-		// Third row
-		pos = &PIXEL(x, y+2);
-		blend(pos, color);
-		blend(pos+4, color);
-		// Last row
-		pos = &PIXEL(x, y+3);
-		blend(pos, color);
-	}
-
-	void setStep(const size_t &x, const size_t &y, const uint8_t *color, const uint8_t *light, const uint8_t *dark)
+		const int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+		return uint8_t(pa <= pb && pa <= pc ? a : (pb <= pc ? b : c));
+	}
+
+	inline void filterRow(uint8_t *out, const uint8_t *row, const uint8_t *above, const int filter)
 	{
-		uint8_t *pos = &PIXEL(x, y+2);
-		for (size_t i = 0; i < 10; i += 4) {
-			memcpy(pos+i, color, 4);
+		// Write filter type and the row filtered with it to out. The first pixel has nothing to its left
+		const int bytes = gPngLineWidth;
+		out[0] = uint8_t(filter);
+		++out;
+		switch (filter) {
+		case 1:
+			memcpy(out, row, 4);
+			for (int i = 4; i < bytes; ++i) out[i] = uint8_t(row[i] - row[i - 4]);
+			break;
+		case 2:
+			for (int i = 0; i < bytes; ++i) out[i] = uint8_t(row[i] - above[i]);
+			break;
+		case 3:
+			for (int i = 0; i < 4; ++i) out[i] = uint8_t(row[i] - (above[i] >> 1));
+			for (int i = 4; i < bytes; ++i) out[i] = uint8_t(row[i] - ((row[i - 4] + above[i]) >> 1));
+			break;
+		case 4:
+			for (int i = 0; i < 4; ++i) out[i] = uint8_t(row[i] - above[i]);
+			for (int i = 4; i < bytes; ++i) out[i] = uint8_t(row[i] - paeth(row[i - 4], above[i], above[i - 4]));
+			break;
+		default:
+			memcpy(out, row, bytes);
 		}
-		pos = &PIXEL(x, y+3);
-		memcpy(pos+4, dark, 4);
-		memcpy(pos+8, light, 4);
 	}
 
 }
@@ -4,12 +4,22 @@
 #include "helper.h"
 
 bool createImagePng(FILE* fh, size_t width, size_t height, bool splitUp);
+bool openImagePng(FILE* fh, size_t width, size_t height);
 bool saveImagePng(FILE* fh);
 bool loadImagePartPng(FILE* fh, int startx, int starty, int width, int height);
 void setPixelPng(size_t x, size_t y, uint8_t color, float fsub);
 void blendPixelPng(size_t x, size_t y, uint8_t color, float fsub);
+void drawLinePng(size_t x, size_t y, size_t count, const uint8_t *colors, const uint8_t *ops);
+void beginTilePng(int x, int y, int width, int height);
+void endTilePng();
 bool saveImagePartPng(FILE* fh);
+bool beginPatchPng(int x, int y, int width, int height);
+bool endPatchPng();
 bool composeFinalImagePng();
-size_t calcImageSizePng(int mapChunksX, int mapChunksZ, size_t mapHeight, int &pixelsX, int &pixelsY, bool tight = false);
+bool createStreamPng(FILE* fh, size_t width, size_t height, int rows);
+bool streamRowsPng(FILE* fh, int rows);
+void rowsDonePng(int rows);
+uint64_t calcImageSizePng(int mapChunksX, int mapChunksZ, size_t mapHeight, int &pixelsX, int &pixelsY, bool tight = false);
+bool fitsImagePng(int width, int height);
 
 #endif
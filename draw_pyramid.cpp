@@ -0,0 +1,463 @@
+/**
+ * Tile pyramid for web maps (Leaflet, OpenLayers, ...): instead of one image, the map is written as
+ * MAPTILE x MAPTILE png tiles named g_TileDir/zoom/x/y.png while it is rendered. The highest zoom level is
+ * the image at full size, every level below it half the size of the one above, down to level 0, which fits
+ * into one tile. Tiles nothing was drawn to are left out.
+ * The image is always streamed (see streamRowsPng()), and only one row of tiles is kept per level, so
+ * memory use only grows with the width of the map.
+ * With -update, only the tiles of the highest level the changed parts are drawn to are written anew, see
+ * beginPatchPyramid(); the tiles below them are then made from the four tiles above each in saveImagePyramid()
+ */
+
+#include "draw_pyramid.h"
+#include "helper.h"
+#include "globals.h"
+#include "canvas.h"
+#include "threads.h"
+#include <cstring>
+#include <cstdio>
+#include <png.h>
+#include <vector>
+#include <set>
+
+// Size of the tiles in pixels, the usual one for web maps
+#define MAPTILE 256
+
+namespace {
+	Canvas<PixelRgba> gCanvas; // Band of rows being drawn to
+	int gWidth = 0, gHeight = 0;
+	int gStreamRow = 0; // Rows of the image handed to the pyramid so far
+	size_t gTilesWritten = 0;
+
+	// The row of tiles of a zoom level that is being filled, top to bottom. Once it is full its tiles are written,
+	// and it is shrunk to half its size into the level below
+	struct Level {
+		int zoom, tilesX, tileY, rows;
+		size_t lineWidth;
+		std::vector<uint8_t> pixels; // MAPTILE rows of lineWidth bytes
+		std::vector<char> haveDir; // Whether the directory of tile column x was created yet
+		std::vector<char> state; // Of each tile of the row: 0 = empty, 1 = written, 2 = error
+	};
+	std::vector<Level> gLevels; // Index is the zoom level
+
+	// -update: highest zoom level, where the patch being drawn is (in tiles), and the tiles of each level below
+	// that have to be made anew from the ones above them
+	int gMaxZoom = 0;
+	int gPatchX = 0, gPatchY = 0, gPatchTilesX = 0, gPatchTilesY = 0;
+	struct Changed {
+		int zoom;
+		std::vector<std::pair<int, int> > tiles;
+		std::vector<char> state; // Same as Level::state
+	};
+	std::vector<std::set<std::pair<int, int> > > gChanged;
+
+	int zoomLevels(const int width, const int height);
+	bool addRows(const uint8_t *rows, int count);
+	bool flushLevel(const int zoom);
+	bool finishPyramid();
+	size_t tileJob(void *level, size_t x);
+	size_t shrinkJob(void *level, size_t y);
+	size_t patchJob(void *state, size_t tile);
+	size_t changedJob(void *changed, size_t tile);
+	inline void shrinkRow(const uint8_t *top, const uint8_t *bottom, uint8_t *out, const size_t width);
+	bool emptyTile(const uint8_t *tile, const size_t lineWidth);
+	string tileName(const int zoom, const int x, const int y);
+	char putTile(const int zoom, const int x, const int y, const uint8_t *tile, const size_t lineWidth);
+	bool writeTile(const string &path, const uint8_t *tile, const size_t lineWidth);
+	bool readTile(const string &path, uint8_t *tile);
+}
+
+bool createStreamPyramid(FILE* fh, size_t width, size_t height, int rows)
+{
+	// fh isn't used, every tile is a file of its own. As with createStreamPng(), rows is the height of the band drawn to
+	gWidth = (int)width;
+	gHeight = (int)height;
+	const int maxZoom = zoomLevels(gWidth, gHeight);
+	if (!createDir(g_TileDir)) {
+		printf("Could not create directory '%s'\n", g_TileDir);
+		return false;
+	}
+	gLevels.resize(maxZoom + 1);
+	uint64_t bytes = 0;
+	for (int zoom = 0; zoom <= maxZoom; ++zoom) {
+		Level &level = gLevels[zoom];
+		const int shift = maxZoom - zoom;
+		level.zoom = zoom;
+		level.tilesX = MAX(1, (((gWidth + (1 << shift) - 1) >> shift) + MAPTILE - 1) / MAPTILE);
+		level.tileY = level.rows = 0;
+		level.lineWidth = size_t(level.tilesX) * MAPTILE * 4;
+		level.pixels.assign(level.lineWidth * MAPTILE, 0);
+		level.haveDir.assign(level.tilesX, 0);
+		bytes += level.pixels.size();
+		char name[20];
+		snprintf(name, sizeof(name), "/%d", zoom);
+		if (!createDir((string(g_TileDir) + name).c_str())) {
+			printf("Could not create directory '%s%s'\n", g_TileDir, name);
+			return false;
+		}
+	}
+	printf("Image dimensions are %dx%d, writing zoom levels 0 to %d as %dx%d tiles to '%s'\n", gWidth, gHeight, maxZoom, MAPTILE, MAPTILE, g_TileDir);
+	gCanvas.width = gWidth;
+	gCanvas.height = rows;
+	gCanvas.lineWidth = gWidth * 4;
+	gCanvas.offsetX = gCanvas.offsetY = 0;
+	const size_t bandSize = size_t(gCanvas.lineWidth) * rows;
+	printf("Keeping %d rows and a row of tiles per zoom level at a time, %.2fMiB\n", rows, float(double(bandSize + bytes) / double(1024 * 1024)));
+	gCanvas.buffer = new uint8_t[bandSize];
+	memset(gCanvas.buffer, 0, bandSize);
+	gStreamRow = 0;
+	gTilesWritten = 0;
+	return true;
+}
+
+bool streamRowsPyramid(FILE* fh, int rows)
+{
+	// Same as streamRowsPng(): the top rows of the band are done, hand them over and move the band down
+	const int write = MIN(rows, gHeight - gStreamRow);
+	if (write > 0) {
+		// Rows below the band were never drawn to
+		const int copy = MIN(write, gCanvas.height);
+		if (!addRows(gCanvas.buffer, copy) || !addRows(NULL, write - copy)) return false;
+		gStreamRow += write;
+		if (gStreamRow == gHeight && !finishPyramid()) return false;
+	}
+	rows = MIN(rows, gCanvas.height);
+	memmove(gCanvas.buffer, gCanvas.row(rows), size_t(gCanvas.height - rows) * gCanvas.lineWidth);
+	memset(gCanvas.row(gCanvas.height - rows), 0, size_t(rows) * gCanvas.lineWidth);
+	return true;
+}
+
+bool openImagePyramid(FILE* fh, size_t width, size_t height)
+{
+	// For -update: the tiles of the last run have to be there. Level 0 has a tile unless nothing was drawn at all
+	gWidth = (int)width;
+	gHeight = (int)height;
+	gMaxZoom = zoomLevels(gWidth, gHeight);
+	if (!fileExists(tileName(0, 0, 0).c_str())) return false;
+	printf("Image dimensions are %dx%d, updating the tiles of zoom levels 0 to %d in '%s'\n", gWidth, gHeight, gMaxZoom, g_TileDir);
+	gChanged.assign(gMaxZoom, std::set<std::pair<int, int> >());
+	gTilesWritten = 0;
+	gCanvas.offsetX = gCanvas.offsetY = 0;
+	return true;
+}
+
+bool beginPatchPyramid(int x, int y, int width, int height)
+{
+	// Patches always start and end at the edges of tiles of the highest level. The canvas is just the patch
+	gPatchX = x / MAPTILE;
+	gPatchY = y / MAPTILE;
+	gPatchTilesX = (width + MAPTILE - 1) / MAPTILE;
+	gPatchTilesY = (height + MAPTILE - 1) / MAPTILE;
+	gCanvas.width = gPatchTilesX * MAPTILE;
+	gCanvas.height = gPatchTilesY * MAPTILE;
+	gCanvas.lineWidth = gCanvas.width * 4;
+	delete[] gCanvas.buffer;
+	gCanvas.buffer = new uint8_t[size_t(gCanvas.lineWidth) * gCanvas.height];
+	memset(gCanvas.buffer, 0, size_t(gCanvas.lineWidth) * gCanvas.height);
+	return true;
+}
+
+bool endPatchPyramid()
+{
+	// Write the patch's tiles, or remove those that are empty now, and remember the ones below them
+	std::vector<char> state(size_t(gPatchTilesX) * gPatchTilesY, 0);
+	runJobs(&patchJob, &state, state.size(), false);
+	for (size_t i = 0; i < state.size(); ++i) {
+		const int x = gPatchX + int(i) % gPatchTilesX, y = gPatchY + int(i) / gPatchTilesX;
+		if (state[i] == 2) {
+			printf("Error writing tile %d/%d/%d.png to '%s'\n", gMaxZoom, x, y, g_TileDir);
+			return false;
+		}
+		gTilesWritten += size_t(state[i]);
+		if (gMaxZoom > 0) gChanged[gMaxZoom - 1].insert(std::make_pair(x / 2, y / 2));
+	}
+	return true;
+}
+
+bool saveImagePyramid(FILE* fh)
+{
+	// -update is done drawing: make the tiles below the changed ones anew, highest level first, each from the four above it
+	for (int zoom = gMaxZoom - 1; zoom >= 0; --zoom) {
+		Changed changed;
+		changed.zoom = zoom;
+		changed.tiles.assign(gChanged[zoom].begin(), gChanged[zoom].end());
+		changed.state.assign(changed.tiles.size(), 0);
+		runJobs(&changedJob, &changed, changed.tiles.size(), false);
+		for (size_t i = 0; i < changed.tiles.size(); ++i) {
+			if (changed.state[i] == 2) {
+				printf("Error updating tile %d/%d/%d.png in '%s'\n", zoom, changed.tiles[i].first, changed.tiles[i].second, g_TileDir);
+				return false;
+			}
+			gTilesWritten += size_t(changed.state[i]);
+			if (zoom > 0) gChanged[zoom - 1].insert(std::make_pair(changed.tiles[i].first / 2, changed.tiles[i].second / 2));
+		}
+	}
+	printf("Wrote %d tiles\n", (int)gTilesWritten);
+	delete[] gCanvas.buffer;
+	gCanvas.buffer = NULL;
+	std::vector<std::set<std::pair<int, int> > >().swap(gChanged);
+	return true;
+}
+
+void setPixelPyramid(size_t x, size_t y, uint8_t color, float fsub)
+{
+	gCanvas.setPixel(x, y, color, fsub);
+}
+
+void blendPixelPyramid(size_t x, size_t y, uint8_t color, float fsub)
+{
+	gCanvas.blendPixel(x, y, color, fsub);
+}
+
+void drawLinePyramid(size_t x, size_t y, size_t count, const uint8_t *colors, const uint8_t *ops)
+{
+	gCanvas.drawLine(x, y, count, colors, ops);
+}
+
+void beginTilePyramid(int x, int y, int width, int height)
+{
+	gCanvas.beginTile(x, y, width, height);
+}
+
+void endTilePyramid()
+{
+	gCanvas.endTile();
+}
+
+namespace {
+
+	int zoomLevels(const int width, const int height)
+	{
+		// Highest zoom level, the image at full size; level 0 fits into one tile
+		int maxZoom = 0;
+		while ((int64_t(MAPTILE) << maxZoom) < int64_t(MAX(width, height))) ++maxZoom;
+		return maxZoom;
+	}
+
+	bool addRows(const uint8_t *rows, int count)
+	{
+		// Append rows of the image to the highest zoom level; NULL for empty ones
+		Level &level = gLevels.back();
+		while (count > 0) {
+			const int n = MIN(count, MAPTILE - level.rows);
+			if (rows != NULL) {
+				for (int y = 0; y < n; ++y) {
+					memcpy(&level.pixels[size_t(level.rows + y) * level.lineWidth], rows, gCanvas.lineWidth);
+					rows += gCanvas.lineWidth;
+				}
+			}
+			level.rows += n;
+			count -= n;
+			if (level.rows == MAPTILE && !flushLevel(level.zoom)) return false;
+		}
+		return true;
+	}
+
+	bool flushLevel(const int zoom)
+	{
+		// Write the tiles of the level's row on all threads, then shrink it into the level below, which might fill that one up
+		Level &level = gLevels[zoom];
+		level.state.assign(level.tilesX, 0);
+		runJobs(&tileJob, &level, level.tilesX, false);
+		for (int x = 0; x < level.tilesX; ++x) {
+			if (level.state[x] == 2) {
+				printf("Error writing tile %d/%d/%d.png to '%s'\n", zoom, x, level.tileY, g_TileDir);
+				return false;
+			}
+			gTilesWritten += size_t(level.state[x]);
+		}
+		if (zoom > 0) {
+			runJobs(&shrinkJob, &level, MAPTILE / 2, false);
+			gLevels[zoom - 1].rows += MAPTILE / 2;
+		}
+		memset(&level.pixels[0], 0, level.pixels.size());
+		level.rows = 0;
+		++level.tileY;
+		if (zoom > 0 && gLevels[zoom - 1].rows == MAPTILE) {
+			return flushLevel(zoom - 1);
+		}
+		return true;
+	}
+
+	bool finishPyramid()
+	{
+		// The image is complete, write the rows of tiles that are only partly filled, highest level first
+		for (int zoom = int(gLevels.size()) - 1; zoom >= 0; --zoom) {
+			if (gLevels[zoom].rows > 0 && !flushLevel(zoom)) return false;
+		}
+		printf("Wrote %d tiles in %d zoom levels\n", (int)gTilesWritten, (int)gLevels.size());
+		std::vector<Level>().swap(gLevels);
+		return true;
+	}
+
+	size_t tileJob(void *data, size_t job)
+	{
+		Level &level = *(Level*)data;
+		const int x = (int)job;
+		const uint8_t *tile = &level.pixels[size_t(x) * MAPTILE * 4];
+		if (emptyTile(tile, level.lineWidth)) return 0;
+		// Tiles of the same row are written at the same time, each to its own column's directory
+		char name[40];
+		snprintf(name, sizeof(name), "/%d/%d", level.zoom, x);
+		if (!level.haveDir[x]) {
+			if (!createDir((string(g_TileDir) + name).c_str())) {
+				level.state[x] = 2;
+				return 0;
+			}
+			level.haveDir[x] = 1;
+		}
+		level.state[x] = (writeTile(tileName(level.zoom, x, level.tileY), tile, level.lineWidth) ? 1 : 2);
+		return 0;
+	}
+
+	size_t shrinkJob(void *data, size_t job)
+	{
+		// Row 'job' of the level below is the average of two rows of this one. Colors are weighted
+		// by their alpha, so the transparent background doesn't darken the edges of the map
+		const Level &level = *(Level*)data;
+		Level &below = gLevels[level.zoom - 1];
+		const uint8_t *top = &level.pixels[job * 2 * level.lineWidth];
+		shrinkRow(top, top + level.lineWidth, &below.pixels[(below.rows + job) * below.lineWidth], size_t(level.tilesX) * MAPTILE / 2);
+		return 0;
+	}
+
+	size_t patchJob(void *data, size_t job)
+	{
+		// Tile 'job' of the patch, row by row
+		std::vector<char> &state = *(std::vector<char>*)data;
+		const int x = int(job) % gPatchTilesX, y = int(job) / gPatchTilesX;
+		const uint8_t *tile = gCanvas.buffer + size_t(y) * MAPTILE * gCanvas.lineWidth + size_t(x) * MAPTILE * 4;
+		state[job] = putTile(gMaxZoom, gPatchX + x, gPatchY + y, tile, gCanvas.lineWidth);
+		return 0;
+	}
+
+	size_t changedJob(void *data, size_t job)
+	{
+		// Make a tile anew from the four tiles of the level above it; those that don't exist are empty
+		Changed &changed = *(Changed*)data;
+		const int x = changed.tiles[job].first, y = changed.tiles[job].second;
+		std::vector<uint8_t> tile(MAPTILE * MAPTILE * 4, 0), above(MAPTILE * MAPTILE * 4);
+		const size_t lineWidth = MAPTILE * 4;
+		for (int i = 0; i < 4; ++i) {
+			const string path = tileName(changed.zoom + 1, x * 2 + i % 2, y * 2 + i / 2);
+			if (!fileExists(path.c_str())) continue;
+			if (!readTile(path, &above[0])) {
+				changed.state[job] = 2;
+				return 0;
+			}
+			uint8_t *out = &tile[(i / 2) * (MAPTILE / 2) * lineWidth + (i % 2) * (MAPTILE / 2) * 4];
+			for (int row = 0; row < MAPTILE / 2; ++row) {
+				shrinkRow(&above[row * 2 * lineWidth], &above[(row * 2 + 1) * lineWidth], out + row * lineWidth, MAPTILE / 2);
+			}
+		}
+		changed.state[job] = putTile(changed.zoom, x, y, &tile[0], lineWidth);
+		return 0;
+	}
+
+	inline void shrinkRow(const uint8_t *top, const uint8_t *bottom, uint8_t *out, const size_t width)
+	{
+		// Each pixel of out is the average of two of top and two of bottom. Colors are weighted by their alpha,
+		// so the transparent background doesn't darken the edges of the map
+		for (size_t x = 0; x < width; ++x, top += 8, bottom += 8, out += 4) {
+			const int alpha = top[3] + top[7] + bottom[3] + bottom[7];
+			if (alpha == 0) continue;
+			for (int i = 0; i < 3; ++i) {
+				out[i] = uint8_t((top[i] * top[3] + top[i + 4] * top[7] + bottom[i] * bottom[3] + bottom[i + 4] * bottom[7] + alpha / 2) / alpha);
+			}
+			out[3] = uint8_t((alpha + 2) / 4);
+		}
+	}
+
+	bool emptyTile(const uint8_t *tile, const size_t lineWidth)
+	{
+		// Nothing drawn to the tile?
+		for (int y = 0; y < MAPTILE; ++y) {
+			const uint8_t *row = tile + size_t(y) * lineWidth;
+			for (int i = 3; i < MAPTILE * 4; i += 4) {
+				if (row[i] != 0) return false;
+			}
+		}
+		return true;
+	}
+
+	string tileName(const int zoom, const int x, const int y)
+	{
+		char name[40];
+		snprintf(name, sizeof(name), "/%d/%d/%d.png", zoom, x, y);
+		return string(g_TileDir) + name;
+	}
+
+	char putTile(const int zoom, const int x, const int y, const uint8_t *tile, const size_t lineWidth)
+	{
+		// -update: write the tile, or remove it if it is empty now. Same states as Level::state
+		const string path = tileName(zoom, x, y);
+		if (emptyTile(tile, lineWidth)) {
+			remove(path.c_str());
+			return 0;
+		}
+		if (!createDir(path.substr(0, path.rfind('/')).c_str())) return 2;
+		return (writeTile(path, tile, lineWidth) ? 1 : 2);
+	}
+
+	bool writeTile(const string &path, const uint8_t *tile, const size_t lineWidth)
+	{
+		FILE *fh = fopen(path.c_str(), "wb");
+		if (fh == NULL) return false;
+		png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+		png_infop info = (png == NULL ? NULL : png_create_info_struct(png));
+		if (info == NULL) {
+			png_destroy_write_struct(&png, NULL);
+			fclose(fh);
+			return false;
+		}
+		if (setjmp(png_jmpbuf(png))) { // libpng will issue a longjmp on error, so code flow will end up
+			png_destroy_write_struct(&png, &info); // here if something goes wrong in the code below
+			fclose(fh);
+			return false;
+		}
+		png_init_io(png, fh);
+		// Same settings as the single image, see -pnglevel and -pngfilter
+		const int filters[] = {PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH, PNG_ALL_FILTERS};
+		png_set_compression_level(png, g_PngLevel);
+		png_set_filter(png, PNG_FILTER_TYPE_BASE, filters[g_PngFilter]);
+		png_set_IHDR(png, info, MAPTILE, MAPTILE, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
+				PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+		png_write_info(png, info);
+		for (int y = 0; y < MAPTILE; ++y) {
+			png_write_row(png, (png_bytep)(tile + size_t(y) * lineWidth));
+		}
+		png_write_end(png, NULL);
+		png_destroy_write_struct(&png, &info);
+		return fclose(fh) == 0;
+	}
+
+	bool readTile(const string &path, uint8_t *tile)
+	{
+		// A tile as writeTile() wrote it, MAPTILE rows of MAPTILE * 4 bytes
+		FILE *fh = fopen(path.c_str(), "rb");
+		if (fh == NULL) return false;
+		png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+		png_infop info = (png == NULL ? NULL : png_create_info_struct(png));
+		if (info == NULL) {
+			png_destroy_read_struct(&png, NULL, NULL);
+			fclose(fh);
+			return false;
+		}
+		if (setjmp(png_jmpbuf(png))) { // libpng will issue a longjmp on error, so code flow will end up
+			png_destroy_read_struct(&png, &info, NULL); // here if something goes wrong in the code below
+			fclose(fh);
+			return false;
+		}
+		png_init_io(png, fh);
+		png_read_info(png, info);
+		bool ok = (png_get_image_width(png, info) == MAPTILE && png_get_image_height(png, info) == MAPTILE && png_get_bit_depth(png, info) == 8
+				&& png_get_color_type(png, info) == PNG_COLOR_TYPE_RGBA && png_get_interlace_type(png, info) == PNG_INTERLACE_NONE);
+		for (int y = 0; ok && y < MAPTILE; ++y) {
+			png_read_row(png, (png_bytep)(tile + size_t(y) * MAPTILE * 4), NULL);
+		}
+		png_destroy_read_struct(&png, &info, NULL);
+		fclose(fh);
+		return ok;
+	}
+
+}
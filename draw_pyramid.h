@@ -0,0 +1,18 @@
+#ifndef DRAW_PYRAMID_H_
+#define DRAW_PYRAMID_H_
+
+#include "helper.h"
+
+bool createStreamPyramid(FILE* fh, size_t width, size_t height, int rows);
+bool streamRowsPyramid(FILE* fh, int rows);
+bool openImagePyramid(FILE* fh, size_t width, size_t height);
+bool beginPatchPyramid(int x, int y, int width, int height);
+bool endPatchPyramid();
+bool saveImagePyramid(FILE* fh);
+void setPixelPyramid(size_t x, size_t y, uint8_t color, float fsub);
+void blendPixelPyramid(size_t x, size_t y, uint8_t color, float fsub);
+void drawLinePyramid(size_t x, size_t y, size_t count, const uint8_t *colors, const uint8_t *ops);
+void beginTilePyramid(int x, int y, int width, int height);
+void endTilePyramid();
+
+#endif
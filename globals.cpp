@@ -5,10 +5,19 @@ int g_FromChunkX = UNDEFINED, g_FromChunkZ = UNDEFINED, g_ToChunkX = UNDEFINED,
 size_t g_MapsizeZ = 0, g_MapsizeY = 128, g_MapsizeX = 0;
 
 Orientation g_Orientation = East;
+ptrdiff_t g_ViewOrigin = 0, g_ViewStepX = 0, g_ViewStepZ = 1;
 bool g_Nightmode = false;
 bool g_Underground = false;
 bool g_BlendUnderground = false;
 bool g_Skylight = false;
 int g_Noise = 0;
+bool g_Deferred = false;
+int g_Threads = 0; // 0 = one per CPU
+int g_Scale = 1; // Blocks of the world per block of the terrain in every direction, see TERRAINCHUNK
+int g_PngLevel = 6, g_PngFilter = 5; // zlib level and png row filter type, 5 = pick the best one for every row
+const char *g_TempDir = NULL; // Where scratch files go, NULL = the system's temp dir
+const char *g_TileDir = NULL; // Where -tiles writes the tile pyramid
 
-uint8_t *g_Terrain = NULL, *g_Light = NULL;
+uint8_t *g_Terrain = NULL, *g_Light = NULL, *g_SkyLight = NULL; // Sky light is only kept separately for deferred shading
+uint64_t *g_Opaque = NULL; // One bit per block, set if fully opaque. Same order as g_Terrain, see OPAQUECOLUMN
+uint8_t *g_Heights[3] = {NULL, NULL, NULL}; // Lowest and highest block of columns and groups of columns, see HEIGHTAT
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <cstdlib>
+#include <cstddef>
 
 #define UNDEFINED 0x7FFFFFFF
 
@@ -21,12 +22,22 @@ extern size_t g_MapsizeY, g_MapsizeZ, g_MapsizeX;
 extern int G_FROMX, G_FROMZ, G_TOX, G_TOZ;
 
 extern Orientation g_Orientation;
+// Where view column 0,0 is in the terrain arrays, and how far to go for one step along the view's x and z axis, see setView()
+extern ptrdiff_t g_ViewOrigin, g_ViewStepX, g_ViewStepZ;
 extern bool g_Nightmode;
 extern bool g_Underground;
 extern bool g_BlendUnderground;
 extern bool g_Skylight;
 extern int g_Noise;
-
-extern uint8_t *g_Terrain, *g_Light;
+extern bool g_Deferred;
+extern int g_Threads;
+extern int g_Scale;
+extern int g_PngLevel, g_PngFilter;
+extern const char *g_TempDir;
+extern const char *g_TileDir;
+
+extern uint8_t *g_Terrain, *g_Light, *g_SkyLight;
+extern uint64_t *g_Opaque;
+extern uint8_t *g_Heights[3];
 
 #endif
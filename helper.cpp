@@ -2,11 +2,23 @@
 #include <cstring>
 #include <ctime>
 #include <cstdio>
+#include <cstdlib>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <direct.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 #ifndef S_ISREG
 #define	S_ISREG(m)	(((m) & S_IFMT) == S_IFREG)
 #endif
+#ifndef S_ISDIR
+#define	S_ISDIR(m)	(((m) & S_IFMT) == S_IFDIR)
+#endif
 
 uint8_t clamp(int32_t val)
 {
@@ -89,6 +101,16 @@ bool fileExists(const char* strFilename) {
   return false;
 }
 
+bool fileStamp(const char* name, int64_t &time, int64_t &size)
+{
+	// Last modification time and size of the file, to tell whether it changed
+	struct stat info;
+	if (stat(name, &info) != 0) return false;
+	time = int64_t(info.st_mtime);
+	size = int64_t(info.st_size);
+	return true;
+}
+
 bool isNumeric(char* str)
 {
 	if (str[0] == '-' && str[1] != '\0') ++str;
@@ -98,3 +120,100 @@ bool isNumeric(char* str)
 	}
 	return true;
 }
+
+uint8_t *mapFile(FILE *fh, uint64_t size)
+{
+	// Grow the file to the given size (the new part reads as zeros) and map all of it for reading and writing.
+	// NULL if that doesn't work, callers then have to fall back to reading and writing the file
+	if (uint64_t(size_t(size)) != size || fflush(fh) != 0) return NULL; // Doesn't fit the address space
+#ifdef _WIN32
+	const HANDLE file = (HANDLE)_get_osfhandle(_fileno(fh));
+	const HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READWRITE, DWORD(size >> 32), DWORD(size & 0xFFFFFFFF), NULL);
+	if (mapping == NULL) return NULL;
+	void *map = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size_t(size));
+	CloseHandle(mapping); // The view keeps the mapping alive
+	return (uint8_t*)map;
+#else
+	if (ftruncate(fileno(fh), off_t(size)) != 0) return NULL;
+	void *map = mmap(NULL, size_t(size), PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fh), 0);
+	return (map == MAP_FAILED ? NULL : (uint8_t*)map);
+#endif
+}
+
+void unmapFile(uint8_t *map, uint64_t size)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(map);
+#else
+	munmap(map, size_t(size));
+#endif
+}
+
+bool truncateFile(FILE *fh, uint64_t size)
+{
+	// Cut the file off after size bytes
+	if (fflush(fh) != 0) return false;
+#ifdef _WIN32
+	return _chsize_s(_fileno(fh), int64_t(size)) == 0;
+#else
+	return ftruncate(fileno(fh), off_t(size)) == 0;
+#endif
+}
+
+bool readFileAt(FILE *fh, uint64_t pos, void *buffer, size_t size)
+{
+	// Read without moving the file position, so several threads can read from the same file at once.
+	// Anything written through fh has to be flushed first
+	uint8_t *to = (uint8_t*)buffer;
+	while (size > 0) {
+#ifdef _WIN32
+		OVERLAPPED at;
+		memset(&at, 0, sizeof(at));
+		at.Offset = DWORD(pos & 0xFFFFFFFF);
+		at.OffsetHigh = DWORD(pos >> 32);
+		DWORD got = 0;
+		if (!ReadFile((HANDLE)_get_osfhandle(_fileno(fh)), to, DWORD(MIN(size, size_t(1) << 30)), &got, &at) || got == 0) return false;
+#else
+		const ssize_t got = pread(fileno(fh), to, size, off_t(pos));
+		if (got <= 0) return false;
+#endif
+		to += got;
+		pos += got;
+		size -= got;
+	}
+	return true;
+}
+
+FILE *openTempFile(const char *dir)
+{
+	// A new file in dir, or the system's temp dir if NULL, that is deleted when closed or when mcmap ends
+	if (dir == NULL) dir = getenv("TMPDIR");
+	if (dir == NULL) dir = getenv("TEMP");
+#ifdef _WIN32
+	char *name = _tempnam(dir, "mcmap");
+	if (name == NULL) return NULL;
+	FILE *fh = fopen(name, "w+bTD"); // T: keep in cache if possible, D: delete when closed
+	free(name);
+	return fh;
+#else
+	string name = string(dir == NULL ? "/tmp" : dir) + "/mcmap.XXXXXX";
+	const int fd = mkstemp(&name[0]);
+	if (fd == -1) return NULL;
+	unlink(name.c_str()); // Gone from the directory already, the data goes away once the file is closed
+	FILE *fh = fdopen(fd, "w+b");
+	if (fh == NULL) close(fd);
+	return fh;
+#endif
+}
+
+bool createDir(const char *path)
+{
+	// Create a directory; true if it exists afterwards, whether it was created or was there already
+#ifdef _WIN32
+	if (_mkdir(path) == 0) return true;
+#else
+	if (mkdir(path, 0755) == 0) return true;
+#endif
+	struct stat info;
+	return stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+}
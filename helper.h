@@ -5,27 +5,42 @@
 #define CHUNKSIZE_Z 16
 #define CHUNKSIZE_X 16
 #define CHUNKSIZE_Y 128
+// With -scale, a chunk of the terrain holds every g_Scale-th column of g_Scale x g_Scale chunks of the world,
+// and one block for every g_Scale blocks of height. This is the terrain chunk a chunk of the world goes to
+#define TERRAINCHUNK(c) ((c) >= 0 ? (c) / g_Scale : ((c) + 1) / g_Scale - 1)
+// Height in the world of block y of the terrain (the topmost of the blocks it stands for)
+#define WORLDY(y) ((y) * g_Scale + g_Scale - 1)
 // Some macros for easier array access
+// Terrain and light are stored in world order (x, z, y), whatever the orientation. All of these take view coordinates,
+// the view transform set by setView() rotates them to world order
+#define VIEWCOLUMN(x,z) (g_ViewOrigin + ptrdiff_t(x) * g_ViewStepX + ptrdiff_t(z) * g_ViewStepZ)
 // First: Block array
-#define BLOCKAT(x,y,z) g_Terrain[(y) + ((z) + ((x) * g_MapsizeZ)) * g_MapsizeY]
-#define BLOCKEAST(x,y,z) g_Terrain[(y) + ((g_MapsizeZ - ((x) + 1)) + ((z) * g_MapsizeZ)) * g_MapsizeY]
-#define BLOCKWEST(x,y,z) g_Terrain[(y) + ((x) + ((g_MapsizeX - ((z) + 1)) * g_MapsizeZ)) * g_MapsizeY]
-#define BLOCKNORTH(x,y,z) g_Terrain[(y) + ((z) + ((x) * g_MapsizeZ)) * g_MapsizeY]
-#define BLOCKSOUTH(x,y,z) g_Terrain[(y) + ((g_MapsizeZ - ((z) + 1)) + ((g_MapsizeX - ((x) + 1)) * g_MapsizeZ)) * g_MapsizeY]
-//#define BLOCKAT(x,y,z) g_Terrain[(x) + ((z) + ((y) * g_MapsizeZ)) * g_MapsizeX]
-//#define BLOCKEAST(x,y,z) g_Terrain[(z) + ((g_MapsizeZ - ((x) + 1)) + ((y) * g_MapsizeZ)) * g_MapsizeX]
+#define BLOCKAT(x,y,z) g_Terrain[(y) + VIEWCOLUMN(x,z) * ptrdiff_t(g_MapsizeY)]
 // Same for lightmap
-#define GETLIGHTAT(x,y,z) ((g_Light[((y) / 2) + ((z) + ((x) * g_MapsizeZ)) * ((g_MapsizeY + 1) / 2)] >> (((y) % 2) * 4)) & 0xF)
-#define SETLIGHTEAST(x,y,z) g_Light[((y) / 2) + ((g_MapsizeZ - ((x) + 1)) + ((z) * g_MapsizeZ)) * ((g_MapsizeY + 1) / 2)]
-#define SETLIGHTWEST(x,y,z) g_Light[((y) / 2) + ((x) + ((g_MapsizeX - ((z) + 1)) * g_MapsizeZ)) * ((g_MapsizeY + 1) / 2)]
-#define SETLIGHTNORTH(x,y,z) g_Light[((y) / 2) + ((z) + ((x) * g_MapsizeZ)) * ((g_MapsizeY + 1) / 2)]
-#define SETLIGHTSOUTH(x,y,z) g_Light[((y) / 2) + ((g_MapsizeZ - ((z) + 1)) + ((g_MapsizeX - ((x) + 1)) * g_MapsizeZ)) * ((g_MapsizeY + 1) / 2)]
+#define LIGHTBYTE(map,x,y,z) (map)[((y) / 2) + VIEWCOLUMN(x,z) * ptrdiff_t((g_MapsizeY + 1) / 2)]
+#define GETLIGHTFROM(map,x,y,z) ((LIGHTBYTE(map,x,y,z) >> (((y) % 2) * 4)) & 0xF)
+#define SETLIGHTIN(map,x,y,z,l) (LIGHTBYTE(map,x,y,z) = uint8_t((LIGHTBYTE(map,x,y,z) & (0xF0 >> (((y) % 2) * 4))) | ((l) << (((y) % 2) * 4))))
+#define GETLIGHTAT(x,y,z) GETLIGHTFROM(g_Light,x,y,z)
+
+// Opacity bitmap and height pyramid are stored in view order, as they're only needed for one view at a time
+// Opacity bitmap: each column of blocks is OPAQUEWORDS words, bit y set if block at height y is fully opaque
+#define OPAQUEWORDS ((g_MapsizeY + 63) / 64)
+#define OPAQUECOLUMN(x,z) (g_Opaque + ((z) + ((x) * g_MapsizeZ)) * OPAQUEWORDS)
+// Height pyramid: for every column (level 0), group of 4x4 columns (level 1) and chunk (level 2), the
+// lowest non-air block [0] and the highest one + 1 [1]. Empty columns are 255, 0
+#define HEIGHTLEVELS 3
+#define HEIGHTSHIFT(level) ((level) * 2)
+#define HEIGHTAT(level,x,z) (g_Heights[level] + (((z) >> HEIGHTSHIFT(level)) + ((x) >> HEIGHTSHIFT(level)) * (g_MapsizeZ >> HEIGHTSHIFT(level))) * 2)
+
+// Extra border around tiles drawn to with beginTile*(), so that blocks sticking out of a tile don't need clipping
+#define TILE_MARGIN 4
 
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 
 
 #include <string>
+#include <cstdio>
 
 // Difference between MSVC++ and gcc/others
 #if defined(_WIN32) && !defined(__GNUC__)
@@ -39,10 +54,13 @@
 #if defined(_WIN32) && !defined(__GNUC__)
 // MSVC++
 #	define fseek64 _fseeki64
+#	define ftell64 _ftelli64
 #elif defined(__APPLE__)
 #	define fseek64 fseeko
+#	define ftell64 ftello
 #else
 #	define fseek64 fseeko64
+#	define ftell64 ftello64
 #endif
 
 
@@ -56,6 +74,13 @@ int base10(char* val);
 uint8_t clamp(int32_t val);
 void printProgress(const size_t current, const size_t max);
 bool fileExists(const char* strFilename);
+bool fileStamp(const char* name, int64_t &time, int64_t &size);
 bool isNumeric(char* str);
+uint8_t *mapFile(FILE *fh, uint64_t size);
+void unmapFile(uint8_t *map, uint64_t size);
+bool truncateFile(FILE *fh, uint64_t size);
+bool readFileAt(FILE *fh, uint64_t pos, void *buffer, size_t size);
+FILE *openTempFile(const char *dir);
+bool createDir(const char *path);
 
 #endif
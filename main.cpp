@@ -9,14 +9,21 @@
 #include "draw.h"
 #ifdef WITHPNG
 #include "draw_png.h"
+#include "draw_pyramid.h"
 #endif
 #include "colors.h"
 #include "worldloader.h"
+#include "deferred.h"
+#include "threads.h"
 #include "globals.h"
+#include "topdown.h"
+#include "update.h"
 #include <string>
 #include <cstring>
 #include <cstdio>
 #include <cstdlib>
+#include <vector>
+#include <algorithm>
 #ifdef _DEBUG
 #include <cassert>
 #endif
@@ -28,6 +35,22 @@ namespace {
 	bool gAtBottomLeft = true, gAtBottomRight = true;
 	int gTotalFromChunkX, gTotalFromChunkZ, gTotalToChunkX, gTotalToChunkZ;
 	bool gPng = false;
+	bool gTiff = false; // BigTIFF instead of bmp, for images too big for one
+	bool gPyramid = false; // Tiles for web maps instead of one image, see draw_pyramid.cpp
+	bool gFrontToBack = false;
+	// Streaming: parts are drawn one diagonal of the view after another, and finished rows of the image written out right away
+	bool gStream = false;
+	int gStreamTop = 0; // Image row at the top of the band of rows kept in memory
+	int gAreaX = -1, gAreaZ = 0; // Part being drawn
+	bool gTopDown = false;
+	// -crop: only this rectangle of the image (uncropped, see calcBitmapOverdraw()) is rendered, and only the chunks
+	// that can draw to it are loaded, see setCropWindow()
+	bool gCrop = false;
+	int gCropX = 0, gCropY = 0, gCropWidth = 0, gCropHeight = 0;
+	// -update: parts of the image to draw anew, each the way -crop draws its rectangle
+	struct Patch {
+		int x, y, width, height;
+	};
 
 	bool (*createImage)(FILE* fh, size_t width, size_t height, bool splitUp) = NULL;
 	bool (*saveImage)(FILE* fh) = NULL;
@@ -35,16 +58,69 @@ namespace {
 	void (*setPixel)(size_t x, size_t y, uint8_t color, float fsub) = NULL;
 	void (*blendPixel)(size_t x, size_t y, uint8_t color, float fsub) = NULL;
 	bool (*saveImagePart)(FILE* fh) = NULL;
-	size_t (*calcImageSize)(int mapChunksX, int mapChunksZ, size_t mapHeight, int &pixelsX, int &pixelsY, bool tight) = NULL;
+	void (*drawLine)(size_t x, size_t y, size_t count, const uint8_t *colors, const uint8_t *ops) = NULL;
+	uint64_t (*calcImageSize)(int mapChunksX, int mapChunksZ, size_t mapHeight, int &pixelsX, int &pixelsY, bool tight) = NULL;
+	bool (*fitsImage)(int width, int height) = NULL; // Whether the file format can hold an image that big
+	void (*beginTile)(int x, int y, int width, int height) = NULL;
+	void (*endTile)() = NULL;
+	bool (*createStream)(FILE* fh, size_t width, size_t height, int rows) = NULL;
+	bool (*streamRows)(FILE* fh, int rows) = NULL;
+	// -update: open the image of the last run, then clear and draw each patch over it; saveImage finishes it
+	bool (*openImage)(FILE* fh, size_t width, size_t height) = NULL;
+	bool (*beginPatch)(int x, int y, int width, int height) = NULL;
+	bool (*endPatch)() = NULL;
+	// Rows of the image above 'rows' won't be drawn to anymore, so the output can encode and write them while drawing goes on.
+	// NULL if the output has no use for that
+	void (*rowsDone)(int rows) = NULL;
+	bool gTileRowsDone = false; // drawTiles() calls rowsDone after every row of tiles
+	// What to do with every block that is drawn: either paint it right away or store it in the G-buffer
+	void (*drawBlock)(const size_t x, const size_t y, const size_t z, const uint8_t c, const int bmpPosX, const int bmpPosY) = NULL;
 }
 
 // Macros to make code more readable
 #define BLOCK_AT_MAPEDGE(x,z) (((z)+1 == g_MapsizeZ-CHUNKSIZE_Z && gAtBottomLeft) || ((x)+1 == g_MapsizeX-CHUNKSIZE_X && gAtBottomRight))
+// Highest block optimizeTerrain() looks at. Some cheating here, as in most cases there is little to nothing up that high,
+// and the few things that are won't slow down rendering too much
+#define CULLTOP (MIN(g_MapsizeY, size_t(100 / g_Scale)) - 1)
+// Size in pixels of the square pieces of the image drawTiles() works on
+#define TILESIZE 256
+// Size in chunks of the parts drawn when streaming
+#define STREAMSIZE 4
 
+void drawTerrain(const int offsetX, const int offsetY);
+void drawTiles(const int offsetX, const int offsetY);
+void drawFrontToBack(const int offsetX, const int offsetY);
+size_t calcFrontToBackSize(int chunksX, int chunksZ);
+void resolveLight();
+inline void resolveBlockLight(const size_t x, const size_t y, const size_t z, const int top);
+void paintBlock(const size_t x, const size_t y, const size_t z, const uint8_t c, const int bmpPosX, const int bmpPosY);
+void storeBlock(const size_t x, const size_t y, const size_t z, const uint8_t c, const int bmpPosX, const int bmpPosY);
+inline float blockBrightness(const size_t x, const size_t y, const size_t z, const uint8_t c);
+inline int blockLight(const uint8_t *lightmap, const uint8_t *skymap, const size_t x, const size_t y, const size_t z, const int top);
+inline int sampleLight(const uint8_t *lightmap, const uint8_t *skymap, const size_t x, const size_t y, const size_t z, const int dim);
+inline bool blockEdge(const size_t x, const size_t y, const size_t z, const uint8_t c);
+inline bool blockCulled(const size_t x, const size_t y, const size_t z);
+int shadeOnly(const char *gbufferfile, char *outfile, char *colorfile);
 void optimizeTerrain();
-inline void blockCulling(const size_t x, const size_t y, const size_t z, size_t &removed);
+size_t cullingJob(void *top, size_t job);
+size_t undergroundJob(void *, size_t job);
 void undergroundMode(bool explore);
+void drawCaveOverlay(const int offsetX, const int offsetY);
+void areaBounds(int splitX, int splitZ, int areaX, int areaZ, int &fromChunkX, int &fromChunkZ, int &toChunkX, int &toChunkZ, int &bitmapStartX, int &bitmapStartY);
+void windowStart(int fromChunkX, int fromChunkZ, int toChunkX, int toChunkZ, int &bitmapStartX, int &bitmapStartY);
 bool prepareNextArea(int splitX, int splitZ, int &bitmapStartX, int &bitmapStartY);
+bool loadPartImage(FILE *fh, const int startX, const int startY);
+bool cropTouches(int chunkX, int chunkZ);
+void chunkPixels(int chunkX, int chunkZ, int &fromX, int &fromY, int &toX, int &toY);
+bool cropNeeds(int chunkX, int chunkZ);
+void setCropWindow(int &bitmapStartX, int &bitmapStartY);
+void changedPatches(const std::vector<std::pair<int, int> > &changed, const int cropLeft, const int cropTop, const int width, const int height, std::vector<Patch> &patches);
+bool renderPatches(FILE *fh, const char *world, const std::vector<Patch> &patches, const int cropLeft, const int cropTop);
+int diagonalTop(int splitX, int splitZ, int diagonal);
+int remainingTop(int splitX, int splitZ);
+bool finishRows(FILE *fh, const int finished);
+bool renderTopDown(FILE *fh, const char *world);
+void topDownSize(int &width, int &height);
 void assignFunctionPointers();
 void printHelp(char* binary);
 
@@ -56,8 +132,9 @@ int main(int argc, char** argv)
 		return 1;
 	}
 	bool wholeworld = false;
-	char *filename = NULL, *outfile = NULL, *colorfile = NULL;
-	size_t memlimit = 1800 * size_t(1024 * 1024);
+	char *filename = NULL, *outfile = NULL, *colorfile = NULL, *gbufferfile = NULL, *shadefile = NULL, *updatefile = NULL;
+	uint64_t memlimit = 1800 * uint64_t(1024 * 1024);
+	string tiffName;
 	bool memlimitSet = false;
 
 	// First, for the sake of backward compatibility, try to parse command line arguments the old way first
@@ -106,6 +183,44 @@ int main(int argc, char** argv)
 				g_BlendUnderground = true;
 			} else if (strcmp(option, "-skylight") == 0) {
 				g_Skylight = true;
+			} else if (strcmp(option, "-frontback") == 0) {
+				gFrontToBack = true;
+			} else if (strcmp(option, "-deferred") == 0) {
+				g_Deferred = true;
+			} else if (strcmp(option, "-stream") == 0) {
+				gStream = true;
+			} else if (strcmp(option, "-topdown") == 0) {
+				gTopDown = true;
+			} else if (strcmp(option, "-crop") == 0) {
+				if (!MOREARGS(4) || !isNumeric(POLLARG(1)) || !isNumeric(POLLARG(2)) || !isNumeric(POLLARG(3)) || !isNumeric(POLLARG(4))
+						|| atoi(POLLARG(3)) <= 0 || atoi(POLLARG(4)) <= 0) {
+					printf("Error: %s needs four integer arguments, position and size, ie: %s 1024 512 256 256\n", option, option);
+					return 1;
+				}
+				gCrop = true;
+				gCropX = atoi(NEXTARG);
+				gCropY = atoi(NEXTARG);
+				gCropWidth = atoi(NEXTARG);
+				gCropHeight = atoi(NEXTARG);
+			} else if (strcmp(option, "-update") == 0) {
+				if (!MOREARGS(1)) {
+					printf("Error: %s needs one argument, ie: %s myworld.state\n", option, option);
+					return 1;
+				}
+				updatefile = NEXTARG;
+			} else if (strcmp(option, "-gbuffer") == 0) {
+				if (!MOREARGS(1)) {
+					printf("Error: %s needs one argument, ie: %s myworld.gb\n", option, option);
+					return 1;
+				}
+				g_Deferred = true;
+				gbufferfile = NEXTARG;
+			} else if (strcmp(option, "-shade") == 0) {
+				if (!MOREARGS(1)) {
+					printf("Error: %s needs one argument, ie: %s myworld.gb\n", option, option);
+					return 1;
+				}
+				shadefile = NEXTARG;
 			} else if (strcmp(option, "-png") == 0) {
 #ifdef WITHPNG
 				gPng = true;
@@ -113,6 +228,38 @@ int main(int argc, char** argv)
 				printf("mcmap was not compiled with libpng support.\n");
 				return 1;
 #endif
+			} else if (strcmp(option, "-tiff") == 0) {
+				gTiff = true;
+			} else if (strcmp(option, "-tiles") == 0) {
+#ifdef WITHPNG
+				if (!MOREARGS(1)) {
+					printf("Error: %s needs one argument, ie: %s mymap\n", option, option);
+					return 1;
+				}
+				gPyramid = true;
+				g_TileDir = NEXTARG;
+#else
+				printf("mcmap was not compiled with libpng support.\n");
+				return 1;
+#endif
+			} else if (strcmp(option, "-pnglevel") == 0) {
+				if (!MOREARGS(1) || !isNumeric(POLLARG(1)) || atoi(POLLARG(1)) < 0 || atoi(POLLARG(1)) > 9) {
+					printf("Error: %s needs an integer argument between 0 and 9, ie: %s 9\n", option, option);
+					return 1;
+				}
+				g_PngLevel = atoi(NEXTARG);
+			} else if (strcmp(option, "-pngfilter") == 0) {
+				// Same order as the png filter types, the last one picks the best filter for every row
+				const char *filters[] = {"none", "sub", "up", "average", "paeth", "adaptive"};
+				const char *name = (MOREARGS(1) ? NEXTARG : "");
+				g_PngFilter = -1;
+				for (int i = 0; i < 6; ++i) {
+					if (strcmp(name, filters[i]) == 0) g_PngFilter = i;
+				}
+				if (g_PngFilter == -1) {
+					printf("Error: %s needs one of none, sub, up, average, paeth or adaptive, ie: %s up\n", option, option);
+					return 1;
+				}
 			} else if (strcmp(option, "-noise") == 0 || strcmp(option, "-dither") == 0) {
 				if (!MOREARGS(1) || !isNumeric(POLLARG(1))) {
 					printf("Error: %s needs an integer argument, ie: %s 10\n", option, option);
@@ -125,13 +272,32 @@ int main(int argc, char** argv)
 					return 1;
 				}
 				g_MapsizeY = atoi(NEXTARG);
+			} else if (strcmp(option, "-threads") == 0) {
+				if (!MOREARGS(1) || !isNumeric(POLLARG(1)) || atoi(POLLARG(1)) <= 0) {
+					printf("Error: %s needs a positive integer argument, ie: %s 4\n", option, option);
+					return 1;
+				}
+				g_Threads = atoi(NEXTARG);
+			} else if (strcmp(option, "-scale") == 0) {
+				if (!MOREARGS(1) || !isNumeric(POLLARG(1))
+						|| (atoi(POLLARG(1)) != 1 && atoi(POLLARG(1)) != 2 && atoi(POLLARG(1)) != 4 && atoi(POLLARG(1)) != 8)) {
+					printf("Error: %s needs 1, 2, 4 or 8 as argument, ie: %s 4\n", option, option);
+					return 1;
+				}
+				g_Scale = atoi(NEXTARG);
 			} else if (strcmp(option, "-mem") == 0) {
 				if (!MOREARGS(1) || !isNumeric(POLLARG(1)) || atoi(POLLARG(1)) <= 0) {
 					printf("Error: %s needs a positive integer argument, ie: %s 1000\n", option, option);
 					return 1;
 				}
 				memlimitSet = true;
-				memlimit = size_t(atoi(NEXTARG)) * size_t(1024 * 1024);
+				memlimit = uint64_t(atoi(NEXTARG)) * uint64_t(1024 * 1024);
+			} else if (strcmp(option, "-tmpdir") == 0) {
+				if (!MOREARGS(1)) {
+					printf("Error: %s needs one argument, ie: %s /mnt/scratch\n", option, option);
+					return 1;
+				}
+				g_TempDir = NEXTARG;
 			} else if (strcmp(option, "-file") == 0) {
 				if (!MOREARGS(1)) {
 					printf("Error: %s needs one argument, ie: %s myworld.bmp\n", option, option);
@@ -171,6 +337,39 @@ int main(int argc, char** argv)
 	}
 	// ########## end of command line parsing ##########
 
+	if (gCrop && (gStream || gTopDown || gPyramid || g_Deferred || gFrontToBack || g_BlendUnderground)) {
+		printf("Error: -crop can't be used with -stream, -topdown, -tiles, -deferred, -gbuffer, -frontback or -blendcave.\n");
+		return 1;
+	}
+	if (updatefile != NULL && (gCrop || gTopDown || g_Deferred || gFrontToBack || g_BlendUnderground || shadefile != NULL)) {
+		printf("Error: -update can't be used with -crop, -topdown, -deferred, -gbuffer, -frontback, -blendcave or -shade.\n");
+		return 1;
+	}
+	if (gTopDown && (g_Deferred || gFrontToBack || g_BlendUnderground)) {
+		printf("Error: -topdown can't be used with -deferred, -gbuffer, -frontback or -blendcave.\n");
+		return 1;
+	}
+	if ((gStream || gPyramid) && g_BlendUnderground) {
+		// Parts this small only see the torches and hills right around them, the overlay wouldn't match the whole map's
+		printf("Error: -blendcave can't be used with -stream or -tiles.\n");
+		return 1;
+	}
+	if (g_Scale > 1 && (g_Underground || g_BlendUnderground)) {
+		// Finding caves needs every block, the scaled down terrain misses torches and the light they spread
+		printf("Error: -scale can't be used with -cave or -blendcave.\n");
+		return 1;
+	}
+	if (gPyramid) {
+		if (shadefile != NULL) {
+			printf("Error: -tiles can't be used with -shade.\n");
+			return 1;
+		}
+		gStream = true; // Tiles are written as soon as their rows are done
+	}
+	if (shadefile != NULL) {
+		// No world needed, everything we need to know is in the G-buffer
+		return shadeOnly(shadefile, outfile, colorfile);
+	}
 	if (filename == NULL) {
 		printf("Error: No world given. Please add the path to your world to the command line.\n");
 		return 1;
@@ -179,11 +378,34 @@ int main(int argc, char** argv)
 		printf("Error accessing terrain at '%s'\n", filename);
 		return 1;
 	}
+	// -update needs to know every chunk file; scanning sets the bounds to the whole world, so keep -from/-to
+	std::vector<ChunkStamp> stamps;
+	if (updatefile != NULL) {
+		const int fromX = g_FromChunkX, fromZ = g_FromChunkZ, toX = g_ToChunkX, toZ = g_ToChunkZ;
+		if (!wholeworld && !scanWorldDirectory(filename)) {
+			printf("Error accessing terrain at '%s'\n", filename);
+			return 1;
+		}
+		g_FromChunkX = fromX;
+		g_FromChunkZ = fromZ;
+		g_ToChunkX = toX;
+		g_ToChunkZ = toZ;
+		chunkStamps(stamps);
+	}
 	if (g_MapsizeY < 1 || g_ToChunkX <= g_FromChunkX || g_ToChunkZ <= g_FromChunkZ) {
 		printf("What to doooo, yeah, what to doooo... (English: max height < 1 or X/Z-width <= 0) %d %d %d\n", (int)g_MapsizeY, (int)g_MapsizeX, (int)g_MapsizeZ);
 		return 1;
 	}
 	if (g_MapsizeY > CHUNKSIZE_Y) g_MapsizeY = CHUNKSIZE_Y;
+	if (g_Scale > 1) {
+		// From here on, chunk bounds and height are those of the smaller terrain, see TERRAINCHUNK
+		g_FromChunkX = TERRAINCHUNK(g_FromChunkX);
+		g_FromChunkZ = TERRAINCHUNK(g_FromChunkZ);
+		g_ToChunkX = TERRAINCHUNK(g_ToChunkX - 1) + 1;
+		g_ToChunkZ = TERRAINCHUNK(g_ToChunkZ - 1) + 1;
+		g_MapsizeY = (g_MapsizeY + g_Scale - 1) / g_Scale;
+		printf("Rendering at 1/%d size\n", g_Scale);
+	}
 	// Whole area to be rendered, in chunks
 	// If -mem is omitted or high enough, this won't be needed
 	gTotalFromChunkX = g_FromChunkX;
@@ -191,35 +413,70 @@ int main(int argc, char** argv)
 	gTotalToChunkX = g_ToChunkX;
 	gTotalToChunkZ = g_ToChunkZ;
 	// Don't allow ridiculously small values for big maps
-	if (memlimit && memlimit < 200000000 && memlimit < size_t(g_MapsizeX * g_MapsizeZ * 150000)) {
+	if (!gStream && !gTopDown && !gCrop && memlimit && memlimit < 200000000 && memlimit < uint64_t(g_MapsizeX) * g_MapsizeZ * 150000) {
 		printf("Need at least %d MiB of RAM to render a map of that size.\n", int(float(g_MapsizeX) * g_MapsizeZ * .15f + 1));
 		return 1;
 	}
 
-	// This decides whether a bmp or png is created
+	// This decides whether a bmp, png or tiff is created
+	if (gTiff) gPng = false;
 	assignFunctionPointers();
 
 	// Mem check
 	int bitmapX, bitmapY;
-	size_t bitmapBytes = (*calcImageSize)(g_ToChunkX - g_FromChunkX, g_ToChunkZ - g_FromChunkZ, g_MapsizeY, bitmapX, bitmapY, false);
+	uint64_t bitmapBytes = (*calcImageSize)(g_ToChunkX - g_FromChunkX, g_ToChunkZ - g_FromChunkZ, g_MapsizeY, bitmapX, bitmapY, false);
 	// Cropping
 	int cropLeft = 0, cropRight = 0, cropTop = 0, cropBottom = 0;
 	if (wholeworld) {
 		calcBitmapOverdraw(cropLeft, cropRight, cropTop, cropBottom);
 		bitmapX -= (cropLeft + cropRight);
 		bitmapY -= (cropTop + cropBottom);
-		if (gPng) {
-			bitmapBytes = size_t(bitmapX) * 4 * size_t(bitmapY);
-		} else {
-			bitmapBytes = (size_t(bitmapX * 3 + 3) & ~size_t(3)) * bitmapY;
+	}
+	// Only a rectangle of that image: render the chunks around it in one pass, so the image is placed as in a part
+	int cropStartX = 3, cropStartY = 5;
+	if (gCrop) {
+		gCropX += cropLeft;
+		gCropY += cropTop;
+		cropLeft = cropTop = 0;
+		setCropWindow(cropStartX, cropStartY);
+		bitmapX = gCropWidth;
+		bitmapY = gCropHeight;
+	}
+	// If the image is too big for a bmp or png, write a BigTIFF instead, so it can still be done in one go
+	int imageX = bitmapX, imageY = bitmapY;
+	if (gTopDown) topDownSize(imageX, imageY);
+	if (fitsImage != NULL && !(*fitsImage)(imageX, imageY)) {
+		printf("The image is too big for a %s file, writing a BigTIFF instead.\n", (gPng ? "png" : "bmp"));
+		gTiff = true;
+		gPng = false;
+		assignFunctionPointers();
+		if (outfile != NULL) {
+			tiffName = outfile;
+			const size_t dot = tiffName.rfind('.'), slash = tiffName.find_last_of("/\\");
+			if (dot != string::npos && (slash == string::npos || dot > slash)) tiffName.erase(dot);
+			tiffName += ".tif";
+			outfile = (char*)tiffName.c_str();
 		}
 	}
+	if (gPng) {
+		bitmapBytes = uint64_t(bitmapX) * 4 * uint64_t(bitmapY);
+	} else if (gTiff) {
+		bitmapBytes = uint64_t(bitmapX) * 3 * uint64_t(bitmapY);
+	} else {
+		bitmapBytes = ((uint64_t(bitmapX) * 3 + 3) & ~uint64_t(3)) * uint64_t(bitmapY);
+	}
 	bool splitImage = false;
 	int numSplitsX = 0;
 	int numSplitsZ = 0;
-	if (memlimit && memlimit < bitmapBytes + calcTerrainSize(g_ToChunkX - g_FromChunkX, g_ToChunkZ - g_FromChunkZ)) {
+	if (gStream || gTopDown) {
+		// Small parts, so only a few rows of the image and chunks around the current diagonal are needed at a time
+		numSplitsX = ((gTotalToChunkX - gTotalFromChunkX) + (STREAMSIZE - 1)) / STREAMSIZE;
+		numSplitsZ = ((gTotalToChunkZ - gTotalFromChunkZ) + (STREAMSIZE - 1)) / STREAMSIZE;
+	} else if (!gCrop && memlimit && memlimit < bitmapBytes + calcTerrainSize(g_ToChunkX - g_FromChunkX, g_ToChunkZ - g_FromChunkZ)
+			+ (g_Deferred ? calcGBufferSize(g_ToChunkX - g_FromChunkX, g_ToChunkZ - g_FromChunkZ, g_MapsizeY) : 0)
+			+ (gFrontToBack ? calcFrontToBackSize(g_ToChunkX - g_FromChunkX, g_ToChunkZ - g_FromChunkZ) : 0)) {
 		// If we'd need more mem than allowed, we have to render groups of chunks...
-		if (memlimit < bitmapBytes + 220 * size_t(1024 * 1024)) {
+		if (memlimit < bitmapBytes + 220 * uint64_t(1024 * 1024)) {
 			// Warn about using incremental rendering if user didn't set limit manually
 			if (!memlimitSet) {
 				printf(" ***** PLEASE NOTE *****\n"
@@ -233,18 +490,27 @@ int main(int argc, char** argv)
 			// ...or even use disk caching
 			splitImage = true;
 		}
-		// Split up map more and more, until the mem requirements are satisfied
-		for (numSplitsX = 1, numSplitsZ = 2;;) {
-			int subAreaX = ((gTotalToChunkX - gTotalFromChunkX) + (numSplitsX - 1)) / numSplitsX;
-			int subAreaZ = ((gTotalToChunkZ - gTotalFromChunkZ) + (numSplitsZ - 1)) / numSplitsZ;
+		// Split up map more and more, until the mem requirements are satisfied, but never into parts smaller than a chunk
+		const int chunksX = gTotalToChunkX - gTotalFromChunkX, chunksZ = gTotalToChunkZ - gTotalFromChunkZ;
+		for (numSplitsX = 1, numSplitsZ = MIN(2, chunksZ);;) {
+			int subAreaX = (chunksX + (numSplitsX - 1)) / numSplitsX;
+			int subAreaZ = (chunksZ + (numSplitsZ - 1)) / numSplitsZ;
 			int subBitmapX, subBitmapY;
-			if (splitImage && (*calcImageSize)(subAreaX, subAreaZ, g_MapsizeY, subBitmapX, subBitmapY, true) + calcTerrainSize(subAreaX, subAreaZ) <= memlimit) {
-				break; // Found a suitable partitioning
-			} else if (!splitImage && bitmapBytes + calcTerrainSize(subAreaX, subAreaZ) <= memlimit) {
-				break; // Found a suitable partitioning
+			const size_t extraBytes = (g_Deferred ? calcGBufferSize(subAreaX, subAreaZ, g_MapsizeY) : 0)
+					+ (gFrontToBack ? calcFrontToBackSize(subAreaX, subAreaZ) : 0);
+			if ((splitImage && (*calcImageSize)(subAreaX, subAreaZ, g_MapsizeY, subBitmapX, subBitmapY, true) + calcTerrainSize(subAreaX, subAreaZ) + extraBytes <= memlimit)
+					|| (!splitImage && bitmapBytes + calcTerrainSize(subAreaX, subAreaZ) + extraBytes <= memlimit)) {
+				// Found a suitable partitioning. Parts are rounded up, so fewer of them might already cover the map
+				numSplitsX = (chunksX + subAreaX - 1) / subAreaX;
+				numSplitsZ = (chunksZ + subAreaZ - 1) / subAreaZ;
+				break;
+			}
+			if (numSplitsX >= chunksX && numSplitsZ >= chunksZ) {
+				printf("Error: Rendering even one chunk at a time needs more than %dMiB, try a higher -mem value.\n", int(memlimit / (1024 * 1024)));
+				return 1;
 			}
 			//
-			if (numSplitsZ > numSplitsX) {
+			if (numSplitsX < chunksX && (numSplitsZ > numSplitsX || numSplitsZ >= chunksZ)) {
 				++numSplitsX;
 			} else {
 				++numSplitsZ;
@@ -252,6 +518,11 @@ int main(int argc, char** argv)
 		}
 	}
 
+	if (gbufferfile != NULL && numSplitsX != 0) {
+		printf("Error: Saving the G-buffer doesn't work with incremental rendering, try a higher -mem value.\n");
+		return 1;
+	}
+
 	// Always same random seed, as this is only used for block noise, which should give the same result for the same input every time
 	srand(1337);
 	// Load colormap from file
@@ -269,42 +540,124 @@ int main(int argc, char** argv)
 	if (outfile == NULL) {
 		if (gPng) {
 			outfile = (char*)"output.png";
+		} else if (gTiff) {
+			outfile = (char*)"output.tif";
 		} else {
 			outfile = (char*)"output.bmp";
 		}
 	}
 
-	// open output file
-	FILE *fileHandle = fopen(outfile, (splitImage ? "w+b" : "wb"));
+	// -update: if the state of the last run is there and it used the same settings, only draw the parts of the image
+	// anew that the chunks changed since draw to. Chunks next to them are drawn again too, for light and edges
+	string settings;
+	if (updatefile != NULL) {
+		char buffer[400];
+		int64_t colorTime = 0, colorSize = 0;
+		if (colorfile != NULL) fileStamp(colorfile, colorTime, colorSize);
+		snprintf(buffer, sizeof(buffer), "%s %s %dx%d chunks %d %d %d %d offset %d %d view %d %d %d %d %d %d %d colors %lld %lld out ", VERSION,
+				(gPyramid ? "tiles" : gPng ? "png" : gTiff ? "tiff" : "bmp"), bitmapX, bitmapY, gTotalFromChunkX, gTotalFromChunkZ, gTotalToChunkX, gTotalToChunkZ,
+				cropLeft, cropTop, int(g_Orientation), int(g_Nightmode), int(g_Skylight), int(g_Underground), g_Scale, int(g_MapsizeY), g_Noise,
+				(long long)colorTime, (long long)colorSize);
+		settings = string(buffer) + (gPyramid ? g_TileDir : outfile);
+		std::vector<ChunkStamp> before;
+		string lastSettings;
+		if (!loadStamps(updatefile, lastSettings, before)) {
+			printf("No state of an earlier run in '%s', rendering everything.\n", updatefile);
+		} else if (lastSettings != settings) {
+			printf("The settings or the size of the map changed since the last run, rendering everything.\n");
+		} else if (gPng && memlimit && memlimit < bitmapBytes + 220 * uint64_t(1024 * 1024)) {
+			printf("The png has to be in memory to be updated, but doesn't fit the memory limit; rendering everything.\n");
+		} else {
+			std::vector<std::pair<int, int> > changed;
+			changedChunks(before, stamps, changed);
+			std::vector<Patch> patches;
+			changedPatches(changed, cropLeft, cropTop, bitmapX, bitmapY, patches);
+			printf("%d chunks changed since the last run, drawing %d parts of the image anew.\n", (int)changed.size(), (int)patches.size());
+			if (patches.empty()) {
+				if (!saveStamps(updatefile, settings, stamps)) {
+					printf("Error writing state to '%s'\n", updatefile);
+					return 1;
+				}
+				printf("Job complete.\n");
+				return 0;
+			}
+			FILE *fh = (gPyramid ? NULL : fopen(outfile, "r+b"));
+			if ((gPyramid || fh != NULL) && (*openImage)(fh, bitmapX, bitmapY)) {
+				const bool ok = renderPatches(fh, filename, patches, cropLeft, cropTop);
+				if (fh != NULL && fclose(fh) != 0) {
+					printf("Error writing to '%s'\n", outfile);
+					return 1;
+				}
+				if (!ok) return 1;
+				if (!saveStamps(updatefile, settings, stamps)) {
+					printf("Error writing state to '%s'\n", updatefile);
+					return 1;
+				}
+				printf("Job complete.\n");
+				return 0;
+			}
+			if (fh != NULL) fclose(fh);
+			printf("'%s' isn't the output of the last run, rendering everything.\n", (gPyramid ? g_TileDir : outfile));
+		}
+	}
+
+	// open output file; tiles are files of their own
+	FILE *fileHandle = NULL;
+	if (!gPyramid) {
+		fileHandle = fopen(outfile, (splitImage ? "w+b" : "wb"));
+		if (fileHandle == NULL) {
+			printf("Error opening '%s' for writing.\n", outfile);
+			return 1;
+		}
+	}
 
-	if (fileHandle == NULL) {
-		printf("Error opening '%s' for writing.\n", outfile);
-		return 1;
+	// The top-down view has a loop of its own, see renderTopDown()
+	if (gTopDown) {
+		const bool ok = renderTopDown(fileHandle, filename);
+		if (fileHandle != NULL) fclose(fileHandle);
+		if (!ok) return 1;
+		printf("Job complete.\n");
+		return 0;
 	}
 
 	// This writes out the bitmap header and pre-allocates space if disk caching is used
-	if (!(*createImage)(fileHandle, bitmapX, bitmapY, splitImage)) {
+	// When streaming, a band of rows has to be big enough for all rows a diagonal of parts might draw to
+	const int streamBand = (int)g_MapsizeY * 2 + STREAMSIZE * (CHUNKSIZE_X + CHUNKSIZE_Z) * 2 + 16;
+	if (gStream ? !(*createStream)(fileHandle, bitmapX, bitmapY, streamBand) : !(*createImage)(fileHandle, bitmapX, bitmapY, splitImage)) {
 		printf("Error allocating bitmap. Check if you have enough free disk space.\n");
 		return 1;
 	}
 
+	// Rows are final as soon as the parts drawing to them are done, unless the cave overlay still goes on top in the end.
+	// Handing them over early only pays if the encoder can run next to the drawing
+	const bool earlyRows = (rowsDone != NULL && !gStream && !g_BlendUnderground && numThreads() > 1);
+	gTileRowsDone = (earlyRows && numSplitsX == 0);
+
 	// Now here's the loop rendering all the required parts of the image.
 	// All the vars previously used to define bounds will be set on each loop,
 	// to create something like a virtual window inside the map.
+	int diagonal = -1; // When streaming, diagonal of the view the current part is on
 	for (;;) {
 
-		int bitmapStartX = 3, bitmapStartY = 5;
+		int bitmapStartX = cropStartX, bitmapStartY = cropStartY;
 		if (numSplitsX) { // virtual window is set here
 			// Set current chunk bounds according to number of splits. returns true if we're done
 			if (prepareNextArea(numSplitsX, numSplitsZ, bitmapStartX, bitmapStartY)) {
 				break;
 			}
+			// When streaming, a new diagonal means all parts drawing to rows above it are done
+			if (gStream && gAreaX + gAreaZ != diagonal) {
+				diagonal = gAreaX + gAreaZ;
+				if (!finishRows(fileHandle, diagonalTop(numSplitsX, numSplitsZ, diagonal) - cropTop)) {
+					printf("Error writing image rows to file.\n");
+					return 1;
+				}
+				releaseChunks();
+			}
 			// if image is split up, prepare memory block for next part
 			if (splitImage) {
 				bitmapStartX += 2;
-				const int sizex = (g_ToChunkX - g_FromChunkX) * CHUNKSIZE_X * 2 + (g_ToChunkZ - g_FromChunkZ) * CHUNKSIZE_Z * 2;
-				const int sizey = (int)g_MapsizeY * 2 + (g_ToChunkX - g_FromChunkX) * CHUNKSIZE_X + (g_ToChunkZ - g_FromChunkZ) * CHUNKSIZE_Z + 3;
-				if (!(*loadImagePart)(fileHandle, bitmapStartX - cropLeft, bitmapStartY - cropTop, sizex, sizey)) {
+				if (!loadPartImage(fileHandle, bitmapStartX - cropLeft, bitmapStartY - cropTop)) {
 					printf("Error loading partial image to render to.\n");
 					return 1;
 				}
@@ -319,21 +672,16 @@ int main(int argc, char** argv)
 		--g_FromChunkX;
 		--g_FromChunkZ;
 
-		// For rotation, X and Z have to be swapped (East and West)
-		if (g_Orientation == North || g_Orientation == South) {
-			g_MapsizeZ = (g_ToChunkZ - g_FromChunkZ) * CHUNKSIZE_Z;
-			g_MapsizeX = (g_ToChunkX - g_FromChunkX) * CHUNKSIZE_X;
-		} else {
-			g_MapsizeX = (g_ToChunkZ - g_FromChunkZ) * CHUNKSIZE_Z;
-			g_MapsizeZ = (g_ToChunkX - g_FromChunkX) * CHUNKSIZE_X;
-		}
+		// Map size and rotation
+		setView();
 
 		// Load world or part of world
-		if (numSplitsX == 0 && wholeworld && !loadEntireTerrain()) {
+		const bool loadAll = (numSplitsX == 0 && wholeworld && !gCrop);
+		if (loadAll && !loadEntireTerrain()) {
 			printf("Error loading terrain from '%s'\n", filename);
 			return 1;
-		} else if (numSplitsX != 0 || !wholeworld) {
-			if (!loadTerrain(filename)) {
+		} else if (!loadAll) {
+			if (!loadTerrain(filename, gStream, (gCrop ? &cropNeeds : NULL))) {
 				printf("Error loading terrain from '%s'\n", filename);
 				return 1;
 			}
@@ -342,301 +690,1082 @@ int main(int argc, char** argv)
 		// If underground mode, remove blocks that don't seem to belong to caves
 		if (g_Underground) {
 			undergroundMode(false);
+		} else if (g_BlendUnderground && numSplitsX == 0) {
+			keepTerrain();
 		}
 
-		optimizeTerrain();
-
 		// Finally, render terrain to file
-		printf("Drawing map...\n");
-		for (size_t x = CHUNKSIZE_X; x < g_MapsizeX - CHUNKSIZE_X; ++x) {
-			printProgress(x - CHUNKSIZE_X, g_MapsizeX);
-			for (size_t z = CHUNKSIZE_Z; z < g_MapsizeZ - CHUNKSIZE_Z; ++z) {
-				const int bmpPosX = int((g_MapsizeZ - z - CHUNKSIZE_Z) * 2 + (x - CHUNKSIZE_X) * 2 + (splitImage ? -2 : bitmapStartX - cropLeft));
-				int bmpPosY = int(g_MapsizeY * 2 + z + x - CHUNKSIZE_Z - CHUNKSIZE_X + (splitImage ? 0 : bitmapStartY - cropTop)) + 2;
-				for (size_t y = 0; y < g_MapsizeY; ++y) {
-					bmpPosY -= 2;
-					uint8_t &c = BLOCKAT(x,y,z);
-					if (c == AIR) continue;
-					//float col = float(y) * .78f - 91;
-					float brightnessAdjustment = (100.0f/(1.0f+exp(-(1.3f * float(y) / 16.0f)+6.0f))) - 91; // thx Donkey Kong
-					if (g_BlendUnderground) brightnessAdjustment -= 168;
-					// we use light if...
-					if (g_Nightmode // nightmode is active, or
-							|| (g_Skylight // skylight is used and
-									&& (!BLOCK_AT_MAPEDGE(x, z)) // block is not edge of map (or if it is, has non-opaque block above)
-											)) {
-						int l = GETLIGHTAT(x, y, z); // find out how much light hits that block
-						if (l == 0 && y+1 == g_MapsizeY) l = (g_Nightmode ? 3 : 15); // quickfix: assume maximum strength at highest level
-						bool blocked[5] = {false, false, false, false, false}; // if light is blocked in one direction
-						for (int i = 1; i < 4 && l <= 0; ++i) {
-							// Need to make this a loop to deal with half-steps, fences, flowers and other special blocks
-							blocked[0] |= (colors[BLOCKAT(x+i, y, z)][ALPHA] == 255);
-							blocked[1] |= (colors[BLOCKAT(x, y, z+i)][ALPHA] == 255);
-							blocked[2] |= (y+i >= g_MapsizeY || colors[BLOCKAT(x, y+i, z)][ALPHA] == 255);
-							blocked[3] |= (colors[BLOCKAT(x+i, y+i, z)][ALPHA] == 255);
-							blocked[4] |= (colors[BLOCKAT(x, y+i, z+i)][ALPHA] == 255);
-							if (l <= 0 // if block is still dark and there are no translucent blocks around, stop
-									&& blocked[0] && blocked[1] && blocked[2] && blocked[3] && blocked[4]) break;
-							//
-							if (!blocked[2] && l <= 0 && y+i < g_MapsizeY) l = GETLIGHTAT(x, y+i, z);
-							if (!blocked[0] && l <= 0) l = GETLIGHTAT(x+i, y, z) - i/2;
-							if (!blocked[1] && l <= 0) l = GETLIGHTAT(x, y, z+i) - i/2;
-							if (!blocked[3] && l <= 0 && y+i < g_MapsizeY) l = (int)GETLIGHTAT(x+i, y+i, z) - i/2;
-							if (!blocked[4] && l <= 0 && y+i < g_MapsizeY) l = (int)GETLIGHTAT(x, y+i, z+i) - i/2;
-							//if (!blocked[2] && l <= 0 && y+i < g_MapsizeY) l = GETLIGHTAT(x+i/2, y+i/2, z+i/2) - i/2;
-						}
-						if (l < 0) l = 0;
-						if (!g_Skylight) { // Night
-							brightnessAdjustment -= (125 - l * 9);
-						} else { // Day
-							brightnessAdjustment -= (210 - l * 14);
-						}
-					}
-					// Edge detection (this means where terrain goes 'down' and the side of the block is not visible)
-					if ((y && y+1 < g_MapsizeY) // In bounds?
-						&& BLOCKAT(x,y+1,z) == AIR // Only if block above is air
-						&& (BLOCKAT(x-1,y-1,z-1) == c || BLOCKAT(x-1,y-1,z-1) == AIR) // block behind (from pov) this one is same type or air
-						&& (BLOCKAT(x-1,y,z) == AIR || BLOCKAT(x,y,z-1) == AIR)) { // block TL/TR from this one is air = edge
-							brightnessAdjustment += 12;
-					}
-					setPixel(bmpPosX, bmpPosY, c, brightnessAdjustment);
-				}
+		const int offsetX = (splitImage ? -2 : bitmapStartX - cropLeft);
+		const int offsetY = (splitImage ? 0 : bitmapStartY - cropTop - gStreamTop);
+		if (g_Deferred) {
+			// Only remember what ends up where, colors are calculated afterwards
+			createGBuffer((g_MapsizeX + g_MapsizeZ) * 2 + 4, g_MapsizeY * 2 + g_MapsizeX + g_MapsizeZ + 4, offsetX, offsetY);
+			drawBlock = &storeBlock;
+		} else {
+			drawBlock = &paintBlock;
+		}
+		if (gFrontToBack) {
+			drawFrontToBack(offsetX, offsetY); // Resolves the light of the blocks it draws itself
+		} else {
+			optimizeTerrain();
+			if (g_Nightmode || g_Skylight) {
+				resolveLight();
 			}
+			drawTerrain(offsetX, offsetY);
 		}
-		printProgress(10, 10);
-		// Bitmap creation complete
-		// unless we use....
-		// Underground overlay mode
-		if (g_BlendUnderground && !g_Underground) {
-			// Load map data again, since block culling removed most of the blocks
-			if (numSplitsX == 0 && wholeworld && !loadEntireTerrain()) {
-				printf("Error loading terrain from '%s'\n", filename);
+		if (g_Deferred) {
+			if (gbufferfile != NULL && !saveGBuffer(gbufferfile, bitmapX, bitmapY)) {
+				printf("Error writing G-buffer to '%s'\n", gbufferfile);
 				return 1;
-			} else if (numSplitsX != 0 || !wholeworld) {
-				if (!loadTerrain(filename)) {
-					printf("Error loading terrain from '%s'\n", filename);
-					return 1;
-				}
 			}
+			shadeGBuffer(drawLine);
+			destroyGBuffer();
+		}
+		// Bitmap creation complete
+		// unless we use....
+		// Underground overlay mode; with incremental rendering it's done in a pass of its own, see below
+		if (g_BlendUnderground && !g_Underground && numSplitsX == 0) {
+			// Back to the terrain as loaded, the surface pass culled most of it
+			restoreTerrain();
 			undergroundMode(true);
 			optimizeTerrain();
-			printf("Creating cave overlay...\n");
-			for (size_t x = CHUNKSIZE_X; x < g_MapsizeX - CHUNKSIZE_X; ++x) {
-				printProgress(x - CHUNKSIZE_X, g_MapsizeX);
-				for (size_t z = CHUNKSIZE_Z; z < g_MapsizeZ - CHUNKSIZE_Z; ++z) {
-					const size_t bmpPosX = (g_MapsizeZ - z - CHUNKSIZE_Z) * 2 + (x - CHUNKSIZE_X) * 2 + (splitImage ? -2 : bitmapStartX) - cropLeft;
-					size_t bmpPosY = g_MapsizeY * 2 + z + x - CHUNKSIZE_Z - CHUNKSIZE_X + (splitImage ? 0 : bitmapStartY) - cropTop;
-					for (size_t y = 0; y < MIN(g_MapsizeY, 64); ++y) {
-						uint8_t &c = BLOCKAT(x,y,z);
-						if (c != AIR) { // If block is not air (colors[c][3] != 0)
-							(*blendPixel)(bmpPosX, bmpPosY, c, float(y + 30) * .0048f);
-						}
-						bmpPosY -= 2;
-					}
-				}
-			}
-			printProgress(10, 10);
+			drawCaveOverlay(offsetX, offsetY);
 		} // End blend-underground
 		// If disk caching is used, save part to disk
 		if (splitImage && !(*saveImagePart)(fileHandle)) {
 			printf("Error saving partially rendered image.\n");
 			return 1;
 		}
+		if (earlyRows && numSplitsX != 0 && remainingTop(numSplitsX, numSplitsZ) != -1) {
+			(*rowsDone)(remainingTop(numSplitsX, numSplitsZ) - cropTop);
+		}
 		// No incremental rendering at all, so quit the loop
 		if (numSplitsX == 0) break;
 	}
-	if (!splitImage) {
+	if (gStream) {
+		// Everything is drawn, write out the remaining rows
+		if (!finishRows(fileHandle, bitmapY + 4)) {
+			printf("Error writing image rows to file.\n");
+			return 1;
+		}
+	} else if (g_BlendUnderground && !g_Underground && numSplitsX != 0) {
+		// Parts drawn later would paint over the cave overlay of the ones before,
+		// so it goes on top of all of them when they are done, loading each part again
+		printf("Blending cave overlay...\n");
+		gAreaX = -1;
+		gAreaZ = 0;
+		int bitmapStartX, bitmapStartY;
+		while (!prepareNextArea(numSplitsX, numSplitsZ, bitmapStartX, bitmapStartY)) {
+			if (splitImage && !loadPartImage(fileHandle, bitmapStartX + 2 - cropLeft, bitmapStartY - cropTop)) {
+				printf("Error loading partial image to render to.\n");
+				return 1;
+			}
+			++g_ToChunkX;
+			++g_ToChunkZ;
+			--g_FromChunkX;
+			--g_FromChunkZ;
+			setView();
+			if (!loadTerrain(filename)) {
+				printf("Error loading terrain from '%s'\n", filename);
+				return 1;
+			}
+			undergroundMode(true);
+			optimizeTerrain();
+			drawCaveOverlay((splitImage ? -2 : bitmapStartX - cropLeft), (splitImage ? 0 : bitmapStartY - cropTop));
+			if (splitImage && !(*saveImagePart)(fileHandle)) {
+				printf("Error saving partially rendered image.\n");
+				return 1;
+			}
+		}
+	}
+	if (!splitImage && !gStream) {
 		printf("Writing to file...\n");
 		(*saveImage)(fileHandle);
-	} else if (gPng) {
+	} else if (gPng && !gStream) {
 #ifdef WITHPNG
-		composeFinalImagePng();
+		if (!composeFinalImagePng()) {
+			printf("Error writing png file.\n");
+			return 1;
+		}
 #endif
 	}
-	fclose(fileHandle);
+	if (fileHandle != NULL) fclose(fileHandle);
+	if (updatefile != NULL && !saveStamps(updatefile, settings, stamps)) {
+		printf("Error writing state to '%s'\n", updatefile);
+		return 1;
+	}
 
 	printf("Job complete.\n");
 	return 0;
 }
 
+void drawTerrain(const int offsetX, const int offsetY)
+{
+	// Classic painter's algorithm, back to front. Expects optimizeTerrain() to have removed most hidden blocks
+	printf("Drawing map...\n");
+	if (drawBlock == &paintBlock) {
+		// The G-buffer needs every block exactly once, so only do this when painting right away
+		drawTiles(offsetX, offsetY);
+		return;
+	}
+	for (size_t x = CHUNKSIZE_X; x < g_MapsizeX - CHUNKSIZE_X; ++x) {
+		printProgress(x - CHUNKSIZE_X, g_MapsizeX);
+		for (size_t z = CHUNKSIZE_Z; z < g_MapsizeZ - CHUNKSIZE_Z; ++z) {
+			// Skip empty chunks and groups of columns right away
+			if (z % 16 == 0 && HEIGHTAT(2, x, z)[1] == 0) {
+				z += 15;
+				continue;
+			}
+			if (z % 4 == 0 && HEIGHTAT(1, x, z)[1] == 0) {
+				z += 3;
+				continue;
+			}
+			const uint8_t *height = HEIGHTAT(0, x, z);
+			const int bmpPosX = int((g_MapsizeZ - z - CHUNKSIZE_Z) * 2 + (x - CHUNKSIZE_X) * 2 + offsetX);
+			int bmpPosY = int(g_MapsizeY * 2 + z + x - CHUNKSIZE_Z - CHUNKSIZE_X + offsetY) + 2 - int(height[0]) * 2;
+			for (size_t y = height[0]; y < height[1]; ++y) {
+				bmpPosY -= 2;
+				const uint8_t c = BLOCKAT(x,y,z);
+				if (c == AIR) continue;
+				(*drawBlock)(x, y, z, c, bmpPosX, bmpPosY);
+			}
+		}
+	}
+	printProgress(10, 10);
+}
+
+namespace {
+	inline int floorHalf(const int val)
+	{
+		return (val >= 0 ? val / 2 : -((1 - val) / 2));
+	}
+}
+
+void drawTiles(const int offsetX, const int offsetY)
+{
+	// Same as drawTerrain(), but one tile of the image at a time, so the part of the image being drawn to stays in
+	// the cache instead of hopping across the whole width of it for every block.
+	// Every tile gets all blocks that touch it, in the same order as drawTerrain(), so each pixel still sees the
+	// right order. Blocks sticking out of the tile end up in its margin and get drawn again by the neighbouring tile
+	const int sizeX = int(g_MapsizeX - CHUNKSIZE_X * 2), sizeZ = int(g_MapsizeZ - CHUNKSIZE_Z * 2);
+	// With u = x - CHUNKSIZE_X and v = z - CHUNKSIZE_Z, a block is drawn at baseX + (u - v) * 2, baseY + u + v - y * 2
+	const int baseX = sizeZ * 2 + offsetX;
+	const int baseY = int(g_MapsizeY) * 2 + offsetY;
+	int fromX = baseX - (sizeZ - 1) * 2, toX = baseX + (sizeX - 1) * 2 + 4;
+	int fromY = baseY - (int(g_MapsizeY) - 1) * 2, toY = baseY + sizeX + sizeZ - 2 + 4;
+	if (gCrop) { // The terrain reaches past the image, only draw the tiles inside it
+		fromX = MAX(fromX, 0);
+		fromY = MAX(fromY, 0);
+		toX = MIN(toX, gCropWidth);
+		toY = MIN(toY, gCropHeight);
+	}
+	const int tilesX = (toX - fromX + TILESIZE - 1) / TILESIZE, tilesY = (toY - fromY + TILESIZE - 1) / TILESIZE;
+	for (int ty = 0; ty < tilesY; ++ty) {
+		printProgress(size_t(ty), size_t(tilesY));
+		// The last row and column of tiles stop at the edge, so nothing past it is touched
+		const int tileY = fromY + ty * TILESIZE, tileHeight = MIN(TILESIZE, toY - tileY);
+		// u + v range of columns that might have a block touching this row of tiles
+		const int minS = tileY - 3 - baseY, maxS = tileY + tileHeight - 1 - baseY + (int(g_MapsizeY) - 1) * 2;
+		for (int tx = 0; tx < tilesX; ++tx) {
+			const int tileX = fromX + tx * TILESIZE, tileWidth = MIN(TILESIZE, toX - tileX);
+			// u - v range of columns touching this tile
+			const int minD = -floorHalf(baseX - tileX + 3), maxD = floorHalf(tileX + tileWidth - 1 - baseX);
+			const int posX = baseX - tileX + TILE_MARGIN, posY = baseY - tileY + TILE_MARGIN;
+			bool started = false;
+			for (int u = MAX(0, minS - sizeZ + 1); u < sizeX && u <= maxS; ++u) {
+				const int lastV = MIN(MIN(sizeZ - 1, u - minD), maxS - u);
+				for (int v = MAX(MAX(0, u - maxD), minS - u); v <= lastV; ++v) {
+					const size_t x = size_t(u + CHUNKSIZE_X), z = size_t(v + CHUNKSIZE_Z);
+					const uint8_t *height = HEIGHTAT(0, x, z);
+					// Only the blocks of the column that end up in the tile
+					const int top = baseY + u + v;
+					const int fromBlock = MAX(int(height[0]), -floorHalf(tileY + tileHeight - 1 - top));
+					const int toBlock = MIN(int(height[1]), floorHalf(top - tileY + 3) + 1);
+					const int bmpPosX = posX + (u - v) * 2;
+					const uint8_t *column = &BLOCKAT(x,0,z);
+					for (int y = fromBlock; y < toBlock; ++y) {
+						const uint8_t c = column[y];
+						if (c == AIR) continue;
+						if (!started) {
+							(*beginTile)(tileX, tileY, tileWidth, tileHeight);
+							started = true;
+						}
+						paintBlock(x, size_t(y), z, c, bmpPosX, posY + u + v - y * 2);
+					}
+				}
+			}
+			if (started) {
+				(*endTile)();
+			}
+		}
+		if (gTileRowsDone) {
+			(*rowsDone)(tileY + tileHeight);
+		}
+	}
+	printProgress(10, 10);
+}
+
+namespace {
+	// Pixels of the 4x4 block sprite, one bit per pixel, row by row (bit = row * 4 + column)
+	// A T T T
+	// D D L L
+	// D D L L
+	//   D L
+#	define SPRITE_FULL 0x6FFF
+	uint16_t gSpriteCovers[256]; // Pixels a block type overwrites, no matter what was there before
+	uint16_t gSpriteTouches[256]; // Pixels a block type draws to at all
+
+	void initSpriteMasks()
+	{	// This has to match what the canvas (canvas.h) does for each block shape
+		const uint16_t touches[SHAPE_COUNT] = {SPRITE_FULL, SPRITE_FULL, 0x00F0, 0x0440, 0x24A0, 0x1313, 0x4DB5, 0x6F00};
+		// Translucent cubes, fences and fire get blended
+		const uint16_t covers[SHAPE_COUNT] = {SPRITE_FULL, SPRITE_FULL, 0x00F0, 0x0440, 0x24A0, 0, 0, 0x6F00};
+		for (int i = 0; i < 256; ++i) {
+			const uint8_t shape = colors[i][SHAPE];
+			gSpriteTouches[i] = touches[shape];
+			gSpriteCovers[i] = (shape == SHAPE_CUBE && colors[i][ALPHA] != 255 ? 0 : covers[shape]);
+		}
+	}
+
+	// Coverage buffer: One bit per pixel, set if a block in front has overwritten that pixel
+	uint8_t *gCover = NULL;
+	size_t gCoverLineWidth = 0, gCoverHeight = 0;
+	// Per column: a ray starting there at this height or above doesn't run into any block, see blockCulled()
+	uint8_t *gRayTop = NULL;
+
+	inline uint16_t getCoverage(const size_t x, const size_t y)
+	{	// Returns the coverage bits of the 4x4 area with x,y at its top left
+		uint16_t ret = 0;
+		const uint8_t *pos = gCover + (x >> 3) + y * gCoverLineWidth;
+		for (size_t i = 0; i < 4; ++i, pos += gCoverLineWidth) {
+			ret |= (((pos[0] | (pos[1] << 8)) >> (x & 7)) & 0xF) << (i * 4);
+		}
+		return ret;
+	}
+
+	inline void setCoverage(const size_t x, const size_t y, uint16_t mask)
+	{
+		uint8_t *pos = gCover + (x >> 3) + y * gCoverLineWidth;
+		for (size_t i = 0; i < 4; ++i, pos += gCoverLineWidth, mask >>= 4) {
+			const uint16_t bits = uint16_t((mask & 0xF) << (x & 7));
+			pos[0] |= uint8_t(bits & 0xFF);
+			pos[1] |= uint8_t(bits >> 8);
+		}
+	}
+
+	bool areaCovered(const size_t fromX, const size_t toX, size_t fromY, const size_t toY)
+	{	// Check if all pixels from fromX,fromY to toX,toY (inclusive) are covered
+		const size_t first = fromX >> 3, last = toX >> 3;
+		const uint8_t firstMask = uint8_t(0xFF << (fromX & 7)), lastMask = uint8_t(0xFF >> (7 - (toX & 7)));
+		const uint8_t *line = gCover + fromY * gCoverLineWidth;
+		for (; fromY <= toY; ++fromY, line += gCoverLineWidth) {
+			if (first == last) {
+				if ((line[first] & firstMask & lastMask) != (firstMask & lastMask)) return false;
+				continue;
+			}
+			if ((line[first] & firstMask) != firstMask || (line[last] & lastMask) != lastMask) return false;
+			for (size_t i = first + 1; i < last; ++i) {
+				if (line[i] != 0xFF) return false;
+			}
+		}
+		return true;
+	}
+
+	bool sliceHidden(const int level, const size_t x, const size_t z)
+	{	// Check if the columns from z down to the start of their group at the given level of the height pyramid are
+		// either empty or completely covered already. Uses the height of the whole group, so it's conservative
+		const uint8_t *height = HEIGHTAT(level, x, z);
+		if (height[1] == 0) return true;
+		const size_t first = z + 1 - (size_t(1) << HEIGHTSHIFT(level)); // Rightmost column in the image
+		const size_t fromX = (g_MapsizeZ - z - CHUNKSIZE_Z) * 2 + (x - CHUNKSIZE_X) * 2;
+		const size_t toX = (g_MapsizeZ - first - CHUNKSIZE_Z) * 2 + (x - CHUNKSIZE_X) * 2 + 3;
+		const size_t fromY = g_MapsizeY * 2 + first + x - CHUNKSIZE_Z - CHUNKSIZE_X - (height[1] - 1) * 2;
+		const size_t toY = g_MapsizeY * 2 + z + x - CHUNKSIZE_Z - CHUNKSIZE_X - height[0] * 2 + 3;
+		return areaCovered(fromX, toX, fromY, toY);
+	}
+
+	bool columnCovered(const size_t x, size_t fromY, const size_t toY, size_t &openRow)
+	{	// Check if the 4 pixel wide column is covered from fromY to toY (inclusive). If not, openRow is set to the first uncovered row
+		const uint8_t *pos = gCover + (x >> 3) + fromY * gCoverLineWidth;
+		for (; fromY <= toY; ++fromY, pos += gCoverLineWidth) {
+			if ((((pos[0] | (pos[1] << 8)) >> (x & 7)) & 0xF) != 0xF) {
+				openRow = fromY;
+				return false;
+			}
+		}
+		return true;
+	}
+}
+
+void drawFrontToBack(const int offsetX, const int offsetY)
+{
+	// Walk all blocks in the exact reverse order of drawTerrain() and keep track of which pixels
+	// are already covered by blocks in front. Blocks that don't add anything to the image are skipped,
+	// the rest is remembered and finally drawn back to front, so translucency and shading stay the same.
+	// No need to remove hidden blocks from the terrain first. Drawing goes through the blocks in the order
+	// resolveLight() does, so their light can be resolved right before, without touching any hidden block.
+	printf("Finding visible blocks...\n");
+	initSpriteMasks();
+	gCoverLineWidth = ((g_MapsizeX + g_MapsizeZ) * 2 + 7) / 8 + 2;
+	gCoverHeight = g_MapsizeY * 2 + g_MapsizeX + g_MapsizeZ + 4;
+	gCover = new uint8_t[gCoverLineWidth * gCoverHeight];
+	memset(gCover, 0, gCoverLineWidth * gCoverHeight);
+	std::vector<size_t> visible;
+	for (size_t x = g_MapsizeX - CHUNKSIZE_X - 1; x >= CHUNKSIZE_X; --x) {
+		printProgress(g_MapsizeX - CHUNKSIZE_X - 1 - x, g_MapsizeX);
+		for (size_t z = g_MapsizeZ - CHUNKSIZE_Z - 1; z >= CHUNKSIZE_Z; --z) {
+			// Before looking at single blocks, try to get rid of this row of the whole chunk, group of columns or column
+			if (z % 16 == 15 && sliceHidden(2, x, z)) {
+				z -= 15;
+				continue;
+			}
+			if (z % 4 == 3 && sliceHidden(1, x, z)) {
+				z -= 3;
+				continue;
+			}
+			if (sliceHidden(0, x, z)) continue;
+			const uint8_t *height = HEIGHTAT(0, x, z);
+			const size_t posX = (g_MapsizeZ - z - CHUNKSIZE_Z) * 2 + (x - CHUNKSIZE_X) * 2;
+			const size_t bottomY = g_MapsizeY * 2 + z + x - CHUNKSIZE_Z - CHUNKSIZE_X; // where block at y = 0 goes
+			const size_t lowestY = bottomY - height[0] * 2 + 3; // Last row of the lowest block
+			size_t openRow = 0; // Known uncovered row below the current block
+			const uint8_t *column = &BLOCKAT(x,0,z);
+			for (size_t y = height[1] - 1; y >= height[0] && y < g_MapsizeY; --y) {
+				const uint8_t c = column[y];
+				if (c == AIR) continue;
+				const size_t posY = bottomY - y * 2;
+				const uint16_t covered = getCoverage(posX, posY);
+				if ((covered & gSpriteTouches[c]) == gSpriteTouches[c]) {
+					// Block is hidden. If everything below is hidden too, we're done with this column
+					if (openRow < posY + 2 && columnCovered(posX, posY + 2, lowestY, openRow)) break;
+					continue;
+				}
+				setCoverage(posX, posY, gSpriteCovers[c]);
+				visible.push_back(y + (z + x * g_MapsizeZ) * g_MapsizeY);
+			}
+		}
+	}
+	printProgress(10, 10);
+	delete[] gCover;
+	gCover = NULL;
+	printf("%lu visible blocks\n", (unsigned long)visible.size());
+	// Edges and light look at the blocks around, as if hidden ones were removed. Most rays towards the viewer
+	// leave the terrain after a few blocks, remember where so blockCulled() can stop there
+	gRayTop = new uint8_t[g_MapsizeX * g_MapsizeZ];
+	for (size_t x = g_MapsizeX; x-- > 0;) {
+		for (size_t z = g_MapsizeZ; z-- > 0;) {
+			int top = 0;
+			if (x + 1 < g_MapsizeX && z + 1 < g_MapsizeZ) {
+				top = MAX(int(HEIGHTAT(0, x + 1, z + 1)[1]), int(gRayTop[(z + 1) + (x + 1) * g_MapsizeZ])) - 1;
+			}
+			gRayTop[z + x * g_MapsizeZ] = uint8_t(MAX(top, 0));
+		}
+	}
+	// Now draw them in the right order
+	printf("Drawing map...\n");
+	const bool light = (g_Nightmode || g_Skylight);
+	const int top = (g_SkyLight != NULL ? 0 : (g_Nightmode ? 3 : 15));
+	const size_t max = visible.size();
+	for (size_t i = max; i > 0; --i) {
+		if (i % 10000 == 0) printProgress(max - i, max);
+		const size_t index = visible[i - 1];
+		const size_t y = index % g_MapsizeY;
+		const size_t z = (index / g_MapsizeY) % g_MapsizeZ;
+		const size_t x = index / (g_MapsizeY * g_MapsizeZ);
+		const uint8_t c = BLOCKAT(x,y,z);
+		const int bmpPosX = int((g_MapsizeZ - z - CHUNKSIZE_Z) * 2 + (x - CHUNKSIZE_X) * 2 + offsetX);
+		const int bmpPosY = int(g_MapsizeY * 2 + z + x - CHUNKSIZE_Z - CHUNKSIZE_X + offsetY) - int(y) * 2;
+		if (light) resolveBlockLight(x, y, z, top);
+		(*drawBlock)(x, y, z, c, bmpPosX, bmpPosY);
+	}
+	delete[] gRayTop;
+	gRayTop = NULL;
+	printProgress(10, 10);
+}
+
+size_t calcFrontToBackSize(int chunksX, int chunksZ)
+{
+	// Memory drawFrontToBack() needs for a part of the given size, including the border chunks:
+	// the coverage buffer, gRayTop and the list of visible blocks. Blocks mostly end up visible because
+	// they add a pixel to the image, but translucent ones don't cover anything, so allow two per pixel
+	const size_t sizeX = size_t(chunksX + 2) * CHUNKSIZE_X, sizeZ = size_t(chunksZ + 2) * CHUNKSIZE_Z;
+	const size_t width = (sizeX + sizeZ) * 2, height = g_MapsizeY * 2 + sizeX + sizeZ + 4;
+	return ((width + 7) / 8 + 2) * height + sizeX * sizeZ + width * height * 2 * sizeof(size_t);
+}
+
+void resolveLight()
+{
+	// Replace the light value of every block that might get drawn by the light that actually hits it,
+	// so drawing only has to look it up. Going through the map in the same order it is stored in
+	// (x, z, y ascending) allows to do this in place: the neighbour search only looks at blocks with
+	// a higher x, z or y, which haven't been touched yet.
+	printf("Resolving light...\n");
+	const int top = (g_SkyLight != NULL ? 0 : (g_Nightmode ? 3 : 15));
+	for (size_t x = CHUNKSIZE_X; x < g_MapsizeX - CHUNKSIZE_X; ++x) {
+		printProgress(x - CHUNKSIZE_X, g_MapsizeX);
+		for (size_t z = CHUNKSIZE_Z; z < g_MapsizeZ - CHUNKSIZE_Z; ++z) {
+			const uint8_t *block = &BLOCKAT(x, 0, z);
+			const uint8_t *height = HEIGHTAT(0, x, z);
+			for (size_t y = height[0]; y < height[1]; ++y) {
+				if (block[y] == AIR) continue;
+				resolveBlockLight(x, y, z, top);
+			}
+		}
+	}
+	printProgress(10, 10);
+}
+
+inline void resolveBlockLight(const size_t x, const size_t y, const size_t z, const int top)
+{
+	const int l = blockLight(g_Light, g_SkyLight, x, y, z, top);
+	SETLIGHTIN(g_Light, x, y, z, l & 0xF);
+	if (g_SkyLight != NULL) SETLIGHTIN(g_SkyLight, x, y, z, l >> 4);
+}
+
+void paintBlock(const size_t x, const size_t y, const size_t z, const uint8_t c, const int bmpPosX, const int bmpPosY)
+{
+	(*setPixel)(bmpPosX, bmpPosY, c, blockBrightness(x, y, z, c));
+}
+
+void storeBlock(const size_t x, const size_t y, const size_t z, const uint8_t c, const int bmpPosX, const int bmpPosY)
+{
+	uint8_t flags = (blockEdge(x, y, z, c) ? GB_EDGE : 0);
+	if (BLOCK_AT_MAPEDGE(x, z)) flags |= GB_MAPEDGE;
+	uint8_t light = 0;
+	if (g_SkyLight != NULL) {
+		light = uint8_t(GETLIGHTAT(x, y, z) | (GETLIGHTFROM(g_SkyLight, x, y, z) << 4));
+	} else if (g_Nightmode || g_Skylight) { // Cave mode with lights, no separate sky light here
+		light = uint8_t(GETLIGHTAT(x, y, z) * 0x11);
+	} else {
+		flags |= GB_UNLIT;
+	}
+	rasterBlock(bmpPosX, bmpPosY, c, uint8_t(WORLDY(y)), light, flags);
+}
+
+inline float blockBrightness(const size_t x, const size_t y, const size_t z, const uint8_t c)
+{
+	int l = -1;
+	// we use light if...
+	if (g_Nightmode // nightmode is active, or
+			|| (g_Skylight // skylight is used and
+					&& (!BLOCK_AT_MAPEDGE(x, z)) // block is not edge of map (or if it is, has non-opaque block above)
+							)) {
+		l = GETLIGHTAT(x, y, z); // see resolveLight()
+	}
+	return shadeBrightness(WORLDY(y), l, blockEdge(x, y, z, c));
+}
+
+inline int blockLight(const uint8_t *lightmap, const uint8_t *skymap, const size_t x, const size_t y, const size_t z, const int top)
+{	// If skymap is given, both maps are searched together and the result is packed: block light | sky light << 4
+	int l = sampleLight(lightmap, skymap, x, y, z, 0); // find out how much light hits that block
+	if (l == 0 && y+1 == g_MapsizeY) l = top; // quickfix: assume maximum strength at highest level
+	bool blocked[5] = {false, false, false, false, false}; // if light is blocked in one direction
+	// Hidden blocks don't block anything, as if optimizeTerrain() had removed them for -frontback too
+#	define BLOCKS(x,y,z) (colors[BLOCKAT(x, y, z)][ALPHA] == 255 && !(gFrontToBack && blockCulled(x, y, z)))
+	for (int i = 1; i < 4 && l <= 0; ++i) {
+		// Need to make this a loop to deal with half-steps, fences, flowers and other special blocks
+		blocked[0] |= BLOCKS(x+i, y, z);
+		blocked[1] |= BLOCKS(x, y, z+i);
+		blocked[2] |= (y+i >= g_MapsizeY || BLOCKS(x, y+i, z));
+		blocked[3] |= BLOCKS(x+i, y+i, z);
+		blocked[4] |= BLOCKS(x, y+i, z+i);
+		if (l <= 0 // if block is still dark and there are no translucent blocks around, stop
+				&& blocked[0] && blocked[1] && blocked[2] && blocked[3] && blocked[4]) break;
+		//
+		if (!blocked[2] && l <= 0 && y+i < g_MapsizeY) l = sampleLight(lightmap, skymap, x, y+i, z, 0);
+		if (!blocked[0] && l <= 0) l = sampleLight(lightmap, skymap, x+i, y, z, i/2);
+		if (!blocked[1] && l <= 0) l = sampleLight(lightmap, skymap, x, y, z+i, i/2);
+		if (!blocked[3] && l <= 0 && y+i < g_MapsizeY) l = sampleLight(lightmap, skymap, x+i, y+i, z, i/2);
+		if (!blocked[4] && l <= 0 && y+i < g_MapsizeY) l = sampleLight(lightmap, skymap, x, y+i, z+i, i/2);
+		//if (!blocked[2] && l <= 0 && y+i < g_MapsizeY) l = GETLIGHTAT(x+i/2, y+i/2, z+i/2) - i/2;
+	}
+#	undef BLOCKS
+	if (l < 0) l = 0;
+	return l;
+}
+
+inline int sampleLight(const uint8_t *lightmap, const uint8_t *skymap, const size_t x, const size_t y, const size_t z, const int dim)
+{
+	if (skymap == NULL) return int(GETLIGHTFROM(lightmap, x, y, z)) - dim;
+	// Search stops where the light of the current mode is > 0, the same way it would on the mixed light map.
+	// Dimming happens after mixing there, so at night, where a third of the sky light counts, it's dimmed thrice
+	const int block = int(GETLIGHTFROM(lightmap, x, y, z)), sky = int(GETLIGHTFROM(skymap, x, y, z));
+	const int mixed = (g_Skylight ? MAX(block, (g_Nightmode ? clamp(sky / 3 - 2) : sky)) : block);
+	if (mixed - dim <= 0) return 0;
+	return MAX(block - dim, 0) | (MAX(sky - (g_Nightmode ? dim * 3 : dim), 0) << 4);
+}
+
+inline bool blockEdge(const size_t x, const size_t y, const size_t z, const uint8_t c)
+{
+	// Edge detection (this means where terrain goes 'down' and the side of the block is not visible)
+	if (!(y && y+1 < g_MapsizeY)) return false; // In bounds?
+	const uint8_t *block = &BLOCKAT(x,y,z);
+	const ptrdiff_t stepX = g_ViewStepX * ptrdiff_t(g_MapsizeY), stepZ = g_ViewStepZ * ptrdiff_t(g_MapsizeY);
+	// Hidden blocks count as air, -frontback doesn't remove them from the terrain but has to find the same edges
+#	define SEENASAIR(b,x,y,z) ((b) == AIR || (gFrontToBack && blockCulled(x, y, z)))
+	return SEENASAIR(block[1], x, y+1, z) // Only if block above is air
+		&& (block[-stepX - stepZ - 1] == c || SEENASAIR(block[-stepX - stepZ - 1], x-1, y-1, z-1)) // block behind (from pov) this one is same type or air
+		&& (SEENASAIR(block[-stepX], x-1, y, z) || SEENASAIR(block[-stepZ], x, y, z-1)); // block TL/TR from this one is air = edge
+#	undef SEENASAIR
+}
+
+inline bool blockCulled(const size_t x, const size_t y, const size_t z)
+{
+	// Would optimizeTerrain() remove this block? Same rules as cullingJob(), for a single block: it's hidden if there
+	// is an opaque block somewhere along its ray towards the viewer, unless the border chunk rules keep it.
+	// Only while drawFrontToBack() draws, it sets up gRayTop
+	const size_t y0 = CULLTOP;
+	const size_t lastX = g_MapsizeX-1-(gAtBottomRight ? CHUNKSIZE_X : 0), lastZ = g_MapsizeZ-1-(gAtBottomLeft ? CHUNKSIZE_Z : 0);
+	if (x > lastX || z > lastZ) return false;
+	const size_t k = MIN(lastX - x, lastZ - z); // Where the ray starts, as in cullingJob()
+	bool hidden = false;
+	for (size_t i = 0; i < k && y + i < y0 && !hidden && y + i < gRayTop[(z + i) + (x + i) * g_MapsizeZ]; ++i) {
+		hidden = (colors[BLOCKAT(x+i+1, y+i+1, z+i+1)][ALPHA] == 255);
+	}
+	if (!hidden || !(x <= CHUNKSIZE_X || z <= CHUNKSIZE_Z)) return hidden;
+	const bool farTraced = (x + k > CHUNKSIZE_X && z + k > CHUNKSIZE_Z);
+	return !(y + k <= y0 ? !farTraced : (x + y0 - y <= CHUNKSIZE_X || z + y0 - y <= CHUNKSIZE_Z));
+}
+
+int shadeOnly(const char *gbufferfile, char *outfile, char *colorfile)
+{
+	// Just turn a saved G-buffer into an image, using whatever shading options are set
+	assignFunctionPointers();
+	loadColors();
+	if (colorfile != NULL && !loadColorsFromFile(colorfile)) {
+		printf("Error loading colors from %s: Opening failed.\n", colorfile);
+		return 1;
+	}
+	int bitmapX, bitmapY;
+	if (!loadGBuffer(gbufferfile, bitmapX, bitmapY)) {
+		printf("Error loading G-buffer from '%s'\n", gbufferfile);
+		return 1;
+	}
+	if (outfile == NULL) {
+		outfile = (char*)(gPng ? "output.png" : (gTiff ? "output.tif" : "output.bmp"));
+	}
+	FILE *fileHandle = fopen(outfile, "wb");
+	if (fileHandle == NULL) {
+		printf("Error opening '%s' for writing.\n", outfile);
+		return 1;
+	}
+	if (!(*createImage)(fileHandle, bitmapX, bitmapY, false)) {
+		printf("Error allocating bitmap.\n");
+		return 1;
+	}
+	shadeGBuffer(drawLine);
+	destroyGBuffer();
+	printf("Writing to file...\n");
+	(*saveImage)(fileHandle);
+	fclose(fileHandle);
+	printf("Job complete.\n");
+	return 0;
+}
+
 void optimizeTerrain()
 {
 	// Remove invisible blocks from map (covered by other blocks from isometric pov)
 	// Do so by "raytracing" every block from front to back..
+	// Every ray walks its own diagonal, so they can be split up among threads freely
 	printf("Optimizing terrain...\n");
-	size_t removed = 0;
 	printProgress(0, 10);
-	const size_t top = MIN(g_MapsizeY, 100) - 1;  // Some cheating here, as in most cases there is little to nothing up that high, and the few things that are won't slow down rendering too much
-	const size_t progressMax = g_MapsizeX + g_MapsizeZ - 1 - CHUNKSIZE_Z;
-	for (size_t x = CHUNKSIZE_X+1; x < g_MapsizeX - CHUNKSIZE_X; ++x) {
-		for (size_t z = CHUNKSIZE_Z+1; z < g_MapsizeZ - CHUNKSIZE_Z; ++z) {
-			blockCulling(x, top, z, removed);
+	size_t top = CULLTOP;
+	// One job per diagonal slice of columns (x - z = const), from the far x/z faces to the front
+	const size_t jobs = (g_MapsizeX - (gAtBottomRight ? CHUNKSIZE_X : 0)) + (g_MapsizeZ - (gAtBottomLeft ? CHUNKSIZE_Z : 0)) - 1;
+	const size_t removed = runJobs(&cullingJob, &top, jobs, true);
+	updateHeightPyramid();
+	printProgress(10, 10);
+	printf("Removed %lu blocks\n", (unsigned long)removed);
+}
+
+size_t cullingJob(void *top, size_t job)
+{	// All rays starting in one diagonal slice of columns. A ray goes from (x,y,z) to (x-1,y-1,z-1), so using the
+	// opacity bitmap, 64 rays starting at different heights can be moved on to the next column with one shift.
+	// A block is hidden if the block at y+1 in the column before is opaque or hidden itself.
+	const size_t y0 = *(size_t*)top;
+	const size_t words = OPAQUEWORDS;
+	// Where another part of the map comes next, its border chunk hides blocks just like it would without splitting
+	const size_t lastX = g_MapsizeX-1-(gAtBottomRight ? CHUNKSIZE_X : 0), lastZ = g_MapsizeZ-1-(gAtBottomLeft ? CHUNKSIZE_Z : 0);
+	const size_t startX = MIN(lastX, job), startZ = startX + lastZ - job; // First column is at the far x or z face
+	// Rays starting in the border chunks were never traced, keep it that way so edge detection doesn't change
+	const bool farTraced = (startX > CHUNKSIZE_X && startZ > CHUNKSIZE_Z);
+	uint64_t *mask = new uint64_t[words * 3];
+	uint64_t *hidden = mask + words, *front = mask + words * 2;
+	for (size_t w = 0; w < words; ++w) { // Only blocks up to y0 take part
+		mask[w] = (w * 64 + 64 <= y0 + 1 ? ~uint64_t(0) : (w * 64 > y0 ? 0 : (uint64_t(1) << (y0 + 1 - w * 64)) - 1));
+		front[w] = 0;
+	}
+	size_t removed = 0;
+	for (size_t k = 0; k <= MIN(startX, startZ); ++k) {
+		const size_t x = startX - k, z = startZ - k;
+		uint64_t *opaque = OPAQUECOLUMN(x, z);
+		for (size_t w = 0; w < words; ++w) {
+			hidden[w] = (front[w] >> 1) | (w + 1 < words ? front[w + 1] << 63 : 0);
 		}
-		for (size_t y = top; y > 0; --y) {
-			blockCulling(x, y, g_MapsizeZ-1-CHUNKSIZE_Z, removed);
+		for (size_t w = 0; w < words; ++w) {
+			front[w] = (opaque[w] & mask[w]) | hidden[w];
 		}
-		printProgress(x, progressMax);
-	}
-	for (size_t z = CHUNKSIZE_Z+1; z < g_MapsizeZ-1 - CHUNKSIZE_Z; ++z) {
-		for (size_t y = top; y > 0; --y) {
-			blockCulling(g_MapsizeX-1-CHUNKSIZE_X, y, z, removed);
+		uint8_t *column = &BLOCKAT(x, 0, z);
+		const uint8_t *height = HEIGHTAT(0, x, z);
+		const bool border = (x <= CHUNKSIZE_X || z <= CHUNKSIZE_Z);
+		const size_t before = removed;
+		for (size_t w = 0; w < words; ++w) {
+			if (hidden[w] == 0) continue;
+			for (size_t y = MAX(w * 64, size_t(height[0])); y < MIN(w * 64 + 64, size_t(height[1])); ++y) {
+				if (!(hidden[w] & (uint64_t(1) << (y % 64))) || column[y] == AIR) continue;
+				if (border && (y + k <= y0 ? !farTraced // Ray started at far face or at the top?
+						: (x + y0 - y <= CHUNKSIZE_X || z + y0 - y <= CHUNKSIZE_Z))) continue;
+				column[y] = AIR;
+				opaque[w] &= ~(uint64_t(1) << (y % 64));
+				++removed;
+			}
 		}
-		printProgress(z + g_MapsizeX, progressMax);
+		if (removed != before) updateHeight(x, z);
+	}
+	delete[] mask;
+	return removed;
+}
+
+namespace {
+	// What undergroundMode() needs to know about a block type
+#	define CAVE_NOFLOOR 1 // Never left as cave floor (snow, leaves...)
+#	define CAVE_WATER 2 // Left as cave floor without counting as one of the two floor blocks
+	uint8_t gCaveClass[256];
+
+	void initCaveClasses()
+	{
+		memset(gCaveClass, 0, sizeof(gCaveClass));
+		gCaveClass[GRASS] = gCaveClass[LEAVES] = gCaveClass[SNOW] = CAVE_NOFLOOR;
+		gCaveClass[WATER] = gCaveClass[STAT_WATER] = CAVE_WATER;
 	}
-	printProgress(10, 10);
-	printf("Removed %lu blocks\n", (unsigned long)removed);
 }
 
-inline void blockCulling(const size_t x, const size_t y, const size_t z, size_t &removed)
-{	// Actually I just used 'removed' for debugging, but removing it
-	// gives no speed increase at all, so why bother?
-	bool cull = false; // Culling active?
-	for (size_t i = 0; i < g_MapsizeY; ++i) {
-		if (x < i || y < i || z < i) break;
-		uint8_t &c = BLOCKAT(x-i, y-i, z-i);
-		if (cull && c != AIR) {
-			c = AIR;
-			++removed;
-		} else if (colors[c][ALPHA] == 255) {
-			cull = true;
+size_t undergroundJob(void *, size_t job)
+{	// One job is a run of up to 256 columns in storage order, every column is done on its own
+	const size_t columns = g_MapsizeX * g_MapsizeZ, lightHeight = (g_MapsizeY + 1) / 2;
+	const size_t first = job * 256, last = MIN(first + 256, columns);
+	for (size_t i = first; i < last; ++i) {
+		uint8_t *column = g_Terrain + i * g_MapsizeY;
+		const uint8_t *light = g_Light + i * lightHeight;
+		// Air above the ground doesn't do anything, skip it 8 blocks at a time
+		size_t top = g_MapsizeY;
+		while (top >= 8) {
+			uint64_t word;
+			memcpy(&word, column + top - 8, 8);
+			if (word != 0) break;
+			top -= 8;
+		}
+		size_t ground = 0;
+		size_t cave = 0;
+		for (size_t y = top - 1; y < top; --y) {
+			uint8_t &c = column[y];
+			if (c == AIR) {
+				if (ground < 3) { // Block is air, if there was not enough ground above, don't treat that as a cave
+					ground = 0;
+				} else { // Thats a cave, draw next two blocks below it
+					cave = 2;
+				}
+			} else if (cave > 0) { // Found a cave, leave floor
+				const uint8_t type = gCaveClass[c];
+				if ((type & CAVE_NOFLOOR) || ((light[y / 2] >> ((y % 2) * 4)) & 0xF) == 0) {
+					c = AIR; // But never count snow or leaves
+					--cave;
+				} else if (!(type & CAVE_WATER)) {
+					--cave;
+				}
+			} else { // Block is not air, count up "ground"
+				c = AIR;
+				++ground;
+			}
 		}
 	}
+	return 0;
 }
 
 void undergroundMode(bool explore)
 {	// This wipes out all blocks that are not caves/tunnels
-	//int cnt[256];
-	//memset(cnt, 0, sizeof(cnt));
 	printf("Exploring underground...\n");
 	if (explore) {
 		clearLightmap();
-		for (size_t x = CHUNKSIZE_X; x < g_MapsizeX-CHUNKSIZE_X; ++x) {
-			printProgress(x - CHUNKSIZE_X, g_MapsizeX);
-			for (size_t z = CHUNKSIZE_Z; z < g_MapsizeZ-CHUNKSIZE_Z; ++z) {
-				for (size_t y = 0; y < MIN(g_MapsizeY, 64)-1; y++) {
-					if (BLOCKAT(x,y,z) == TORCH) {
-						// Torch
-						BLOCKAT(x,y,z) = AIR;
-						for (int ty = int(y) - 9; ty < int(y) + 9; ty+=2) { // The trick here is to only take into account
-							if (ty < 0) continue; // areas around torches.
-							if (ty >= int(g_MapsizeY)-1) break;
-							for (int tz = int(z) - 18; tz < int(z) + 18; ++tz) {
-								if (tz < CHUNKSIZE_Z) continue;
-								if (tz >= int(g_MapsizeZ)-CHUNKSIZE_Z) break;
-								for (int tx = int(x) - 18; tx < int(x) + 18; ++tx) {
-									if (tx < CHUNKSIZE_X) continue;
-									if (tx >= int(g_MapsizeX)-CHUNKSIZE_X) break;
-									SETLIGHTNORTH(tx, ty, tz) = 0xFF;
-								}
-							}
-						}
-						// /
-					}
-				}
-			}
-		}
+		discoverCaves(true);
 	}
-	for (size_t x = 0; x < g_MapsizeX; ++x) {
-		printProgress(x + g_MapsizeX * (explore ? 1 : 0), g_MapsizeX * (explore ? 2 : 1));
-		for (size_t z = 0; z < g_MapsizeZ; ++z) {
-			size_t ground = 0;
-			size_t cave = 0;
-			for (size_t y = g_MapsizeY-1; y < g_MapsizeY; --y) {
-				uint8_t &c = BLOCKAT(x,y,z);
-				if (c != AIR && cave > 0) { // Found a cave, leave floor
-					if (c == GRASS || c == LEAVES || c == SNOW || GETLIGHTAT(x,y,z) == 0) {
-						c = AIR; // But never count snow or leaves
-					} //else cnt[*c]++;
-					if (c != WATER && c != STAT_WATER) --cave;
-				} else if (c != AIR) { // Block is not air, count up "ground"
-					c = AIR;
-					if (c != LOG && c != LEAVES && c != SNOW && c != WOOD && c != WATER && c != STAT_WATER) {
-						++ground;
-					}
-				} else if (ground < 3) { // Block is air, if there was not enough ground above, don't trat that as a cave
-					ground = 0;
-				} else { // Thats a cave, draw next two blocks below it
-					cave = 2;
+	initCaveClasses();
+	const size_t columns = g_MapsizeX * g_MapsizeZ;
+	runJobs(&undergroundJob, NULL, (columns + 255) / 256, true);
+	updateTerrainInfo();
+	printProgress(10, 10);
+}
+
+void drawCaveOverlay(const int offsetX, const int offsetY)
+{	// Blend everything left after undergroundMode() over the image
+	printf("Creating cave overlay...\n");
+	for (size_t x = CHUNKSIZE_X; x < g_MapsizeX - CHUNKSIZE_X; ++x) {
+		printProgress(x - CHUNKSIZE_X, g_MapsizeX);
+		for (size_t z = CHUNKSIZE_Z; z < g_MapsizeZ - CHUNKSIZE_Z; ++z) {
+			const int bmpPosX = int((g_MapsizeZ - z - CHUNKSIZE_Z) * 2 + (x - CHUNKSIZE_X) * 2 + offsetX);
+			int bmpPosY = int(g_MapsizeY * 2 + z + x - CHUNKSIZE_Z - CHUNKSIZE_X + offsetY);
+			const uint8_t *column = &BLOCKAT(x, 0, z);
+			for (size_t y = 0; y < MIN(g_MapsizeY, size_t(64)); ++y) {
+				const uint8_t c = column[y];
+				if (c != AIR) { // If block is not air (colors[c][3] != 0)
+					(*blendPixel)(bmpPosX, bmpPosY, c, float(WORLDY(y) + 30) * .0048f);
 				}
+				bmpPosY -= 2;
 			}
 		}
 	}
 	printProgress(10, 10);
-	//for (int i = 0; i < 256; ++i) {
-	//	if (cnt[i] == 0) continue;
-	//	printf("Block %d: %d\n", i, cnt[i]);
-	//}
+}
+
+void areaBounds(int splitX, int splitZ, int areaX, int areaZ, int &fromChunkX, int &fromChunkZ, int &toChunkX, int &toChunkZ, int &bitmapStartX, int &bitmapStartY)
+{
+	// Calc size of area to be rendered (in chunks)
+	const int subAreaX = ((gTotalToChunkX - gTotalFromChunkX) + (splitX - 1)) / splitX;
+	const int subAreaZ = ((gTotalToChunkZ - gTotalFromChunkZ) + (splitZ - 1)) / splitZ;
+	// Adjust values for given area. order depends on map orientation
+	fromChunkX = gTotalFromChunkX + subAreaX * (g_Orientation == North || g_Orientation == West ? areaX : splitX - (areaX + 1));
+	fromChunkZ = gTotalFromChunkZ + subAreaZ * (g_Orientation == North || g_Orientation == East ? areaZ : splitZ - (areaZ + 1));
+	// Bounds checking
+	toChunkX = MIN(fromChunkX + subAreaX, gTotalToChunkX);
+	toChunkZ = MIN(fromChunkZ + subAreaZ, gTotalToChunkZ);
+	windowStart(fromChunkX, fromChunkZ, toChunkX, toChunkZ, bitmapStartX, bitmapStartY);
+}
+
+void windowStart(int fromChunkX, int fromChunkZ, int toChunkX, int toChunkZ, int &bitmapStartX, int &bitmapStartY)
+{
+	// Calulate pixel offsets in bitmap: find this area's chunks in the rotated map
+	const int totalX = gTotalToChunkX - gTotalFromChunkX, totalZ = gTotalToChunkZ - gTotalFromChunkZ;
+	int fromX, fromZ, toX, toZ;
+	worldToView(fromChunkX - gTotalFromChunkX, fromChunkZ - gTotalFromChunkZ, totalX, totalZ, fromX, fromZ);
+	worldToView(toChunkX - 1 - gTotalFromChunkX, toChunkZ - 1 - gTotalFromChunkZ, totalX, totalZ, toX, toZ);
+	if (fromX > toX) std::swap(fromX, toX);
+	if (fromZ > toZ) std::swap(fromZ, toZ);
+	const int viewTotalZ = (g_Orientation == North || g_Orientation == South ? totalZ : totalX);
+	bitmapStartX = ((viewTotalZ * CHUNKSIZE_Z) * 2 + 3) // Center of image..
+			- ((toZ + 1) * CHUNKSIZE_Z * 2) // increasing Z pos will move left in bitmap
+			+ (fromX * CHUNKSIZE_X * 2); // increasing X pos will move right in bitmap
+	bitmapStartY = 5 + fromZ * CHUNKSIZE_Z + fromX * CHUNKSIZE_X;
 }
 
 bool prepareNextArea(int splitX, int splitZ, int &bitmapStartX, int &bitmapStartY)
 {
-	static int currentAreaX = -1;
-	static int currentAreaZ = 0;
+	static int pass = 0;
 	// move on to next part and stop if we're done
-	++currentAreaX;
-	if (currentAreaX >= splitX) {
-		currentAreaX = 0;
-		++currentAreaZ;
+	if (gStream) {
+		// One diagonal of the view after another, so the image is finished from top to bottom
+		if (gAreaX + 1 < splitX && gAreaZ > 0) {
+			++gAreaX;
+			--gAreaZ;
+		} else {
+			const int diagonal = gAreaX + gAreaZ + 1;
+			gAreaX = MAX(0, diagonal - (splitZ - 1));
+			gAreaZ = diagonal - gAreaX;
+		}
+	} else if (++gAreaX >= splitX) {
+		gAreaX = 0;
+		++gAreaZ;
 	}
-	if (currentAreaZ >= splitZ) {
+	if (gAreaX >= splitX || gAreaZ >= splitZ) {
 		return true;
 	}
 	// For bright map edges
 	if (g_Orientation == West || g_Orientation == East) {
-		gAtBottomRight = (currentAreaZ + 1 == splitZ);
-		gAtBottomLeft = (currentAreaX + 1 == splitX);
+		gAtBottomRight = (gAreaZ + 1 == splitZ);
+		gAtBottomLeft = (gAreaX + 1 == splitX);
 	} else {
-		gAtBottomLeft = (currentAreaZ + 1 == splitZ);
-		gAtBottomRight = (currentAreaX + 1 == splitX);
+		gAtBottomLeft = (gAreaZ + 1 == splitZ);
+		gAtBottomRight = (gAreaX + 1 == splitX);
 	}
-	// Calc size of area to be rendered (in chunks)
-	const int subAreaX = ((gTotalToChunkX - gTotalFromChunkX) + (splitX - 1)) / splitX;
-	const int subAreaZ = ((gTotalToChunkZ - gTotalFromChunkZ) + (splitZ - 1)) / splitZ;
-	// Adjust values for current frame. order depends on map orientation
-	g_FromChunkX = gTotalFromChunkX + subAreaX * (g_Orientation == North || g_Orientation == West ? currentAreaX : splitX - (currentAreaX + 1));
-	g_FromChunkZ = gTotalFromChunkZ + subAreaZ * (g_Orientation == North || g_Orientation == East ? currentAreaZ : splitZ - (currentAreaZ + 1));
-	g_ToChunkX = g_FromChunkX + subAreaX;
-	g_ToChunkZ = g_FromChunkZ + subAreaZ;
-	// Bounds checking
-	if (g_ToChunkX > gTotalToChunkX) g_ToChunkX = gTotalToChunkX;
-	if (g_ToChunkZ > gTotalToChunkZ) g_ToChunkZ = gTotalToChunkZ;
-	printf("Pass %d of %d...\n", int(currentAreaX + (currentAreaZ * splitX) + 1), int(splitX * splitZ));
-	// Calulate pixel offsets in bitmap. Forgot how this works right after writing it, really.
-	if (g_Orientation == North) {
-		bitmapStartX = (((gTotalToChunkZ - gTotalFromChunkZ) * CHUNKSIZE_Z) * 2 + 3) // Center of image..
-				- ((g_ToChunkZ - gTotalFromChunkZ) * CHUNKSIZE_Z * 2) // increasing Z pos will move left in bitmap
-				+ ((g_FromChunkX - gTotalFromChunkX) * CHUNKSIZE_X * 2); // increasing X pos will move right in bitmap
-		bitmapStartY = 5 + (g_FromChunkZ - gTotalFromChunkZ) * CHUNKSIZE_Z + (g_FromChunkX - gTotalFromChunkX) * CHUNKSIZE_X;
-	} else if (g_Orientation == South) {
-		const int tox = gTotalToChunkX - g_FromChunkX + gTotalFromChunkX;
-		const int toz = gTotalToChunkZ - g_FromChunkZ + gTotalFromChunkZ;
-		const int fromx = tox - (g_ToChunkX - g_FromChunkX);
-		const int fromz = toz - (g_ToChunkZ - g_FromChunkZ);
-		bitmapStartX = (((gTotalToChunkZ - gTotalFromChunkZ) * CHUNKSIZE_Z) * 2 + 3) // Center of image..
-				- ((toz - gTotalFromChunkZ) * CHUNKSIZE_Z * 2) // increasing Z pos will move left in bitmap
-				+ ((fromx - gTotalFromChunkX) * CHUNKSIZE_X * 2); // increasing X pos will move right in bitmap
-		bitmapStartY = 5 + (fromz - gTotalFromChunkZ) * CHUNKSIZE_Z + (fromx - gTotalFromChunkX) * CHUNKSIZE_X;
-	} else if (g_Orientation == East) {
-		const int tox = gTotalToChunkX - g_FromChunkX + gTotalFromChunkX;
-		const int fromx = tox - (g_ToChunkX - g_FromChunkX);
-		bitmapStartX = (((gTotalToChunkX - gTotalFromChunkX) * CHUNKSIZE_X) * 2 + 3) // Center of image..
-				- ((tox - gTotalFromChunkX) * CHUNKSIZE_X * 2) // increasing Z pos will move left in bitmap
-				+ ((g_FromChunkZ - gTotalFromChunkZ) * CHUNKSIZE_Z * 2); // increasing X pos will move right in bitmap
-		bitmapStartY = 5 + (fromx - gTotalFromChunkX) * CHUNKSIZE_X + (g_FromChunkZ - gTotalFromChunkZ) * CHUNKSIZE_Z;
-	} else {
-		const int toz = gTotalToChunkZ - g_FromChunkZ + gTotalFromChunkZ;
-		const int fromz = toz - (g_ToChunkZ - g_FromChunkZ);
-		bitmapStartX = (((gTotalToChunkX - gTotalFromChunkX) * CHUNKSIZE_X) * 2 + 3) // Center of image..
-				- ((g_ToChunkX - gTotalFromChunkX) * CHUNKSIZE_X * 2) // increasing Z pos will move left in bitmap
-				+ ((fromz - gTotalFromChunkZ) * CHUNKSIZE_Z * 2); // increasing X pos will move right in bitmap
-		bitmapStartY = 5 + (g_FromChunkX - gTotalFromChunkX) * CHUNKSIZE_X + (fromz - gTotalFromChunkZ) * CHUNKSIZE_Z;
+	areaBounds(splitX, splitZ, gAreaX, gAreaZ, g_FromChunkX, g_FromChunkZ, g_ToChunkX, g_ToChunkZ, bitmapStartX, bitmapStartY);
+	if (gAreaX == 0 && gAreaZ == 0) { // Going over all parts again
+		pass = 0;
 	}
+	printf("Pass %d of %d...\n", ++pass, int(splitX * splitZ));
 	return false; // not done yet, return false
 }
 
+bool loadPartImage(FILE *fh, const int startX, const int startY)
+{
+	// Disk caching: load the area of the image the current part draws to
+	const int sizex = (g_ToChunkX - g_FromChunkX) * CHUNKSIZE_X * 2 + (g_ToChunkZ - g_FromChunkZ) * CHUNKSIZE_Z * 2;
+	const int sizey = (int)g_MapsizeY * 2 + (g_ToChunkX - g_FromChunkX) * CHUNKSIZE_X + (g_ToChunkZ - g_FromChunkZ) * CHUNKSIZE_Z + 3;
+	return (*loadImagePart)(fh, startX, startY, sizex, sizey);
+}
+
+bool cropTouches(int chunkX, int chunkZ)
+{
+	// Whether any block of the chunk can end up in the -crop rectangle
+	if (chunkX < gTotalFromChunkX || chunkX >= gTotalToChunkX || chunkZ < gTotalFromChunkZ || chunkZ >= gTotalToChunkZ) {
+		return false;
+	}
+	int fromX, fromY, toX, toY;
+	chunkPixels(chunkX, chunkZ, fromX, fromY, toX, toY);
+	return toX > gCropX && fromX < gCropX + gCropWidth && toY > gCropY && fromY < gCropY + gCropHeight;
+}
+
+void chunkPixels(int chunkX, int chunkZ, int &fromX, int &fromY, int &toX, int &toY)
+{
+	// Pixels of the whole map's image (uncropped) the blocks of a chunk can draw to, end exclusive. In the whole map's view,
+	// column u,v (blocks) gets drawn at 3 + viewTotalZ * 32 + (u - v) * 2, 5 + g_MapsizeY * 2 + u + v - y * 2, each block 4x4 pixels
+	const int totalX = gTotalToChunkX - gTotalFromChunkX, totalZ = gTotalToChunkZ - gTotalFromChunkZ;
+	const int viewTotalZ = (g_Orientation == North || g_Orientation == South ? totalZ : totalX);
+	int viewX, viewZ;
+	worldToView(chunkX - gTotalFromChunkX, chunkZ - gTotalFromChunkZ, totalX, totalZ, viewX, viewZ);
+	// Range of u - v and u + v of the chunk's columns
+	const int fromD = (viewX - viewZ) * CHUNKSIZE_X - (CHUNKSIZE_Z - 1), toD = (viewX - viewZ) * CHUNKSIZE_X + (CHUNKSIZE_X - 1);
+	const int fromS = (viewX + viewZ) * CHUNKSIZE_X, toS = fromS + CHUNKSIZE_X + CHUNKSIZE_Z - 2;
+	const int baseX = viewTotalZ * CHUNKSIZE_Z * 2 + 3, baseY = int(g_MapsizeY) * 2 + 5;
+	fromX = baseX + fromD * 2;
+	toX = baseX + toD * 2 + 4;
+	fromY = baseY + fromS - (int(g_MapsizeY) - 1) * 2;
+	toY = baseY + toS + 4;
+}
+
+bool cropNeeds(int chunkX, int chunkZ)
+{
+	// Chunks next to the ones drawing to the rectangle are needed too, for light and edges
+	for (int x = chunkX - 1; x <= chunkX + 1; ++x) {
+		for (int z = chunkZ - 1; z <= chunkZ + 1; ++z) {
+			if (cropTouches(x, z)) return true;
+		}
+	}
+	return false;
+}
+
+void setCropWindow(int &bitmapStartX, int &bitmapStartY)
+{
+	// Narrow the chunk bounds down to the chunks drawing to the -crop rectangle and set where the rectangle
+	// is in the image of those. loadTerrain() then leaves out the chunks in there that don't draw to it
+	int fromX = gTotalToChunkX, fromZ = gTotalToChunkZ, toX = gTotalFromChunkX, toZ = gTotalFromChunkZ;
+	for (int x = gTotalFromChunkX; x < gTotalToChunkX; ++x) {
+		for (int z = gTotalFromChunkZ; z < gTotalToChunkZ; ++z) {
+			if (!cropTouches(x, z)) continue;
+			fromX = MIN(fromX, x);
+			fromZ = MIN(fromZ, z);
+			toX = MAX(toX, x + 1);
+			toZ = MAX(toZ, z + 1);
+		}
+	}
+	if (fromX >= toX) { // Nothing there, so nothing is loaded; any chunk will do
+		fromX = gTotalFromChunkX;
+		fromZ = gTotalFromChunkZ;
+		toX = fromX + 1;
+		toZ = fromZ + 1;
+	}
+	g_FromChunkX = fromX;
+	g_FromChunkZ = fromZ;
+	g_ToChunkX = toX;
+	g_ToChunkZ = toZ;
+	windowStart(fromX, fromZ, toX, toZ, bitmapStartX, bitmapStartY);
+	bitmapStartX -= gCropX;
+	bitmapStartY -= gCropY;
+	// For bright map edges, as in prepareNextArea()
+	const int totalX = gTotalToChunkX - gTotalFromChunkX, totalZ = gTotalToChunkZ - gTotalFromChunkZ;
+	int viewFromX, viewFromZ, viewToX, viewToZ;
+	worldToView(fromX - gTotalFromChunkX, fromZ - gTotalFromChunkZ, totalX, totalZ, viewFromX, viewFromZ);
+	worldToView(toX - 1 - gTotalFromChunkX, toZ - 1 - gTotalFromChunkZ, totalX, totalZ, viewToX, viewToZ);
+	const bool alongZ = (g_Orientation == North || g_Orientation == South);
+	gAtBottomLeft = (MAX(viewFromZ, viewToZ) + 1 == (alongZ ? totalZ : totalX));
+	gAtBottomRight = (MAX(viewFromX, viewToX) + 1 == (alongZ ? totalX : totalZ));
+	printf("Rendering chunks %d %d to %d %d for the rectangle\n", fromX, fromZ, toX - 1, toZ - 1);
+}
+
+void changedPatches(const std::vector<std::pair<int, int> > &changed, const int cropLeft, const int cropTop, const int width, const int height, std::vector<Patch> &patches)
+{
+	// Cells of TILESIZE x TILESIZE pixels of the image that the changed chunks, or the chunks next to them, draw to.
+	// Cells next to each other in a row become one patch, so the chunks they share are only loaded once
+	const int cellsX = (width + TILESIZE - 1) / TILESIZE, cellsY = (height + TILESIZE - 1) / TILESIZE;
+	std::vector<char> cells(size_t(cellsX) * cellsY, 0);
+	for (size_t i = 0; i < changed.size(); ++i) {
+		const int chunkX = TERRAINCHUNK(changed[i].first), chunkZ = TERRAINCHUNK(changed[i].second);
+		for (int x = chunkX - 1; x <= chunkX + 1; ++x) {
+			for (int z = chunkZ - 1; z <= chunkZ + 1; ++z) {
+				if (x < gTotalFromChunkX || x >= gTotalToChunkX || z < gTotalFromChunkZ || z >= gTotalToChunkZ) continue;
+				int fromX, fromY, toX, toY;
+				chunkPixels(x, z, fromX, fromY, toX, toY);
+				fromX = MAX(fromX - cropLeft, 0);
+				fromY = MAX(fromY - cropTop, 0);
+				toX = MIN(toX - cropLeft, width);
+				toY = MIN(toY - cropTop, height);
+				for (int cy = fromY / TILESIZE; cy * TILESIZE < toY; ++cy) {
+					for (int cx = fromX / TILESIZE; cx * TILESIZE < toX; ++cx) {
+						cells[size_t(cy) * cellsX + cx] = 1;
+					}
+				}
+			}
+		}
+	}
+	patches.clear();
+	for (int cy = 0; cy < cellsY; ++cy) {
+		for (int cx = 0; cx < cellsX; ++cx) {
+			if (!cells[size_t(cy) * cellsX + cx]) continue;
+			const int first = cx;
+			while (cx + 1 < cellsX && cells[size_t(cy) * cellsX + cx + 1]) ++cx;
+			const Patch patch = {first * TILESIZE, cy * TILESIZE, (cx + 1 - first) * TILESIZE, TILESIZE};
+			patches.push_back(patch);
+		}
+	}
+}
+
+bool renderPatches(FILE *fh, const char *world, const std::vector<Patch> &patches, const int cropLeft, const int cropTop)
+{
+	// -update: draw every patch the way -crop draws its rectangle, right over what the last run drew there
+	gCrop = true;
+	for (size_t i = 0; i < patches.size(); ++i) {
+		const Patch &patch = patches[i];
+		printf("Pass %d of %d...\n", int(i + 1), int(patches.size()));
+		gCropX = patch.x + cropLeft;
+		gCropY = patch.y + cropTop;
+		gCropWidth = patch.width;
+		gCropHeight = patch.height;
+		int bitmapStartX, bitmapStartY;
+		setCropWindow(bitmapStartX, bitmapStartY);
+		++g_ToChunkX;
+		++g_ToChunkZ;
+		--g_FromChunkX;
+		--g_FromChunkZ;
+		setView();
+		if (!loadTerrain(world, false, &cropNeeds)) {
+			printf("Error loading terrain from '%s'\n", world);
+			return false;
+		}
+		if (g_Underground) {
+			undergroundMode(false);
+		}
+		drawBlock = &paintBlock;
+		optimizeTerrain();
+		if (g_Nightmode || g_Skylight) {
+			resolveLight();
+		}
+		if (!(*beginPatch)(patch.x, patch.y, patch.width, patch.height)) {
+			printf("Error preparing the image for the changed part.\n");
+			return false;
+		}
+		drawTerrain(bitmapStartX, bitmapStartY);
+		if (!(*endPatch)()) {
+			printf("Error writing the changed part of the image.\n");
+			return false;
+		}
+	}
+	printf("Writing to file...\n");
+	if (!(*saveImage)(fh)) {
+		printf("Error writing the image.\n");
+		return false;
+	}
+	return true;
+}
+
+int diagonalTop(int splitX, int splitZ, int diagonal)
+{
+	// Topmost row of the uncropped image any part on the given diagonal can draw to. As the parts further down the
+	// view start even lower, every row above it is finished once the diagonal before this one is drawn
+	int top = -1;
+	for (int areaX = MAX(0, diagonal - (splitZ - 1)); areaX < splitX && areaX <= diagonal; ++areaX) {
+		int fromX, fromZ, toX, toZ, startX, startY;
+		areaBounds(splitX, splitZ, areaX, diagonal - areaX, fromX, fromZ, toX, toZ, startX, startY);
+		if (top == -1 || startY < top) top = startY;
+	}
+	return top;
+}
+
+int remainingTop(int splitX, int splitZ)
+{
+	// Topmost row of the uncropped image any of the parts after the current one can draw to, -1 if there are none
+	int top = -1;
+	for (int areaZ = gAreaZ; areaZ < splitZ; ++areaZ) {
+		for (int areaX = (areaZ == gAreaZ ? gAreaX + 1 : 0); areaX < splitX; ++areaX) {
+			int fromX, fromZ, toX, toZ, startX, startY;
+			areaBounds(splitX, splitZ, areaX, areaZ, fromX, fromZ, toX, toZ, startX, startY);
+			if (top == -1 || startY < top) top = startY;
+		}
+	}
+	return top;
+}
+
+bool finishRows(FILE *fh, const int finished)
+{
+	// All rows above 'finished' are done drawing, write them out
+	const int rows = finished - gStreamTop;
+	if (rows <= 0) {
+		return true;
+	}
+	gStreamTop += rows;
+	return (*streamRows)(fh, rows);
+}
+
+bool renderTopDown(FILE *fh, const char *world)
+{
+	// One pixel per column, rows of the image going down the view's z axis. Strips of STREAMSIZE chunks
+	// are loaded and drawn one after another and written to file right away. They don't need a border
+	// like the isometric parts, so every chunk is only loaded once
+	const bool alongZ = (g_Orientation == North || g_Orientation == South);
+	const bool reverse = (g_Orientation == South || g_Orientation == East);
+	const int from = (alongZ ? gTotalFromChunkZ : gTotalFromChunkX), to = (alongZ ? gTotalToChunkZ : gTotalToChunkX);
+	int width, height;
+	topDownSize(width, height);
+	if (!(*createStream)(fh, width, height, STREAMSIZE * CHUNKSIZE_Z)) {
+		printf("Error allocating bitmap. Check if you have enough free disk space.\n");
+		return false;
+	}
+	for (int strip = 0; strip < to - from; strip += STREAMSIZE) {
+		const int stripFrom = (reverse ? MAX(from, to - strip - STREAMSIZE) : from + strip);
+		const int stripTo = (reverse ? to - strip : MIN(to, from + strip + STREAMSIZE));
+		if (alongZ) {
+			g_FromChunkZ = stripFrom;
+			g_ToChunkZ = stripTo;
+		} else {
+			g_FromChunkX = stripFrom;
+			g_ToChunkX = stripTo;
+		}
+		setView();
+		if (!loadTerrain(world)) {
+			printf("Error loading terrain from '%s'\n", world);
+			return false;
+		}
+		if (g_Underground) {
+			undergroundMode(false);
+		}
+		drawTopDown(0, strip == 0, drawLine);
+		if (!(*streamRows)(fh, (stripTo - stripFrom) * CHUNKSIZE_Z)) {
+			printf("Error writing image rows to file.\n");
+			return false;
+		}
+	}
+	return true;
+}
+
+void topDownSize(int &width, int &height)
+{
+	// Size of the image renderTopDown() creates
+	const bool alongZ = (g_Orientation == North || g_Orientation == South);
+	width = (alongZ ? gTotalToChunkX - gTotalFromChunkX : gTotalToChunkZ - gTotalFromChunkZ) * CHUNKSIZE_X;
+	height = (alongZ ? gTotalToChunkZ - gTotalFromChunkZ : gTotalToChunkX - gTotalFromChunkX) * CHUNKSIZE_Z;
+}
+
 void assignFunctionPointers()
 {
-	if (gPng) {
+	if (gPyramid) {
+#ifdef WITHPNG
+		// Always streamed, so there's no whole image to create
+		createImage = NULL;
+		loadImagePart = NULL;
+		setPixel = &setPixelPyramid;
+		blendPixel = &blendPixelPyramid;
+		saveImagePart = NULL;
+		calcImageSize = &calcImageSizePng;
+		fitsImage = NULL; // Every tile is a file of its own
+		drawLine = &drawLinePyramid;
+		beginTile = &beginTilePyramid;
+		endTile = &endTilePyramid;
+		createStream = &createStreamPyramid;
+		streamRows = &streamRowsPyramid;
+		rowsDone = NULL;
+		openImage = &openImagePyramid;
+		beginPatch = &beginPatchPyramid;
+		endPatch = &endPatchPyramid;
+		saveImage = &saveImagePyramid; // Only used by -update
+#endif
+	} else if (gPng) {
 #ifdef WITHPNG
 		createImage = &createImagePng;
 		saveImage = &saveImagePng;
@@ -645,7 +1774,35 @@ void assignFunctionPointers()
 		blendPixel = &blendPixelPng;
 		saveImagePart = &saveImagePartPng;
 		calcImageSize = &calcImageSizePng;
+		fitsImage = &fitsImagePng;
+		drawLine = &drawLinePng;
+		beginTile = &beginTilePng;
+		endTile = &endTilePng;
+		createStream = &createStreamPng;
+		streamRows = &streamRowsPng;
+		rowsDone = &rowsDonePng;
+		openImage = &openImagePng;
+		beginPatch = &beginPatchPng;
+		endPatch = &endPatchPng;
 #endif
+	} else if (gTiff) {
+		createImage = &createImageTiff;
+		saveImage = &saveImageBmp;
+		loadImagePart = &loadImagePartBmp;
+		setPixel = &setPixelTiff;
+		blendPixel = &blendPixelTiff;
+		saveImagePart = &saveImagePartBmp;
+		calcImageSize = &calcImageSizeTiff;
+		fitsImage = NULL; // Sizes are 64 bit
+		drawLine = &drawLineTiff;
+		beginTile = &beginTileTiff;
+		endTile = &endTileTiff;
+		createStream = &createStreamTiff;
+		streamRows = &streamRowsBmp;
+		rowsDone = NULL; // Drawn straight into the file if it could be mapped
+		openImage = &openImageTiff;
+		beginPatch = &beginPatchBmp;
+		endPatch = &endPatchBmp;
 	} else {
 		createImage = &createImageBmp;
 		saveImage = &saveImageBmp;
@@ -654,6 +1811,16 @@ void assignFunctionPointers()
 		blendPixel = &blendPixelBmp;
 		saveImagePart = &saveImagePartBmp;
 		calcImageSize = &calcImageSizeBmp;
+		fitsImage = &fitsImageBmp;
+		drawLine = &drawLineBmp;
+		beginTile = &beginTileBmp;
+		endTile = &endTileBmp;
+		createStream = &createStreamBmp;
+		streamRows = &streamRowsBmp;
+		rowsDone = NULL;
+		openImage = &openImageBmp;
+		beginPatch = &beginPatchBmp;
+		endPatch = &endPatchBmp;
 	}
 }
 
@@ -668,17 +1835,47 @@ void printHelp(char* binary)
 			"                Note: Currently you need both -from and -to to define\n"
 			"                bounds, otherwise the entire world will be rendered.\n"
 			"  -cave         renders a map of all caves that have been explored by players\n"
-			"  -blendcave    overlay caves over normal map; doesn't work with incremental\n"
-			"                rendering (some parts will be hidden)\n"
+			"  -blendcave    overlay caves over normal map; with incremental rendering,\n"
+			"                caves near the borders of the parts can come out different;\n"
+			"                can't be used with -stream or -tiles\n"
 			"  -night        renders the world at night using blocklight (torches)\n"
 			"  -skylight     use skylight when rendering map (shadows below trees etc.)\n"
 			"                hint: using this with -night makes a difference\n"
+			"  -frontback    render front to back using a coverage buffer instead of\n"
+			"                removing hidden blocks first; usually faster on big maps\n"
+			"  -deferred     rasterise first, then calculate colors in a separate pass\n"
+			"  -stream       render the map in small parts from top to bottom, writing\n"
+			"                finished rows to file right away; -mem is ignored, memory\n"
+			"                use only grows with the width of the map\n"
+			"  -topdown      render the map seen from straight above, one pixel per\n"
+			"                block; much faster than the isometric view. Works with\n"
+			"                -night, -skylight, -cave and -scale\n"
+			"  -crop X Y W H only render the W by H pixels at X,Y of the image the other\n"
+			"                options would give; only the chunks drawing to them are\n"
+			"                loaded, so this takes about as long as the area is big\n"
+			"  -update NAME  keep when every chunk was last changed in the file 'NAME';\n"
+			"                if it is there from an earlier run with the same options,\n"
+			"                only the parts of the image (or tiles) that the chunks\n"
+			"                changed since draw to are drawn anew, so refreshing a map\n"
+			"                takes about as long as the changes are big\n"
+			"  -gbuffer NAME like -deferred, also save the rasterised map to 'NAME'\n"
+			"  -shade NAME   create image from a file saved with -gbuffer; no world\n"
+			"                needed, so -night, -skylight, -noise or -colors can be\n"
+			"                changed without rendering again. Light is only available\n"
+			"                if the G-buffer was created with -night or -skylight\n"
 			"  -noise VAL    adds some noise to certain blocks, reasonable values are 0-20\n"
+			"  -scale VAL    render the map at 1/VAL of its size, VAL can be 2, 4 or 8;\n"
+			"                every VAL-th block is drawn, and -from/-to are rounded to\n"
+			"                multiples of VAL chunks; can't be used with -cave or\n"
+			"                -blendcave\n"
 			"  -height VAL   maximum height at which blocks will be rendered (1-128)\n"
 			"  -file NAME    sets the output filename to 'NAME'; default is output.bmp\n"
+			"  -threads VAL  number of threads to use; default is one per CPU\n"
 			"  -mem VAL      sets the amount of memory (in MiB) used for rendering. mcmap\n"
 			"                will use incremental rendering or disk caching to stick to\n"
 			"                this limit. Default is 1800.\n"
+			"  -tmpdir DIR   where to keep the image while it's drawn, if it's a png and\n"
+			"                doesn't fit the memory limit; default is the system's temp dir\n"
 			"  -colors NAME  loads user defined colors from file 'NAME'\n"
 			"  -dumpcolors   creates a file which contains the default colors being used\n"
 			"                for rendering. Can be used to modify them and then use -colors\n"
@@ -687,7 +1884,17 @@ void printHelp(char* binary)
 			"                it only makes sense to pass one of them; East is default\n"
 #ifdef WITHPNG
 			"  -png          set output format to png instead of bmp\n"
+			"  -pnglevel VAL compression level of the png, 0-9; default is 6\n"
+			"  -pngfilter NAME\n"
+			"                row filter of the png: none, sub, up, average, paeth or\n"
+			"                adaptive (default). The png is compressed on all threads\n"
+			"  -tiles DIR    write 256x256 png tiles for web maps (Leaflet etc.) to\n"
+			"                DIR/zoom/x/y.png instead of one image, with zoom levels down\n"
+			"                to one tile for the whole map. Empty tiles are left out.\n"
+			"                Implies -stream, so memory use stays low\n"
 #endif
+			"  -tiff         write an uncompressed BigTIFF instead of a bmp; this is done\n"
+			"                automatically if the image is too big for a bmp or png\n"
 			"\n    WORLDPATH is the path of the desired alpha world.\n\n"
 			////////////////////////////////////////////////////////////////////////////////
 			"Examples:\n\n"
@@ -0,0 +1,183 @@
+#include "threads.h"
+#include "helper.h"
+#include "globals.h"
+
+#if defined(_WIN32) && !defined(__GNUC__)
+#	define MSVCP
+#	include <windows.h>
+	typedef HANDLE THREADHANDLE;
+#else
+#	include <pthread.h>
+#	include <unistd.h>
+	typedef pthread_t THREADHANDLE;
+#endif
+
+#define MAX_THREADS 64
+
+namespace {
+	struct JobQueue {
+		JobFunc func;
+		void *data;
+		size_t jobs;
+		volatile size_t next, done, total;
+	};
+
+	struct Thread {
+		THREADHANDLE handle;
+		JobFunc func;
+		void *data;
+		size_t result;
+		volatile size_t done;
+	};
+
+	inline size_t atomicAdd(volatile size_t *value, const size_t add);
+	void doJobs(JobQueue *queue, const bool progress);
+#ifdef MSVCP
+	DWORD WINAPI worker(LPVOID queue);
+	DWORD WINAPI single(LPVOID thread);
+#else
+	void *worker(void *queue);
+	void *single(void *thread);
+#endif
+}
+
+int numThreads()
+{
+	if (g_Threads <= 0) {
+#ifdef MSVCP
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		g_Threads = int(info.dwNumberOfProcessors);
+#else
+		g_Threads = int(sysconf(_SC_NPROCESSORS_ONLN));
+#endif
+	}
+	if (g_Threads < 1) g_Threads = 1;
+	if (g_Threads > MAX_THREADS) g_Threads = MAX_THREADS;
+	return g_Threads;
+}
+
+size_t runJobs(JobFunc func, void *data, size_t jobs, bool progress)
+{
+	JobQueue queue;
+	queue.func = func;
+	queue.data = data;
+	queue.jobs = jobs;
+	queue.next = queue.done = queue.total = 0;
+	const int threads = (int)MIN(size_t(numThreads()), jobs);
+	// Calling thread does its share of the work too
+	THREADHANDLE handles[MAX_THREADS];
+	int started = 0;
+	for (int i = 1; i < threads; ++i) {
+#ifdef MSVCP
+		handles[started] = CreateThread(NULL, 0, &worker, &queue, 0, NULL);
+		if (handles[started] == NULL) break;
+#else
+		if (pthread_create(&handles[started], NULL, &worker, &queue) != 0) break;
+#endif
+		++started;
+	}
+	doJobs(&queue, progress);
+	for (int i = 0; i < started; ++i) {
+#ifdef MSVCP
+		WaitForSingleObject(handles[i], INFINITE);
+		CloseHandle(handles[i]);
+#else
+		pthread_join(handles[i], NULL);
+#endif
+	}
+	return queue.total;
+}
+
+void *startThread(JobFunc func, void *data)
+{
+	Thread *thread = new Thread;
+	thread->func = func;
+	thread->data = data;
+	thread->result = thread->done = 0;
+#ifdef MSVCP
+	thread->handle = CreateThread(NULL, 0, &single, thread, 0, NULL);
+	if (thread->handle == NULL) {
+#else
+	if (pthread_create(&thread->handle, NULL, &single, thread) != 0) {
+#endif
+		delete thread;
+		return NULL;
+	}
+	return thread;
+}
+
+size_t joinThread(void *thread)
+{
+	Thread *t = (Thread*)thread;
+#ifdef MSVCP
+	WaitForSingleObject(t->handle, INFINITE);
+	CloseHandle(t->handle);
+#else
+	pthread_join(t->handle, NULL);
+#endif
+	const size_t result = t->result;
+	delete t;
+	return result;
+}
+
+bool threadDone(void *thread)
+{
+	return atomicAdd(&((Thread*)thread)->done, 0) != 0;
+}
+
+namespace {
+
+	inline size_t atomicAdd(volatile size_t *value, const size_t add)
+	{	// Returns the value before adding
+#ifdef MSVCP
+#	ifdef _WIN64
+		return size_t(InterlockedExchangeAdd64((volatile LONGLONG*)value, LONGLONG(add)));
+#	else
+		return size_t(InterlockedExchangeAdd((volatile LONG*)value, LONG(add)));
+#	endif
+#else
+		return __sync_fetch_and_add(value, add);
+#endif
+	}
+
+	void doJobs(JobQueue *queue, const bool progress)
+	{
+		size_t total = 0;
+		for (;;) {
+			const size_t job = atomicAdd(&queue->next, 1);
+			if (job >= queue->jobs) break;
+			total += (*queue->func)(queue->data, job);
+			const size_t done = atomicAdd(&queue->done, 1) + 1;
+			if (progress && done < queue->jobs) printProgress(done, queue->jobs);
+		}
+		atomicAdd(&queue->total, total);
+	}
+
+#ifdef MSVCP
+	DWORD WINAPI worker(LPVOID queue)
+	{
+		doJobs((JobQueue*)queue, false);
+		return 0;
+	}
+#else
+	void *worker(void *queue)
+	{
+		doJobs((JobQueue*)queue, false);
+		return NULL;
+	}
+#endif
+
+#ifdef MSVCP
+	DWORD WINAPI single(LPVOID thread)
+#else
+	void *single(void *thread)
+#endif
+	{
+		Thread *t = (Thread*)thread;
+		t->result = (*t->func)(t->data, 0);
+		atomicAdd(&t->done, 1);
+		return 0;
+	}
+
+}
@@ -0,0 +1,20 @@
+#ifndef _THREADS_H_
+#define _THREADS_H_
+
+#include <cstdlib>
+
+// One job out of many; whatever it returns is summed up over all jobs (number of removed blocks etc.)
+typedef size_t (*JobFunc)(void *data, size_t job);
+
+// Runs func for job = 0..jobs-1, spread across g_Threads threads; returns the sum of all results
+// Only the calling thread prints progress, jobs should not print anything
+size_t runJobs(JobFunc func, void *data, size_t jobs, bool progress);
+// Number of threads runJobs will use; if g_Threads is 0 it is set to the number of CPUs
+int numThreads();
+// Runs func(data, 0) on a thread of its own while the caller goes on; NULL if no thread could be started.
+// joinThread waits for it to end and returns what func returned, threadDone tells whether that would wait
+void *startThread(JobFunc func, void *data);
+size_t joinThread(void *thread);
+bool threadDone(void *thread);
+
+#endif
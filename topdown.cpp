@@ -0,0 +1,106 @@
+/**
+ * Top-down view: one pixel per column of the terrain, showing its topmost block and whatever
+ * translucent blocks are above that. Only the top of every column is looked at, so this is
+ * little more work than loading the terrain.
+ */
+
+#include "topdown.h"
+#include "helper.h"
+#include "colors.h"
+#include "globals.h"
+#include "deferred.h"
+#include "threads.h"
+#include <cstring>
+#include <cstdio>
+#include <vector>
+
+namespace {
+	// shadeBrightness() for every height, light + 1 (0 = no light used) and edge flag
+	float gBrightness[256][17][2];
+	// Topmost block + 1 of every column in the last row drawn, for edges at the top of the next strip
+	std::vector<uint8_t> gAbove;
+	// Colors (BGRA) and drawLine() ops of all pixels of the strip
+	uint8_t *gColors = NULL, *gOps = NULL;
+
+	size_t rowJob(void *, size_t z);
+	inline void shadeColumn(const size_t x, const size_t z, const bool edge, uint8_t *color, uint8_t &op);
+}
+
+void drawTopDown(const int offsetY, const bool first, void (*drawLine)(size_t x, size_t y, size_t count, const uint8_t *colors, const uint8_t *ops))
+{
+	// Draw the whole terrain currently loaded, view row z goes to image row offsetY + z.
+	// Strips have to be drawn from top to bottom, the first one with first = true
+	if (first) {
+		for (size_t y = 0; y < 256; ++y) {
+			for (int l = 0; l < 17; ++l) {
+				gBrightness[y][l][0] = shadeBrightness(y, l - 1, false);
+				gBrightness[y][l][1] = shadeBrightness(y, l - 1, true);
+			}
+		}
+		gAbove.assign(g_MapsizeX, 255);
+		printf("Drawing map...\n");
+	}
+	gColors = new uint8_t[g_MapsizeX * g_MapsizeZ * 4];
+	gOps = new uint8_t[g_MapsizeX * g_MapsizeZ];
+	runJobs(&rowJob, NULL, g_MapsizeZ, true);
+	for (size_t z = 0; z < g_MapsizeZ; ++z) {
+		(*drawLine)(0, offsetY + z, g_MapsizeX, gColors + z * g_MapsizeX * 4, gOps + z * g_MapsizeX);
+	}
+	for (size_t x = 0; x < g_MapsizeX; ++x) {
+		gAbove[x] = HEIGHTAT(0, x, g_MapsizeZ - 1)[1];
+	}
+	delete[] gColors;
+	delete[] gOps;
+	gColors = gOps = NULL;
+	printProgress(10, 10);
+}
+
+namespace {
+
+	size_t rowJob(void *, size_t z)
+	{	// One row of pixels; a column is at an edge if it is higher than the one to the top left of it
+		uint8_t *color = gColors + z * g_MapsizeX * 4, *op = gOps + z * g_MapsizeX;
+		for (size_t x = 0; x < g_MapsizeX; ++x) {
+			const uint8_t top = HEIGHTAT(0, x, z)[1];
+			const uint8_t behind = (x == 0 ? top : (z == 0 ? gAbove[x - 1] : HEIGHTAT(0, x - 1, z - 1)[1]));
+			shadeColumn(x, z, top > behind, color + x * 4, op[x]);
+		}
+		return 0;
+	}
+
+	inline void shadeColumn(const size_t x, const size_t z, const bool edge, uint8_t *color, uint8_t &op)
+	{
+		// Walk down the column and mix the blocks front to back, until one is opaque or nothing below can be seen anymore.
+		// Every block is shaded like the isometric view does it for the top of that block
+		const uint8_t *column = &BLOCKAT(x, 0, z);
+		const uint8_t *height = HEIGHTAT(0, x, z);
+		const bool light = (g_Nightmode || g_Skylight);
+		int b = 0, g = 0, r = 0, alpha = 0;
+		bool topmost = true;
+		for (size_t y = height[1] - 1; y >= height[0] && y < g_MapsizeY; --y) {
+			const uint8_t c = column[y];
+			if (colors[c][ALPHA] == 0) continue;
+			const int weight = (255 - alpha) * colors[c][ALPHA] / 255;
+			if (weight == 0) break;
+			// The light that hits the top of the block is the one of the block above
+			const int l = (!light ? 0 : 1 + (y + 1 < g_MapsizeY ? GETLIGHTAT(x, y + 1, z) : (g_Nightmode ? 3 : 15)));
+			const float fsub = gBrightness[WORLDY(y)][l][edge && topmost ? 1 : 0];
+			const int sub = int(fsub * (float(colors[c][BRIGHTNESS]) / 323.0f + .21f)); // The brighter the color, the stronger the impact
+			b += clamp(colors[c][BLUE] + sub) * weight;
+			g += clamp(colors[c][GREEN] + sub) * weight;
+			r += clamp(colors[c][RED] + sub) * weight;
+			alpha += weight;
+			topmost = false;
+		}
+		if (alpha == 0) { // Nothing in this column
+			op = 0;
+			return;
+		}
+		color[BLUE] = uint8_t(b / alpha);
+		color[GREEN] = uint8_t(g / alpha);
+		color[RED] = uint8_t(r / alpha);
+		color[ALPHA] = uint8_t(alpha);
+		op = (alpha == 255 ? 1 : 2); // Translucent all the way down: blend once onto the background
+	}
+
+}
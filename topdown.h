@@ -0,0 +1,8 @@
+#ifndef _TOPDOWN_H_
+#define _TOPDOWN_H_
+
+#include "helper.h"
+
+void drawTopDown(const int offsetY, const bool first, void (*drawLine)(size_t x, size_t y, size_t count, const uint8_t *colors, const uint8_t *ops));
+
+#endif
@@ -0,0 +1,102 @@
+/**
+ * -update: the state file remembers the settings of the last run and when every chunk file of the
+ * world was last changed, so the next run can tell which chunks changed since and only draw those
+ * parts of the image anew. It's a text file: a line to recognize it, the settings, then one line
+ * per chunk file with its position, modification time and size
+ */
+
+#include "update.h"
+#include "helper.h"
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#define STATE_HEADER "mcmap update state 1"
+
+namespace {
+	bool readLine(FILE *fh, std::string &line);
+	bool stampBefore(const ChunkStamp &a, const ChunkStamp &b);
+}
+
+bool loadStamps(const char *file, std::string &settings, std::vector<ChunkStamp> &stamps)
+{
+	// False if there is no state file or it isn't one
+	FILE *fh = fopen(file, "r");
+	if (fh == NULL) return false;
+	std::string header;
+	if (!readLine(fh, header) || header != STATE_HEADER || !readLine(fh, settings)) {
+		fclose(fh);
+		return false;
+	}
+	stamps.clear();
+	ChunkStamp stamp;
+	long long time, size;
+	while (fscanf(fh, "%d %d %lld %lld", &stamp.x, &stamp.z, &time, &size) == 4) {
+		stamp.time = int64_t(time);
+		stamp.size = int64_t(size);
+		stamps.push_back(stamp);
+	}
+	const bool ok = (feof(fh) != 0);
+	fclose(fh);
+	return ok;
+}
+
+bool saveStamps(const char *file, const std::string &settings, const std::vector<ChunkStamp> &stamps)
+{
+	FILE *fh = fopen(file, "w");
+	if (fh == NULL) return false;
+	bool ok = (fprintf(fh, "%s\n%s\n", STATE_HEADER, settings.c_str()) > 0);
+	for (size_t i = 0; ok && i < stamps.size(); ++i) {
+		ok = (fprintf(fh, "%d %d %lld %lld\n", stamps[i].x, stamps[i].z, (long long)stamps[i].time, (long long)stamps[i].size) > 0);
+	}
+	return (fclose(fh) == 0) && ok;
+}
+
+void changedChunks(std::vector<ChunkStamp> &before, std::vector<ChunkStamp> &now, std::vector<std::pair<int, int> > &changed)
+{
+	// Chunks that are new, gone, or whose file was written to since. Both lists get sorted by position
+	std::sort(before.begin(), before.end(), &stampBefore);
+	std::sort(now.begin(), now.end(), &stampBefore);
+	changed.clear();
+	size_t i = 0, j = 0;
+	while (i < before.size() || j < now.size()) {
+		if (j == now.size() || (i < before.size() && stampBefore(before[i], now[j]))) {
+			changed.push_back(std::make_pair(before[i].x, before[i].z));
+			++i;
+		} else if (i == before.size() || stampBefore(now[j], before[i])) {
+			changed.push_back(std::make_pair(now[j].x, now[j].z));
+			++j;
+		} else {
+			if (before[i].time != now[j].time || before[i].size != now[j].size) {
+				changed.push_back(std::make_pair(now[j].x, now[j].z));
+			}
+			++i;
+			++j;
+		}
+	}
+}
+
+namespace {
+
+	bool readLine(FILE *fh, std::string &line)
+	{
+		// One line without the line break, however long it is
+		char buffer[1024];
+		line.clear();
+		while (fgets(buffer, sizeof(buffer), fh) != NULL) {
+			line += buffer;
+			if (!line.empty() && line[line.size() - 1] == '\n') {
+				line.erase(line.size() - 1);
+				if (!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+				return true;
+			}
+		}
+		return !line.empty();
+	}
+
+	bool stampBefore(const ChunkStamp &a, const ChunkStamp &b)
+	{
+		return a.x < b.x || (a.x == b.x && a.z < b.z);
+	}
+
+}
@@ -0,0 +1,13 @@
+#ifndef _UPDATE_H_
+#define _UPDATE_H_
+
+#include "worldloader.h"
+#include <string>
+#include <vector>
+#include <utility>
+
+bool loadStamps(const char *file, std::string &settings, std::vector<ChunkStamp> &stamps);
+bool saveStamps(const char *file, const std::string &settings, const std::vector<ChunkStamp> &stamps);
+void changedChunks(std::vector<ChunkStamp> &before, std::vector<ChunkStamp> &now, std::vector<std::pair<int, int> > &changed);
+
+#endif
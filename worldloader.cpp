@@ -4,7 +4,9 @@
 #include "nbt.h"
 #include "colors.h"
 #include "globals.h"
+#include "threads.h"
 #include <list>
+#include <map>
 #include <cstring>
 #include <string>
 #include <cstdio>
@@ -30,15 +32,33 @@ namespace {
 	typedef std::list<char*> charList;
 	typedef std::list<Chunk*> chunkList;
 
+	// Chunks loadTerrain() keeps when streaming, until releaseChunks() finds they're not needed anymore
+	struct CachedChunk {
+		int x, z; // Where the chunk says it is
+		uint8_t *data; // Blocks, then block light and sky light if they are needed; NULL if there is no chunk
+		bool used;
+	};
+	typedef std::map<std::pair<int, int>, CachedChunk> chunkCache;
+
 	size_t lightsize;
 	chunkList chunks;
-
-
+	chunkCache cachedChunks;
+	uint8_t *gTerrainCopy = NULL, *gHeightsCopy = NULL; // Untouched terrain for the cave overlay, see keepTerrain()
 }
 
-static void loadChunk(const char *file);
+// Size of a chunk once it is loaded; smaller than in the file with -scale, see sampleChunk()
+#define SAMPLES_X (CHUNKSIZE_X / g_Scale)
+#define SAMPLES_Z (CHUNKSIZE_Z / g_Scale)
+#define SAMPLES_Y (CHUNKSIZE_Y / g_Scale)
+#define SAMPLES (SAMPLES_X * SAMPLES_Z * SAMPLES_Y)
+
+static void loadChunk(const char *file, CachedChunk *keep);
+static void sampleChunk(const uint8_t *blockdata, const uint8_t *lightdata, const uint8_t *skydata, uint8_t *blocks, uint8_t *light, uint8_t *sky);
+static void copyChunk(const int chunkX, const int chunkZ, const uint8_t *blockdata, const uint8_t *lightdata, const uint8_t *skydata);
 static bool isAlphaWorld(string path);
 static void allocateTerrain();
+static inline void columnInfo(const size_t x, const size_t z);
+static void dilate(uint64_t *line, const size_t count, const size_t stride, const size_t before, const size_t after, uint64_t *buffer);
 
 bool scanWorldDirectory(const char *fromPath)
 {
@@ -134,6 +154,17 @@ bool scanWorldDirectory(const char *fromPath)
 	return true;
 }
 
+void chunkStamps(std::vector<ChunkStamp> &stamps)
+{
+	// Of all chunks scanWorldDirectory() found
+	stamps.clear();
+	stamps.reserve(chunks.size());
+	for (chunkList::iterator it = chunks.begin(); it != chunks.end(); it++) {
+		ChunkStamp stamp = {(**it).x, (**it).z, 0, 0};
+		if (fileStamp((**it).filename, stamp.time, stamp.size)) stamps.push_back(stamp);
+	}
+}
+
 bool loadEntireTerrain()
 {
 	if (chunks.empty()) return false;
@@ -143,13 +174,17 @@ bool loadEntireTerrain()
 	printf("Loading all chunks..\n");
 	for (chunkList::iterator it = chunks.begin(); it != chunks.end(); it++) {
 		printProgress(count++, max);
-		loadChunk((**it).filename);
+		loadChunk((**it).filename, NULL);
+	}
+	updateHeightPyramid();
+	if (g_Underground) {
+		discoverCaves(false);
 	}
 	printProgress(10, 10);
 	return true;
 }
 
-bool loadTerrain(const char* fromPath)
+bool loadTerrain(const char* fromPath, const bool cache, bool (*wanted)(int chunkX, int chunkZ))
 {
 	if (fromPath == NULL || *fromPath == '\0') return false;
 	allocateTerrain();
@@ -163,19 +198,55 @@ bool loadTerrain(const char* fromPath)
 	}
 
 	printf("Loading all chunks..\n");
-	for (int chunkZ = g_FromChunkZ; chunkZ < g_ToChunkZ; ++chunkZ) {
-		printProgress(chunkZ - g_FromChunkZ, g_ToChunkZ - g_FromChunkZ);
-		for (int chunkX = g_FromChunkX; chunkX < g_ToChunkX; ++chunkX) {
+	// Chunks of the world, there are g_Scale x g_Scale of them per chunk of the terrain
+	const int fromZ = g_FromChunkZ * g_Scale, toZ = g_ToChunkZ * g_Scale;
+	for (int chunkZ = fromZ; chunkZ < toZ; ++chunkZ) {
+		printProgress(chunkZ - fromZ, toZ - fromZ);
+		for (int chunkX = g_FromChunkX * g_Scale; chunkX < g_ToChunkX * g_Scale; ++chunkX) {
+			if (wanted != NULL && !(*wanted)(TERRAINCHUNK(chunkX), TERRAINCHUNK(chunkZ))) continue; // Stays empty
+			chunkCache::iterator it = cachedChunks.find(std::make_pair(chunkX, chunkZ));
+			if (it != cachedChunks.end()) { // Streaming, and some earlier part of the map needed this chunk too
+				const CachedChunk &chunk = it->second;
+				it->second.used = true;
+				if (chunk.data != NULL) {
+					const uint8_t *light = chunk.data + SAMPLES;
+					copyChunk(chunk.x, chunk.z, chunk.data, light, light + (g_Nightmode || g_Skylight ? SAMPLES / 2 : 0));
+				}
+				continue;
+			}
 			string thispath = path + base36((chunkX + 640000) % 64) + "/" + base36((chunkZ + 640000) % 64) + "/c." + base36(chunkX) + "." + base36(chunkZ) + ".dat";
-			loadChunk(thispath.c_str());
+			if (cache) {
+				CachedChunk chunk = {chunkX, chunkZ, NULL, true};
+				loadChunk(thispath.c_str(), &chunk);
+				cachedChunks[std::make_pair(chunkX, chunkZ)] = chunk;
+			} else {
+				loadChunk(thispath.c_str(), NULL);
+			}
 		}
 	}
 	// Done loading all chunks
+	updateHeightPyramid();
+	if (g_Underground) {
+		discoverCaves(false);
+	}
 	printProgress(10, 10);
 	return true;
 }
 
-static void loadChunk(const char *file)
+void releaseChunks()
+{	// Drop every chunk loadTerrain() didn't need since the last call
+	for (chunkCache::iterator it = cachedChunks.begin(); it != cachedChunks.end();) {
+		if (it->second.used) {
+			it->second.used = false;
+			++it;
+		} else {
+			delete[] it->second.data;
+			cachedChunks.erase(it++);
+		}
+	}
+}
+
+static void loadChunk(const char *file, CachedChunk *keep)
 {
 	bool ok = false; // Get path name for all required chunks
 	NBT chunk(file, ok);
@@ -191,14 +262,7 @@ static void loadChunk(const char *file)
 	ok = level->getInt("xPos", chunkX);
 	ok = ok && level->getInt("zPos", chunkZ);
 	if (!ok) return;
-	// Check if chunk is in desired bounds (not a chunk where the filename tells a different position)
-	if (chunkX < g_FromChunkX || chunkX >= g_ToChunkX || chunkZ < g_FromChunkZ || chunkZ >= g_ToChunkZ) {
-#ifdef _DEBUG
-		printf("Chunk %s is out of bounds. %d %d\n", file, chunkX, chunkZ);
-#endif
-		return; // Nope, its not...
-	}
-	uint8_t *blockdata, *lightdata, *skydata;
+	uint8_t *blockdata, *lightdata = NULL, *skydata = NULL;
 	int32_t len;
 	ok = level->getByteArray("Blocks", blockdata, len);
 	if (!ok || len < 32768) return;
@@ -206,91 +270,113 @@ static void loadChunk(const char *file)
 		ok = level->getByteArray("BlockLight", lightdata, len);
 		if (!ok || len < 16384) return;
 	}
-	if (g_Skylight) { // Skylight desired - wish granted
+	if (g_Skylight || g_SkyLight != NULL) { // Skylight desired - wish granted
 		ok = level->getByteArray("SkyLight", skydata, len);
 		if (!ok || len < 16384) return;
 	}
-	const int offsetz = (chunkZ - g_FromChunkZ) * CHUNKSIZE_Z;
-	const int offsetx = (chunkX - g_FromChunkX) * CHUNKSIZE_X;
-	// Now read all blocks from this chunk and copy them to the world array
-	// Rotation introduces lots of if-else blocks here :-(
-	// Maybe make the macros functions and then use pointers....
-	for (int x = 0; x < CHUNKSIZE_X; ++x) {
-		for (int z = 0; z < CHUNKSIZE_Z; ++z) {
-			if (g_Orientation == East) {
-				memcpy(&BLOCKEAST(x + offsetx, 0, z + offsetz), &blockdata[(z + (x * CHUNKSIZE_Z)) * CHUNKSIZE_Y], g_MapsizeY);
-			} else if (g_Orientation == North) {
-				memcpy(&BLOCKNORTH(x + offsetx, 0, z + offsetz), &blockdata[(z + (x * CHUNKSIZE_Z)) * CHUNKSIZE_Y], g_MapsizeY);
-			} else if (g_Orientation == South) {
-				memcpy(&BLOCKSOUTH(x + offsetx, 0, z + offsetz), &blockdata[(z + (x * CHUNKSIZE_Z)) * CHUNKSIZE_Y], g_MapsizeY);
-			} else {
-				memcpy(&BLOCKWEST(x + offsetx, 0, z + offsetz), &blockdata[(z + (x * CHUNKSIZE_Z)) * CHUNKSIZE_Y], g_MapsizeY);
+	uint8_t sampled[CHUNKSIZE_X * CHUNKSIZE_Z * CHUNKSIZE_Y / 4]; // Room for the biggest chunk sampleChunk() makes
+	if (g_Scale > 1) {
+		uint8_t *light = sampled + SAMPLES, *sky = light + SAMPLES / 2;
+		sampleChunk(blockdata, lightdata, skydata, sampled, light, sky);
+		blockdata = sampled;
+		if (lightdata != NULL) lightdata = light;
+		if (skydata != NULL) skydata = sky;
+	}
+	if (keep != NULL) { // Copy what's needed before the NBT goes away
+		const size_t blocks = SAMPLES;
+		uint8_t *data = keep->data = new uint8_t[blocks + (lightdata != NULL ? blocks / 2 : 0) + (skydata != NULL ? blocks / 2 : 0)];
+		keep->x = chunkX;
+		keep->z = chunkZ;
+		memcpy(data, blockdata, blocks);
+		blockdata = data;
+		data += blocks;
+		if (lightdata != NULL) {
+			memcpy(data, lightdata, blocks / 2);
+			lightdata = data;
+			data += blocks / 2;
+		}
+		if (skydata != NULL) {
+			memcpy(data, skydata, blocks / 2);
+			skydata = data;
+		}
+	}
+	copyChunk(chunkX, chunkZ, blockdata, lightdata, skydata);
+}
+
+static void sampleChunk(const uint8_t *blockdata, const uint8_t *lightdata, const uint8_t *skydata, uint8_t *blocks, uint8_t *light, uint8_t *sky)
+{
+	// Shrink a chunk for -scale: take every g_Scale-th column, and of every g_Scale blocks of height the topmost one that
+	// isn't air, so thin layers like snow or the surface of water don't get lost. Light is the brightest of those blocks
+	for (int x = 0; x < SAMPLES_X; ++x) {
+		for (int z = 0; z < SAMPLES_Z; ++z) {
+			const size_t from = size_t((z + x * CHUNKSIZE_Z) * g_Scale) * CHUNKSIZE_Y;
+			const size_t to = size_t(z + x * SAMPLES_Z) * SAMPLES_Y;
+			for (int y = 0; y < SAMPLES_Y; ++y) {
+				uint8_t block = AIR, blockLight = 0, skyLight = 0;
+				for (int k = g_Scale - 1; k >= 0; --k) {
+					const size_t i = from + size_t(y * g_Scale + k);
+					if (block == AIR) block = blockdata[i];
+					if (lightdata != NULL) blockLight = MAX(blockLight, (lightdata[i / 2] >> ((i % 2) * 4)) & 0xF);
+					if (skydata != NULL) skyLight = MAX(skyLight, (skydata[i / 2] >> ((i % 2) * 4)) & 0xF);
+				}
+				const size_t j = to + y;
+				blocks[j] = block;
+				// Light is 4 bits, so two blocks per byte
+				if (lightdata != NULL) light[j / 2] = uint8_t(j % 2 ? light[j / 2] | (blockLight << 4) : blockLight);
+				if (skydata != NULL) sky[j / 2] = uint8_t(j % 2 ? sky[j / 2] | (skyLight << 4) : skyLight);
 			}
-			if (!(g_Nightmode || g_Skylight || g_Underground)) continue;
-			for (size_t y = 0; y < g_MapsizeY; ++y) {
-				if (g_Underground) {
-					if (blockdata[y + (z + (x * CHUNKSIZE_Z)) * CHUNKSIZE_Y] == TORCH) {
-						// In underground mode, the lightmap is also used, but the values are calculated manually, to only show
-						// caves the players have discovered yet. It's not perfect of course, but works ok.
-						for (int ty = int(y) - 9; ty < int(y) + 9; ty+=2) { // The trick here is to only take into account
-							if (ty < 0) continue; // areas around torches.
-							if (ty >= int(g_MapsizeY)) break;
-							for (int tz = int(z) - 18 + offsetz; tz < int(z) + 18 + offsetz; ++tz) {
-								if (tz < CHUNKSIZE_Z) continue;
-								for (int tx = int(x) - 18 + offsetx; tx < int(x) + 18 + offsetx; ++tx) {
-									if (tx < CHUNKSIZE_X) continue;
-									if (g_Orientation == East) {
-										if (tx >= int(g_MapsizeZ)-CHUNKSIZE_Z) break;
-										if (tz >= int(g_MapsizeX)-CHUNKSIZE_X) break;
-										SETLIGHTEAST(tx, ty, tz) = 0xFF;
-									} else if (g_Orientation == North) {
-										if (tx >= int(g_MapsizeX)-CHUNKSIZE_X) break;
-										if (tz >= int(g_MapsizeZ)-CHUNKSIZE_Z) break;
-										SETLIGHTNORTH(tx, ty, tz) = 0xFF;
-									} else if (g_Orientation == South) {
-										if (tx >= int(g_MapsizeX)-CHUNKSIZE_X) break;
-										if (tz >= int(g_MapsizeZ)-CHUNKSIZE_Z) break;
-										SETLIGHTSOUTH(tx, ty, tz) = 0xFF;
-									} else {
-										if (tx >= int(g_MapsizeZ)-CHUNKSIZE_Z) break;
-										if (tz >= int(g_MapsizeX)-CHUNKSIZE_X) break;
-										SETLIGHTWEST(tx , ty, tz) = 0xFF;
-									}
-								}
-							}
-						}
-					}
-				} else if (g_Skylight && y % 2 == 0) { // copy light info too. Only every other time, since light info is 4 bits
-					uint8_t light = lightdata[(y / 2) + (z + (x * CHUNKSIZE_Z)) * (CHUNKSIZE_Y / 2)];
-					uint8_t highlight = (light >> 4) & 0x0F;
-					uint8_t lowlight =  (light & 0x0F);
-					uint8_t sky = skydata[(y / 2) + (z + (x * CHUNKSIZE_Z)) * (CHUNKSIZE_Y / 2)];
-					uint8_t highsky = ((sky >> 4) & 0x0F);
-					uint8_t lowsky =  (sky & 0x0F);
+		}
+	}
+}
+
+static void copyChunk(const int chunkX, const int chunkZ, const uint8_t *blockdata, const uint8_t *lightdata, const uint8_t *skydata)
+{
+	// Check if chunk is in desired bounds (not a chunk where the filename tells a different position)
+	const int terrainX = TERRAINCHUNK(chunkX), terrainZ = TERRAINCHUNK(chunkZ);
+	if (terrainX < g_FromChunkX || terrainX >= g_ToChunkX || terrainZ < g_FromChunkZ || terrainZ >= g_ToChunkZ) {
+#ifdef _DEBUG
+		printf("Chunk %d %d is out of bounds.\n", chunkX, chunkZ);
+#endif
+		return; // Nope, its not...
+	}
+	const int offsetz = (terrainZ - g_FromChunkZ) * CHUNKSIZE_Z + (chunkZ - terrainZ * g_Scale) * SAMPLES_Z;
+	const int offsetx = (terrainX - g_FromChunkX) * CHUNKSIZE_X + (chunkX - terrainX * g_Scale) * SAMPLES_X;
+	const int sizeZ = (g_ToChunkZ - g_FromChunkZ) * CHUNKSIZE_Z;
+	const int sizeX = (g_ToChunkX - g_FromChunkX) * CHUNKSIZE_X;
+	const size_t lightHeight = (g_MapsizeY + 1) / 2;
+	// Now copy all blocks from this chunk to the world array. It's in world order just like the chunk,
+	// so every row of columns is one piece of memory in both
+	for (int x = 0; x < SAMPLES_X; ++x) {
+		const size_t row = size_t(offsetz + (x + offsetx) * sizeZ);
+		if (g_MapsizeY == size_t(SAMPLES_Y)) {
+			memcpy(g_Terrain + row * g_MapsizeY, &blockdata[x * SAMPLES_Z * SAMPLES_Y], SAMPLES_Z * SAMPLES_Y);
+		} else for (int z = 0; z < SAMPLES_Z; ++z) {
+			memcpy(g_Terrain + (row + z) * g_MapsizeY, &blockdata[(z + (x * SAMPLES_Z)) * SAMPLES_Y], g_MapsizeY);
+		}
+		for (int z = 0; z < SAMPLES_Z; ++z) {
+			int viewX, viewZ;
+			worldToView(x + offsetx, z + offsetz, sizeX, sizeZ, viewX, viewZ);
+			columnInfo(size_t(viewX), size_t(viewZ));
+			if (!(g_Nightmode || g_Skylight) || g_Underground) continue;
+			uint8_t *light = g_Light + (row + z) * lightHeight;
+			const size_t source = (z + (x * SAMPLES_Z)) * (SAMPLES_Y / 2);
+			if (g_SkyLight != NULL) { // Deferred shading: keep block and sky light apart, the shader mixes them
+				memcpy(light, lightdata + source, lightHeight);
+				memcpy(g_SkyLight + (light - g_Light), skydata + source, lightHeight);
+			} else if (g_Skylight) { // copy light info too. Light info is 4 bits, so two blocks per byte
+				for (size_t i = 0; i < lightHeight; ++i) {
+					uint8_t highlight = (lightdata[source + i] >> 4) & 0x0F;
+					uint8_t lowlight =  (lightdata[source + i] & 0x0F);
+					uint8_t highsky = ((skydata[source + i] >> 4) & 0x0F);
+					uint8_t lowsky =  (skydata[source + i] & 0x0F);
 					if (g_Nightmode) {
 						highsky = clamp(highsky / 3 - 2);
 						lowsky = clamp(lowsky / 3 - 2);
 					}
-					if (g_Orientation == East) {
-						SETLIGHTEAST(x + offsetx, y, z + offsetz) = (MAX(highlight, highsky) << 4) | (MAX(lowlight, lowsky) & 0x0F);
-					} else if (g_Orientation == North) {
-						SETLIGHTNORTH(x + offsetx, y, z + offsetz) = (MAX(highlight, highsky) << 4) | (MAX(lowlight, lowsky) & 0x0F);
-					} else if (g_Orientation == South) {
-						SETLIGHTSOUTH(x + offsetx, y, z + offsetz) = (MAX(highlight, highsky) << 4) | (MAX(lowlight, lowsky) & 0x0F);
-					} else {
-						SETLIGHTWEST(x + offsetx, y, z + offsetz) = (MAX(highlight, highsky) << 4) | (MAX(lowlight, lowsky) & 0x0F);
-					}
-				} else if (g_Nightmode && y % 2 == 0) {
-					if (g_Orientation == East) {
-						SETLIGHTEAST(x + offsetx, y, z + offsetz) = lightdata[(y / 2) + (z + (x * CHUNKSIZE_Z)) * (CHUNKSIZE_Y / 2)];
-					} else if (g_Orientation == North) {
-						SETLIGHTNORTH(x + offsetx, y, z + offsetz) = lightdata[(y / 2) + (z + (x * CHUNKSIZE_Z)) * (CHUNKSIZE_Y / 2)];
-					} else if (g_Orientation == South) {
-						SETLIGHTSOUTH(x + offsetx, y, z + offsetz) = lightdata[(y / 2) + (z + (x * CHUNKSIZE_Z)) * (CHUNKSIZE_Y / 2)];
-					} else {
-						SETLIGHTWEST(x + offsetx, y, z + offsetz) = lightdata[(y / 2) + (z + (x * CHUNKSIZE_Z)) * (CHUNKSIZE_Y / 2)];
-					}
+					light[i] = (MAX(highlight, highsky) << 4) | (MAX(lowlight, lowsky) & 0x0F);
 				}
+			} else if (g_Nightmode) {
+				memcpy(light, lightdata + source, lightHeight);
 			}
 		}
 	}
@@ -298,7 +384,16 @@ static void loadChunk(const char *file)
 
 size_t calcTerrainSize(int chunksX, int chunksZ)
 {
-	size_t size = size_t(chunksX+2) * CHUNKSIZE_X * size_t(chunksZ+2) * CHUNKSIZE_Z * g_MapsizeY;
+	size_t size = size_t(chunksX+2) * CHUNKSIZE_X * size_t(chunksZ+2) * CHUNKSIZE_Z * (g_MapsizeY + OPAQUEWORDS * sizeof(uint64_t) + 3);
+	if (g_Deferred && (g_Nightmode || g_Skylight) && !g_Underground) { // Separate sky light map
+		size += size_t(chunksX+2) * CHUNKSIZE_X * size_t(chunksZ+2) * CHUNKSIZE_Z * ((g_MapsizeY + 1) / 2);
+	}
+	if (g_BlendUnderground && !g_Underground) { // Copy of the terrain for the cave overlay
+		size += size_t(chunksX+2) * CHUNKSIZE_X * size_t(chunksZ+2) * CHUNKSIZE_Z * (g_MapsizeY + 2);
+	}
+	if (g_Underground || g_BlendUnderground) { // Torch bits for discoverCaves()
+		size += size_t(chunksX+2) * CHUNKSIZE_X * size_t(chunksZ+2) * CHUNKSIZE_Z * sizeof(uint64_t);
+	}
 	if (g_Nightmode || g_Underground || g_Skylight || g_BlendUnderground) {
 		return size + size_t(chunksX+2) * CHUNKSIZE_X * size_t(chunksZ+2) * CHUNKSIZE_Z * ((g_MapsizeY + 1) / 2);
 	}
@@ -309,74 +404,77 @@ void calcBitmapOverdraw(int &left, int &right, int &top, int &bottom)
 {
 	top = left = bottom = right = 0xfffffff;
 	int val = 0;
+	const int sizeX = g_ToChunkX - g_FromChunkX, sizeZ = g_ToChunkZ - g_FromChunkZ;
+	const int viewSizeX = (g_Orientation == North || g_Orientation == South ? sizeX : sizeZ);
+	const int viewSizeZ = (g_Orientation == North || g_Orientation == South ? sizeZ : sizeX);
 	for (chunkList::iterator it = chunks.begin(); it != chunks.end(); it++) {
-		const int x = (**it).x;
-		const int z = (**it).z;
-		if (g_Orientation == North) {
-			// Right
-			val = (((g_ToChunkX - 1) - x) * CHUNKSIZE_X * 2)
-					+ ((z - g_FromChunkZ) * CHUNKSIZE_Z * 2);
-			if (val < right) right = val;
-			// Left
-			val = (((g_ToChunkZ - 1) - z) * CHUNKSIZE_Z * 2)
-					+ ((x - g_FromChunkX) * CHUNKSIZE_X * 2);
-			if (val < left) left = val;
-			// Top
-			val = (z - g_FromChunkZ) * CHUNKSIZE_Z + (x - g_FromChunkX) * CHUNKSIZE_X;
-			if (val < top) top = val;
-			// Bottom
-			val = (((g_ToChunkX - 1) - x) * CHUNKSIZE_X) + (((g_ToChunkZ - 1) - z) * CHUNKSIZE_Z);
-			if (val < bottom) bottom = val;
-		} else if (g_Orientation == South) {
-			// Right
-			val = (((g_ToChunkZ - 1) - z) * CHUNKSIZE_Z * 2)
-					+ ((x - g_FromChunkX) * CHUNKSIZE_X * 2);
-			if (val < right) right = val;
-			// Left
-			val = (((g_ToChunkX - 1) - x) * CHUNKSIZE_X * 2)
-					+ ((z - g_FromChunkZ) * CHUNKSIZE_Z * 2);
-			if (val < left) left = val;
-			// Top
-			val = ((g_ToChunkZ - 1) - z) * CHUNKSIZE_Z + ((g_ToChunkX - 1) - x) * CHUNKSIZE_X;
-			if (val < top) top = val;
-			// Bottom
-			val = ((x - g_FromChunkX) * CHUNKSIZE_X) + ((z - g_FromChunkZ) * CHUNKSIZE_Z);
-			if (val < bottom) bottom = val;
-		} else if (g_Orientation == East) {
-			// Right
-			val = ((g_ToChunkZ - 1) - z) * CHUNKSIZE_Z * 2 + ((g_ToChunkX - 1) - x) * CHUNKSIZE_X * 2;
-			if (val < right) right = val;
-			// Left
-			val = ((x - g_FromChunkX) * CHUNKSIZE_X) * 2 +  + ((z - g_FromChunkZ) * CHUNKSIZE_Z) * 2;
-			if (val < left) left = val;
-			// Top
-			val = ((g_ToChunkX - 1) - x) * CHUNKSIZE_X
-					+ (z - g_FromChunkZ) * CHUNKSIZE_Z;
-			if (val < top) top = val;
-			// Bottom
-			val = ((g_ToChunkZ - 1) - z) * CHUNKSIZE_Z
-					+ (x - g_FromChunkX) * CHUNKSIZE_X;
-			if (val < bottom) bottom = val;
-		} else {
-			// Right
-			val = ((x - g_FromChunkX) * CHUNKSIZE_X) * 2 +  + ((z - g_FromChunkZ) * CHUNKSIZE_Z) * 2;
-			if (val < right) right = val;
-			// Left
-			val = ((g_ToChunkZ - 1) - z) * CHUNKSIZE_Z * 2 + ((g_ToChunkX - 1) - x) * CHUNKSIZE_X * 2;
-			if (val < left) left = val;
-			// Top
-			val = ((g_ToChunkZ - 1) - z) * CHUNKSIZE_Z
-					+ (x - g_FromChunkX) * CHUNKSIZE_X;
-			if (val < top) top = val;
-			// Bottom
-			val = ((g_ToChunkX - 1) - x) * CHUNKSIZE_X
-					+ (z - g_FromChunkZ) * CHUNKSIZE_Z;
-			if (val < bottom) bottom = val;
-		}
+		int x, z;
+		worldToView(TERRAINCHUNK((**it).x) - g_FromChunkX, TERRAINCHUNK((**it).z) - g_FromChunkZ, sizeX, sizeZ, x, z);
+		// Right
+		val = ((viewSizeX - 1) - x) * CHUNKSIZE_X * 2 + z * CHUNKSIZE_Z * 2;
+		if (val < right) right = val;
+		// Left
+		val = ((viewSizeZ - 1) - z) * CHUNKSIZE_Z * 2 + x * CHUNKSIZE_X * 2;
+		if (val < left) left = val;
+		// Top
+		val = z * CHUNKSIZE_Z + x * CHUNKSIZE_X;
+		if (val < top) top = val;
+		// Bottom
+		val = ((viewSizeX - 1) - x) * CHUNKSIZE_X + ((viewSizeZ - 1) - z) * CHUNKSIZE_Z;
+		if (val < bottom) bottom = val;
 	}
 	//if (right > (CHUNKSIZE_X + CHUNKSIZE_Y) * 2) right -= (CHUNKSIZE_X + CHUNKSIZE_Y) * 2;
 }
 
+void worldToView(const int x, const int z, const int sizeX, const int sizeZ, int &viewX, int &viewZ)
+{
+	// Where position x,z of an area of sizeX by sizeZ (blocks or chunks) ends up when it is rotated
+	if (g_Orientation == North) {
+		viewX = x;
+		viewZ = z;
+	} else if (g_Orientation == South) {
+		viewX = sizeX - (x + 1);
+		viewZ = sizeZ - (z + 1);
+	} else if (g_Orientation == East) {
+		viewX = z;
+		viewZ = sizeX - (x + 1);
+	} else {
+		viewX = sizeZ - (z + 1);
+		viewZ = x;
+	}
+}
+
+void setView()
+{
+	// Set map size and the transform BLOCKAT() etc. use from the current chunk bounds and orientation.
+	// The terrain stays in world order, so this can be changed after loading; just call updateTerrainInfo() then
+	const ptrdiff_t sizeX = (g_ToChunkX - g_FromChunkX) * CHUNKSIZE_X, sizeZ = (g_ToChunkZ - g_FromChunkZ) * CHUNKSIZE_Z;
+	if (g_Orientation == North || g_Orientation == South) {
+		g_MapsizeX = size_t(sizeX);
+		g_MapsizeZ = size_t(sizeZ);
+	} else {
+		g_MapsizeX = size_t(sizeZ);
+		g_MapsizeZ = size_t(sizeX);
+	}
+	if (g_Orientation == North) {
+		g_ViewOrigin = 0;
+		g_ViewStepX = sizeZ;
+		g_ViewStepZ = 1;
+	} else if (g_Orientation == South) {
+		g_ViewOrigin = sizeX * sizeZ - 1;
+		g_ViewStepX = -sizeZ;
+		g_ViewStepZ = -1;
+	} else if (g_Orientation == East) {
+		g_ViewOrigin = (sizeX - 1) * sizeZ;
+		g_ViewStepX = 1;
+		g_ViewStepZ = -sizeZ;
+	} else {
+		g_ViewOrigin = sizeZ - 1;
+		g_ViewStepX = -1;
+		g_ViewStepZ = sizeZ;
+	}
+}
+
 static bool isAlphaWorld(string path)
 {
 	// Check if this path is a valid minecraft world... in a pretty sloppy way
@@ -386,11 +484,37 @@ static bool isAlphaWorld(string path)
 static void allocateTerrain()
 {
 	if (g_Terrain != NULL) delete[] g_Terrain;
+	if (g_Opaque != NULL) delete[] g_Opaque;
+	for (int i = 0; i < HEIGHTLEVELS; ++i) {
+		if (g_Heights[i] != NULL) delete[] g_Heights[i];
+	}
 	if (g_Light != NULL) delete[] g_Light;
+	if (g_SkyLight != NULL) delete[] g_SkyLight;
+	g_SkyLight = NULL;
 	const size_t terrainsize = g_MapsizeZ * g_MapsizeX * g_MapsizeY;
 	printf("Terrain takes up %.2fMiB", float(terrainsize / float(1024 * 1024)));
 	g_Terrain = new uint8_t[terrainsize];
 	memset(g_Terrain, 0, terrainsize); // Preset: Air
+	if (gTerrainCopy != NULL) delete[] gTerrainCopy;
+	if (gHeightsCopy != NULL) delete[] gHeightsCopy;
+	gTerrainCopy = gHeightsCopy = NULL;
+	if (g_BlendUnderground && !g_Underground) {
+		gTerrainCopy = new uint8_t[terrainsize];
+		gHeightsCopy = new uint8_t[g_MapsizeZ * g_MapsizeX * 2];
+		printf(", copy %.2fMiB", float(terrainsize / float(1024 * 1024)));
+	}
+	const size_t opaquesize = g_MapsizeZ * g_MapsizeX * OPAQUEWORDS;
+	printf(", opacity %.2fMiB", float(opaquesize * sizeof(uint64_t) / float(1024 * 1024)));
+	g_Opaque = new uint64_t[opaquesize];
+	memset(g_Opaque, 0, opaquesize * sizeof(uint64_t));
+	for (int i = 0; i < HEIGHTLEVELS; ++i) {
+		const size_t cells = (g_MapsizeX >> HEIGHTSHIFT(i)) * (g_MapsizeZ >> HEIGHTSHIFT(i));
+		g_Heights[i] = new uint8_t[cells * 2];
+		for (size_t j = 0; j < cells * 2; j += 2) { // Preset: Empty
+			g_Heights[i][j] = 255;
+			g_Heights[i][j + 1] = 0;
+		}
+	}
 	if (g_Nightmode || g_Underground || g_BlendUnderground || g_Skylight) {
 		lightsize = g_MapsizeZ * g_MapsizeX * ((g_MapsizeY + 1) / 2);
 		printf(", lightmap %.2fMiB", float(lightsize / float(1024 * 1024)));
@@ -403,6 +527,14 @@ static void allocateTerrain()
 		} else {
 			memset(g_Light, 0xFF, lightsize);
 		}
+		if (g_Deferred && (g_Nightmode || g_Skylight) && !g_Underground) {
+			// Deferred shading decides later whether it's night or day, so keep block light and sky light.
+			// Where nothing was loaded, the mixed light has to come out as the preset above
+			g_SkyLight = new uint8_t[lightsize];
+			memset(g_Light, 0x11, lightsize);
+			memset(g_SkyLight, (g_Nightmode ? 0x00 : 0xFF), lightsize);
+			printf(", sky light %.2fMiB", float(lightsize / float(1024 * 1024)));
+		}
 	}
 	printf("\n");
 }
@@ -411,3 +543,162 @@ void clearLightmap()
 {
 	if (g_Light != NULL) memset(g_Light, 0x00, lightsize);
 }
+
+void keepTerrain()
+{	// Rendering the surface culls away most of the blocks, keep a copy for the cave overlay instead of loading twice
+	memcpy(gTerrainCopy, g_Terrain, g_MapsizeZ * g_MapsizeX * g_MapsizeY);
+	memcpy(gHeightsCopy, g_Heights[0], g_MapsizeZ * g_MapsizeX * 2);
+}
+
+void restoreTerrain()
+{	// Back to the terrain as it was when keepTerrain() was called. Only the column heights are restored with it,
+	// opacity and the rest of the height pyramid are up to date again after the next updateTerrainInfo()
+	uint8_t *culled = g_Terrain;
+	g_Terrain = gTerrainCopy;
+	gTerrainCopy = culled;
+	memcpy(g_Heights[0], gHeightsCopy, g_MapsizeZ * g_MapsizeX * 2);
+}
+
+static size_t terrainInfoJob(void *, size_t x)
+{
+	for (size_t z = 0; z < g_MapsizeZ; ++z) {
+		columnInfo(x, z);
+	}
+	return 0;
+}
+
+void updateTerrainInfo()
+{	// Needed after blocks have been changed on a large scale; columns don't share anything, so one job per row
+	runJobs(&terrainInfoJob, NULL, g_MapsizeX, false);
+	updateHeightPyramid();
+}
+
+void updateHeight(const size_t x, const size_t z)
+{	// Only for blocks being removed, the column can only get shorter
+	uint8_t *height = HEIGHTAT(0, x, z);
+	const uint8_t *column = &BLOCKAT(x, 0, z);
+	while (height[0] < height[1] && column[height[0]] == AIR) ++height[0];
+	while (height[1] > height[0] && column[height[1] - 1] == AIR) --height[1];
+	if (height[0] >= height[1]) {
+		height[0] = 255;
+		height[1] = 0;
+	}
+}
+
+void updateHeightPyramid()
+{
+	for (int level = 1; level < HEIGHTLEVELS; ++level) {
+		const size_t sizeX = g_MapsizeX >> HEIGHTSHIFT(level), sizeZ = g_MapsizeZ >> HEIGHTSHIFT(level);
+		uint8_t *height = g_Heights[level];
+		for (size_t x = 0; x < sizeX; ++x) {
+			for (size_t z = 0; z < sizeZ; ++z, height += 2) {
+				height[0] = 255;
+				height[1] = 0;
+				// Combine the 4x4 cells of the level below
+				for (size_t i = 0; i < 4; ++i) {
+					const uint8_t *sub = g_Heights[level - 1] + ((z * 4) + (x * 4 + i) * sizeZ * 4) * 2;
+					for (size_t j = 0; j < 4; ++j, sub += 2) {
+						height[0] = MIN(height[0], sub[0]);
+						height[1] = MAX(height[1], sub[1]);
+					}
+				}
+			}
+		}
+	}
+}
+
+void discoverCaves(const bool explore)
+{
+	// Light up the lightmap around torches, to only show caves the players have discovered yet. It's not perfect
+	// of course, but works ok. Every torch lights 36x36 columns around it, 9 bytes (18 blocks) of the lightmap high.
+	// Instead of doing that for every single torch, remember which lightmap bytes of a column have a torch in range,
+	// then spread those bits 36 columns along z and x. That costs the same no matter how many torches there are.
+	// When exploring (cave overlay), only torches below 63 count, and they get removed. The chunks around the map get
+	// light too then, with disk caching they are the next part of the map and hide blocks of this one
+	const size_t border = (explore ? 0 : CHUNKSIZE_X);
+	const int maxY = (explore ? MIN(int(g_MapsizeY), 64) - 1 : int(g_MapsizeY)); // Torches above are ignored
+	const int limit = (explore ? int(g_MapsizeY) - 1 : int(g_MapsizeY)); // No light from here up
+	uint64_t *torches = new uint64_t[g_MapsizeX * g_MapsizeZ];
+	memset(torches, 0, g_MapsizeX * g_MapsizeZ * sizeof(uint64_t));
+	for (size_t x = 0; x < g_MapsizeX; ++x) {
+		for (size_t z = 0; z < g_MapsizeZ; ++z) {
+			const uint8_t *height = HEIGHTAT(0, x, z);
+			uint8_t *column = &BLOCKAT(x, 0, z);
+			uint64_t bits = 0;
+			for (int y = height[0]; y < MIN(maxY, int(height[1])); ++y) {
+				if (column[y] != TORCH) continue;
+				// Blocks y-9, y-7 ... y+7 get lit, as far as they're inside the lightmap
+				const int first = (y >= 9 ? y - 9 : (y + 1) % 2);
+				const int last = (y + 7 < limit ? y + 7 : limit - 1 - (y + 7 - (limit - 1)) % 2);
+				if (first <= last) {
+					bits |= (~uint64_t(0) >> (63 - last / 2)) & (~uint64_t(0) << (first / 2));
+				}
+				if (explore) column[y] = AIR;
+			}
+			torches[z + x * g_MapsizeZ] = bits;
+		}
+	}
+	// A torch lights x-18 to x+17 in the world, which is x-17 to x+18 if the view is mirrored along that axis.
+	// Exploring happens in the view, so it's always x-18 to x+17 there
+	const bool flipX = (!explore && g_ViewStepX < 0), flipZ = (!explore && g_ViewStepZ < 0);
+	uint64_t *buffer = new uint64_t[(MAX(g_MapsizeX, g_MapsizeZ) + 36) * 2];
+	for (size_t x = 0; x < g_MapsizeX; ++x) {
+		dilate(torches + x * g_MapsizeZ, g_MapsizeZ, 1, (flipZ ? 17 : 18), (flipZ ? 18 : 17), buffer);
+	}
+	for (size_t z = border; z < g_MapsizeZ - border; ++z) {
+		dilate(torches + z, g_MapsizeX, g_MapsizeZ, (flipX ? 17 : 18), (flipX ? 18 : 17), buffer);
+	}
+	delete[] buffer;
+	for (size_t x = border; x < g_MapsizeX - border; ++x) {
+		for (size_t z = border; z < g_MapsizeZ - border; ++z) {
+			uint8_t *light = &LIGHTBYTE(g_Light, x, 0, z);
+			for (uint64_t bits = torches[z + x * g_MapsizeZ]; bits != 0; bits >>= 1, ++light) {
+				if (bits & 1) *light = 0xFF;
+			}
+		}
+	}
+	delete[] torches;
+}
+
+static void dilate(uint64_t *line, const size_t count, const size_t stride, const size_t before, const size_t after, uint64_t *buffer)
+{	// OR every value of the line into the values up to 'before' places before and 'after' places after it.
+	// Split into blocks as long as the window, every window is the end of one block plus the start of the next,
+	// so OR-ing from the start and from the end of every block once is enough (van Herk/Gil-Werman)
+	const size_t window = before + after + 1, length = count + window - 1;
+	uint64_t *forward = buffer, *backward = buffer + length;
+	for (size_t i = 0; i < length; ++i) { // Shifted by 'after', and zeroes around
+		const uint64_t val = (i >= after && i - after < count ? line[(i - after) * stride] : 0);
+		forward[i] = (i % window == 0 ? val : forward[i - 1] | val);
+		backward[i] = val;
+	}
+	for (size_t i = length - 1; i-- > 0;) {
+		if ((i + 1) % window != 0) backward[i] |= backward[i + 1];
+	}
+	for (size_t i = 0; i < count; ++i) {
+		line[i * stride] = backward[i] | forward[i + window - 1];
+	}
+}
+
+#define OPAQUE(block) int(colors[block][ALPHA] == 255)
+static inline void columnInfo(const size_t x, const size_t z)
+{	// Update opacity bits and height of a column that has just been loaded
+	const uint8_t *block = &BLOCKAT(x, 0, z);
+	uint64_t *bits = OPAQUECOLUMN(x, z);
+	uint8_t *height = HEIGHTAT(0, x, z);
+	memset(bits, 0, OPAQUEWORDS * sizeof(uint64_t));
+	size_t y = 0;
+	for (; y + 8 <= g_MapsizeY; y += 8) { // 8 at a time, most of the time this is all of them
+		const uint8_t *b = block + y;
+		const uint64_t eight = uint64_t(OPAQUE(b[0]) | (OPAQUE(b[1]) << 1) | (OPAQUE(b[2]) << 2) | (OPAQUE(b[3]) << 3)
+				| (OPAQUE(b[4]) << 4) | (OPAQUE(b[5]) << 5) | (OPAQUE(b[6]) << 6) | (OPAQUE(b[7]) << 7));
+		bits[y / 64] |= eight << (y % 64);
+	}
+	for (; y < g_MapsizeY; ++y) {
+		bits[y / 64] |= uint64_t(OPAQUE(block[y])) << (y % 64);
+	}
+	size_t lo = 0, hi = g_MapsizeY;
+	while (lo < hi && block[lo] == AIR) ++lo;
+	while (hi > lo && block[hi - 1] == AIR) --hi;
+	height[0] = uint8_t(lo < hi ? lo : 255);
+	height[1] = uint8_t(lo < hi ? hi : 0);
+}
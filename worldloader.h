@@ -2,12 +2,30 @@
 #define _WORLDLOADER_H_
 
 #include <cstdlib>
+#include <vector>
+#include <stdint.h>
+
+// When the file of a chunk was last written to, and how big it is, see -update
+struct ChunkStamp {
+	int x, z;
+	int64_t time, size;
+};
 
 bool scanWorldDirectory(const char *fromPath);
-bool loadTerrain(const char *fromPath);
+void chunkStamps(std::vector<ChunkStamp> &stamps);
+bool loadTerrain(const char *fromPath, const bool cache = false, bool (*wanted)(int chunkX, int chunkZ) = NULL);
+void releaseChunks();
 bool loadEntireTerrain();
 size_t calcTerrainSize(int chunksX, int chunksZ);
 void clearLightmap();
+void keepTerrain();
+void restoreTerrain();
+void updateTerrainInfo();
+void updateHeight(const size_t x, const size_t z);
+void updateHeightPyramid();
+void discoverCaves(const bool explore);
 void calcBitmapOverdraw(int &left, int &right, int &top, int &bottom);
+void worldToView(const int x, const int z, const int sizeX, const int sizeZ, int &viewX, int &viewZ);
+void setView();
 
 #endif